@@ -2,134 +2,898 @@
 
 #include "Service/AService.hpp"
 #include <stdlib.h>
-#include <map>
 #include <esp_heap_caps.h>
 #include <freertos/task.h>
 #include <esp_timer.h>
 #include "Logging.hpp"
 #include "Helpers.h"
 #include <freertos/FreeRTOSConfig.h>
-#include <string>
+#include <vector>
+#include <mutex>
 #include <Service/ServiceManager.hpp>
+#include "Event/Event.hpp"
+#include <esp_idf_version.h>
+#include <algorithm>
+#include <string.h>
+#include <atomic>
+#include <sdkconfig.h>
+#include "SchedulingProbe.hpp"
+#include "ProfiledMutex.hpp"
+#ifdef _ENABLE_HEAP_PROFILER
+#include "HeapProfiler.hpp"
+#endif
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+#include <esp_debug_helpers.h>
+#include <esp_cpu.h>
+#endif
+
+#ifndef DIAGNOSTICS_REPORT_INTERVAL_MS
+#define DIAGNOSTICS_REPORT_INTERVAL_MS 5000 //How often the diagnostics are logged, CPU usage is sampled every second regardless.
+#endif
+
+#ifndef DIAGNOSTICS_TOP_TASKS
+#define DIAGNOSTICS_TOP_TASKS 5 //The number of tasks included in the logged CPU usage report.
+#endif
+
+#ifndef DIAGNOSTICS_MAX_TASKS
+#define DIAGNOSTICS_MAX_TASKS 32 //Capacity of the per task CPU table, tasks beyond this still count towards the core load but aren't reported individually.
+#endif
+
+#ifndef DIAGNOSTICS_MAX_SERVICES
+#define DIAGNOSTICS_MAX_SERVICES 16 //Capacity of the per service resource table.
+#endif
+
+#ifndef DIAGNOSTICS_TASK_HEADROOM
+#define DIAGNOSTICS_TASK_HEADROOM 4 //Spare slots added when the task snapshot buffer grows, so a few new tasks don't cause another allocation.
+#endif
+
+#ifndef DIAGNOSTICS_ALLOC_FAILED_BACKTRACE_DEPTH
+#define DIAGNOSTICS_ALLOC_FAILED_BACKTRACE_DEPTH 6 //Number of return addresses logged when an allocation fails (Xtensa targets only), decode them with addr2line.
+#endif
+
+#ifndef DIAGNOSTICS_STACK_ALERT_PERCENT
+#define DIAGNOSTICS_STACK_ALERT_PERCENT 90 //OnStackAlert fires when a task has used more than this percentage of its stack, only for tasks whose depth is known.
+#endif
+
+#ifndef DIAGNOSTICS_STACK_ALERT_BYTES
+#define DIAGNOSTICS_STACK_ALERT_BYTES 256 //OnStackAlert fires when a task has less than this many bytes of its stack left.
+#endif
+
+#ifndef DIAGNOSTICS_TOP_LOCKS
+#define DIAGNOSTICS_TOP_LOCKS 5 //The number of locks included in the logged contention report, only used with _ENABLE_MUTEX_PROFILING.
+#endif
+
+#ifndef DIAGNOSTICS_TOP_ALLOCATION_SITES
+#define DIAGNOSTICS_TOP_ALLOCATION_SITES 3 //The number of call sites included in the logged heap profile, only used with _ENABLE_HEAP_PROFILER.
+#endif
+
+#ifndef DIAGNOSTICS_MAX_REGISTERED_STACKS
+#define DIAGNOSTICS_MAX_REGISTERED_STACKS 8 //Capacity of the stack depth registry for tasks that aren't owned by a service.
+#endif
 
 namespace ReadieFur::Diagnostic
 {
+    /// @brief Periodically samples CPU, memory and per service resource usage, and with _ENABLE_SCHEDULING_PROBE how late tasks are woken.
+    /// @note Sampling doesn't allocate once the buffers have grown to fit the running tasks, so it keeps working when the heap is nearly exhausted.
+    /// The first run registers OnAllocFailed with heap_caps_register_failed_alloc_callback, which replaces any callback the application registered and stays in place after the service stops.
     class DiagnosticsService : public ReadieFur::Service::AService
     {
+    public:
+        struct SServiceResourceUsage
+        {
+            const char* name;
+            size_t taskCount;
+            float cpuUsage; //Percentage of the total CPU time (across all cores) used since the previous sample.
+            size_t stackDepth; //Sum of the configured stack depths of all tasks owned by the service.
+            size_t stackFree; //Sum of the stack high water marks of all tasks owned by the service.
+            uint32_t heapAllocations;
+            uint32_t heapFrees;
+            uint32_t heapAllocatedBytes;
+        };
+
+        /// @brief Percentage of a core's time spent outside of its idle task, averaged over the last 1, 10 and 60 seconds.
+        struct SCoreCpuUsage
+        {
+            float load1s;
+            float load10s;
+            float load60s;
+        };
+
+        struct SHeapUsage
+        {
+            const char* name; //The capability, e.g. "INTERNAL".
+            uint32_t caps;
+            size_t totalFree;
+            size_t totalAllocated;
+            size_t largestFreeBlock;
+            size_t minimumFree; //Lowest totalFree has been since boot.
+            size_t allocatedBlocks;
+            size_t freeBlocks;
+            float fragmentation; //Percentage of the free memory that can't be handed out as a single block, 0 when the free memory is contiguous.
+        };
+
+        struct STaskStackUsage
+        {
+            TaskHandle_t handle;
+            char name[configMAX_TASK_NAME_LEN];
+            size_t stackDepth; //The configured depth in bytes, 0 if the task isn't owned by a service or registered with RegisterTaskStack.
+            size_t stackFree; //The stack high water mark in bytes, the least headroom the task has had since it started.
+            float stackUsed; //Percentage of stackDepth that has been used at its peak, 0 if stackDepth isn't known.
+            bool alerted; //Set once OnStackAlert has fired for the task, the high water mark can't recover so it only fires once.
+        };
+
+        struct STaskCpuUsage
+        {
+            TaskHandle_t handle;
+            char name[configMAX_TASK_NAME_LEN];
+            BaseType_t core; //tskNO_AFFINITY if the task isn't pinned.
+            float cpuUsage; //Percentage of a single core used in the last second, so a task that never blocks reads 100.
+            float averageCpuUsage; //cpuUsage smoothed over roughly the last 10 seconds.
+            uint32_t runTime; //Run time counter at the last sample.
+        };
+
     private:
-        static bool GetCpuTime(std::map<BaseType_t, int32_t>& outRecordings)
+        static constexpr uint32_t CPU_SAMPLE_INTERVAL_MS = 1000;
+        static constexpr size_t CPU_WINDOW_SAMPLES = 60;
+        static constexpr float TASK_AVERAGE_ALPHA = 0.1f; //Weight of the newest sample, with one sample a second this has a time constant of ~10s.
+
+        struct SCpuSample
+        {
+            uint32_t busy; //Run time spent outside of the idle task.
+            uint32_t elapsed;
+        };
+
+        struct SHeapCaps
+        {
+            const char* name;
+            uint32_t caps;
+        };
+
+        static constexpr SHeapCaps HEAP_CAPS[] =
+        {
+            { "INTERNAL", MALLOC_CAP_INTERNAL },
+            { "SPIRAM", MALLOC_CAP_SPIRAM },
+            { "DMA", MALLOC_CAP_DMA },
+            { "EXEC", MALLOC_CAP_EXEC },
+            { "32BIT", MALLOC_CAP_32BIT }
+        };
+        static constexpr size_t HEAP_CAPS_COUNT = sizeof(HEAP_CAPS) / sizeof(HEAP_CAPS[0]);
+
+        struct SStackRegistration
+        {
+            TaskHandle_t handle;
+            size_t stackDepth;
+        };
+
+        struct SServiceRunTime
+        {
+            const Service::AService* service;
+            uint32_t runTime;
+        };
+
+        //Snapshot of every task, shared by all of the samplers and only reallocated when the task count outgrows it.
+        TaskStatus_t* _taskStates = nullptr;
+        size_t _taskStatesCapacity = 0;
+        UBaseType_t _taskStateCount = 0;
+        uint32_t _taskStatesRunTime = 0;
+        std::vector<Service::AService::STrackedTask> _trackedTasks; //Cleared rather than freed between services.
+
+        //Each table below is only written by the service's task, so that task reads them without their mutex, which guards the reads from other tasks.
+        ProfiledMutex _cpuUsageMutex{"DiagnosticsService.CpuUsage"};
+        SCpuSample _cpuSamples[configNUM_CORES][CPU_WINDOW_SAMPLES] = {};
+        size_t _cpuSampleIndex = 0; //Where the next sample will be written.
+        size_t _cpuSampleCount = 0;
+        uint32_t _previousIdleRunTimes[configNUM_CORES] = {};
+        uint32_t _previousCpuTotalRunTime = 0;
+        bool _cpuSampled = false;
+        STaskCpuUsage _taskCpuUsage[DIAGNOSTICS_MAX_TASKS];
+        size_t _taskCpuUsageCount = 0;
+
+        ProfiledMutex _heapUsageMutex{"DiagnosticsService.HeapUsage"};
+        SHeapUsage _heapUsage[HEAP_CAPS_COUNT] = {};
+        size_t _heapUsageCount = 0;
+        static std::atomic<uint32_t> _allocFailures;
+        static std::atomic<bool> _allocFailedCallbackRegistered;
+
+        ProfiledMutex _stackUsageMutex{"DiagnosticsService.StackUsage"};
+        STaskStackUsage _taskStackUsage[DIAGNOSTICS_MAX_TASKS]; //Sorted by stackFree, lowest first.
+        size_t _taskStackUsageCount = 0;
+        float _stackAlertPercent = DIAGNOSTICS_STACK_ALERT_PERCENT;
+        size_t _stackAlertBytes = DIAGNOSTICS_STACK_ALERT_BYTES;
+        static ProfiledMutex _registeredStacksMutex;
+        static SStackRegistration _registeredStacks[DIAGNOSTICS_MAX_REGISTERED_STACKS];
+        static size_t _registeredStackCount;
+
+        #ifdef _ENABLE_SCHEDULING_PROBE
+        SchedulingProbe _schedulingProbe;
+        ProfiledMutex _schedulingLatencyMutex{"DiagnosticsService.SchedulingLatency"};
+        SchedulingProbe::SSchedulingLatency _schedulingLatency[SchedulingProbe::CANARIES] = {};
+        #endif
+
+        ProfiledMutex _serviceResourcesMutex{"DiagnosticsService.ServiceResources"};
+        SServiceResourceUsage _serviceResources[DIAGNOSTICS_MAX_SERVICES];
+        size_t _serviceResourceCount = 0;
+        SServiceRunTime _previousServiceRunTimes[DIAGNOSTICS_MAX_SERVICES];
+        size_t _previousServiceRunTimeCount = 0;
+        uint32_t _previousTotalRunTime = 0;
+
+        static TaskHandle_t GetIdleTaskHandle(BaseType_t core)
+        {
+            #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 2, 0)
+            return xTaskGetIdleTaskHandleForCore(core);
+            #else
+            return xTaskGetIdleTaskHandleForCPU(core);
+            #endif
+        }
+
+        /// @brief Refreshes _taskStates, growing it first if there are now more tasks than it can hold.
+        /// @return False if the snapshot couldn't be taken, the previous snapshot is then left untouched.
+        bool SnapshotTasks()
         {
             #if configUSE_TRACE_FACILITY == 1
-            //Get idle time for all CPU cores.
-            UBaseType_t arraySize = uxTaskGetNumberOfTasks();
-            TaskStatus_t* tasksArray = (TaskStatus_t*)malloc(arraySize * sizeof(TaskStatus_t));
+            UBaseType_t taskCount = uxTaskGetNumberOfTasks();
+            if (taskCount > _taskStatesCapacity)
+            {
+                //Keep the old buffer if this fails, the snapshot below then fails and this is retried on the next sample.
+                size_t capacity = taskCount + DIAGNOSTICS_TASK_HEADROOM;
+                TaskStatus_t* taskStates = (TaskStatus_t*)malloc(capacity * sizeof(TaskStatus_t));
+                if (taskStates != nullptr)
+                {
+                    free(_taskStates);
+                    _taskStates = taskStates;
+                    _taskStatesCapacity = capacity;
+                }
+            }
 
-            if (tasksArray == nullptr)
+            if (_taskStates == nullptr)
                 return false;
 
-            arraySize = uxTaskGetSystemState(tasksArray, arraySize, NULL);
-            for (int i = 0; i < arraySize; i++)
-                if (strcmp(tasksArray[i].pcTaskName, "IDLE") == 0)
-                    outRecordings[tasksArray[i].xTaskNumber] = tasksArray[i].ulRunTimeCounter;
+            //Returns 0 if tasks were created since the count was read and they no longer fit.
+            uint32_t totalRunTime = 0;
+            UBaseType_t count = uxTaskGetSystemState(_taskStates, _taskStatesCapacity, &totalRunTime);
+            if (count == 0)
+                return false;
 
-            free(tasksArray);
+            _taskStateCount = count;
+            _taskStatesRunTime = totalRunTime;
             return true;
-            #elif INCLUDE_xTaskGetIdleTaskHandle == 1 && false
+            #else
+            return false;
+            #endif
+        }
+
+        /// @brief Sums the CPU samples from the most recent window.
+        float GetCoreLoad(size_t core, size_t samples)
+        {
+            samples = std::min(samples, _cpuSampleCount);
+            uint64_t busy = 0, elapsed = 0;
+            for (size_t i = 1; i <= samples; i++)
+            {
+                const SCpuSample& sample = _cpuSamples[core][(_cpuSampleIndex + CPU_WINDOW_SAMPLES - i) % CPU_WINDOW_SAMPLES];
+                busy += sample.busy;
+                elapsed += sample.elapsed;
+            }
+            return elapsed == 0 ? 0 : busy * 100.0f / elapsed;
+        }
+
+        /// @brief Records the run time used by each core and task between the previous snapshot and the current one.
+        bool SampleCpuUsage()
+        {
+            #if configUSE_TRACE_FACILITY == 1 && configGENERATE_RUN_TIME_STATS == 1
+            //The run time counter is the elapsed time of a single core, the unsigned subtractions below handle it wrapping.
+            uint32_t elapsed = _taskStatesRunTime - _previousCpuTotalRunTime;
+            _previousCpuTotalRunTime = _taskStatesRunTime;
+
+            TaskHandle_t idleHandles[configNUM_CORES];
             for (size_t i = 0; i < configNUM_CORES; i++)
+                idleHandles[i] = GetIdleTaskHandle(i);
+
+            std::lock_guard<ProfiledMutex> lock(_cpuUsageMutex);
+            bool seen[DIAGNOSTICS_MAX_TASKS] = {};
+            for (UBaseType_t i = 0; i < _taskStateCount; i++)
             {
-                TaskHandle_t handle = xTaskGetIdleTaskHandleForCPU(i);
-                if (handle == NULL)
+                const TaskStatus_t& task = _taskStates[i];
+
+                for (size_t core = 0; core < configNUM_CORES; core++)
                 {
-                    outRecordings[0] = -1;
-                    continue;
+                    if (task.xHandle != idleHandles[core])
+                        continue;
+
+                    uint32_t idle = task.ulRunTimeCounter - _previousIdleRunTimes[core];
+                    _previousIdleRunTimes[core] = task.ulRunTimeCounter;
+                    if (_cpuSampled)
+                        _cpuSamples[core][_cpuSampleIndex] = { .busy = elapsed - std::min(idle, elapsed), .elapsed = elapsed };
                 }
-                return false;
+
+                size_t index = 0;
+                while (index < _taskCpuUsageCount && _taskCpuUsage[index].handle != task.xHandle)
+                    index++;
+
+                //A handle whose counter went backwards belongs to a new task that reused the memory of a deleted one.
+                bool previouslySeen = index < _taskCpuUsageCount && task.ulRunTimeCounter >= _taskCpuUsage[index].runTime;
+                if (index == _taskCpuUsageCount)
+                {
+                    if (_taskCpuUsageCount == DIAGNOSTICS_MAX_TASKS)
+                        continue;
+                    _taskCpuUsageCount++;
+                }
+
+                STaskCpuUsage& usage = _taskCpuUsage[index];
+                //Tasks that weren't seen in the previous sample started within it so their whole run time counts.
+                uint32_t previousRunTime = previouslySeen ? usage.runTime : 0;
+                if (!previouslySeen)
+                {
+                    usage.handle = task.xHandle;
+                    //Copied as the name lives in the task's TCB which is freed if the task is deleted.
+                    strncpy(usage.name, task.pcTaskName, sizeof(usage.name) - 1);
+                    usage.name[sizeof(usage.name) - 1] = '\0';
+                    #if configTASKLIST_INCLUDE_COREID == 1
+                    usage.core = task.xCoreID;
+                    #else
+                    usage.core = xTaskGetCoreID(task.xHandle);
+                    #endif
+                }
+
+                usage.cpuUsage = 0;
+                if (_cpuSampled && elapsed > 0)
+                    usage.cpuUsage = std::min((task.ulRunTimeCounter - previousRunTime) * 100.0f / elapsed, 100.0f);
+                usage.averageCpuUsage = previouslySeen
+                    ? usage.averageCpuUsage + TASK_AVERAGE_ALPHA * (usage.cpuUsage - usage.averageCpuUsage)
+                    : usage.cpuUsage;
+                usage.runTime = task.ulRunTimeCounter;
+                seen[index] = true;
             }
-            #elif configGENERATE_RUN_TIME_STATS == 1 && configUSE_STATS_FORMATTING_FUNCTIONS == 1
-            ulTaskGetIdleRunTimeCounter()
-            return false;
+
+            //Drop the tasks that have been deleted.
+            size_t kept = 0;
+            for (size_t i = 0; i < _taskCpuUsageCount; i++)
+                if (seen[i])
+                    _taskCpuUsage[kept++] = _taskCpuUsage[i];
+            _taskCpuUsageCount = kept;
+
+            //The first call only establishes the baseline.
+            if (_cpuSampled)
+            {
+                _cpuSampleIndex = (_cpuSampleIndex + 1) % CPU_WINDOW_SAMPLES;
+                _cpuSampleCount = std::min(_cpuSampleCount + 1, CPU_WINDOW_SAMPLES);
+            }
+            _cpuSampled = true;
+            return true;
             #else
             return false;
             #endif
         }
 
-        static void GetFreeMemory(size_t& outIram, size_t& outDram)
+        /// @brief Records the usage of each heap capability, capabilities that the chip (or its configuration) doesn't have are skipped.
+        void SampleHeapUsage()
+        {
+            std::lock_guard<ProfiledMutex> lock(_heapUsageMutex);
+            _heapUsageCount = 0;
+            for (size_t i = 0; i < HEAP_CAPS_COUNT; i++)
+            {
+                multi_heap_info_t info;
+                heap_caps_get_info(&info, HEAP_CAPS[i].caps);
+                if (info.total_free_bytes + info.total_allocated_bytes == 0)
+                    continue;
+
+                _heapUsage[_heapUsageCount++] =
+                {
+                    .name = HEAP_CAPS[i].name,
+                    .caps = HEAP_CAPS[i].caps,
+                    .totalFree = info.total_free_bytes,
+                    .totalAllocated = info.total_allocated_bytes,
+                    .largestFreeBlock = info.largest_free_block,
+                    .minimumFree = info.minimum_free_bytes,
+                    .allocatedBlocks = info.allocated_blocks,
+                    .freeBlocks = info.free_blocks,
+                    .fragmentation = info.total_free_bytes == 0 ? 0 : (1.0f - (float)info.largest_free_block / info.total_free_bytes) * 100.0f
+                };
+            }
+        }
+
+        static void OnAllocFailed(size_t size, uint32_t caps, const char* functionName)
+        {
+            _allocFailures.fetch_add(1, std::memory_order_relaxed);
+
+            //The sinks and stdio take locks, so failures from an ISR are only counted.
+            if (xPortInIsrContext())
+                return;
+
+            //Logging doesn't allocate so it is safe here, the backtrace is formatted on the stack for the same reason.
+            char backtrace[DIAGNOSTICS_ALLOC_FAILED_BACKTRACE_DEPTH * 11 + 1] = {};
+            #if CONFIG_IDF_TARGET_ARCH_XTENSA
+            esp_backtrace_frame_t frame = {};
+            esp_backtrace_get_start(&frame.pc, &frame.sp, &frame.next_pc);
+            size_t length = 0;
+            //Skip this callback's own frame, the rest run from the heap function up through its caller.
+            for (size_t i = 0; i <= DIAGNOSTICS_ALLOC_FAILED_BACKTRACE_DEPTH && frame.next_pc != 0 && esp_backtrace_get_next_frame(&frame); i++)
+                if (i > 0)
+                    length += snprintf(backtrace + length, sizeof(backtrace) - length, " 0x%08lx", (unsigned long)esp_cpu_process_stack_pc(frame.pc));
+            #endif
+
+            LOGE(nameof(DiagnosticsService), "%s failed to allocate %u bytes with caps 0x%08lx, largest free block: %u, backtrace:%s",
+                functionName, size, (unsigned long)caps, heap_caps_get_largest_free_block(caps), backtrace[0] == '\0' ? " unavailable" : backtrace);
+        }
+
+        /// @return The configured stack depth of the task in bytes, or 0 if it isn't known.
+        size_t GetStackDepth(TaskHandle_t handle)
         {
-            outIram = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
-            outDram = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+            for (auto &&trackedTask : _trackedTasks)
+                if (trackedTask.handle == handle)
+                    return trackedTask.stackDepth;
+
+            std::lock_guard<ProfiledMutex> lock(_registeredStacksMutex);
+            for (size_t i = 0; i < _registeredStackCount; i++)
+                if (_registeredStacks[i].handle == handle)
+                    return _registeredStacks[i].stackDepth;
+            return 0;
         }
 
-        static bool GetTasksFreeStack(std::map<const char*, size_t>& outRecordings)
+        /// @brief Refreshes the stack table from the current snapshot and fires OnStackAlert for tasks that have crossed a threshold.
+        bool SampleStackUsage()
         {
             #if configUSE_TRACE_FACILITY == 1
-            UBaseType_t arraySize = uxTaskGetNumberOfTasks();
-            TaskStatus_t* tasksArray = (TaskStatus_t*)malloc(arraySize * sizeof(TaskStatus_t));
+            //Gather the depths of every task owned by a service up front so the service manager isn't held while the table is updated.
+            _trackedTasks.clear();
+            Service::ServiceManager::_mutex.lock();
+            for (auto &&kvp : Service::ServiceManager::_services)
+                kvp.second->GetTrackedTasks(_trackedTasks);
+            Service::ServiceManager::_mutex.unlock();
 
-            if (tasksArray == nullptr)
-                return false;
+            STaskStackUsage alerts[DIAGNOSTICS_TOP_TASKS];
+            size_t alertCount = 0;
+
+            _stackUsageMutex.lock();
+            bool seen[DIAGNOSTICS_MAX_TASKS] = {};
+            for (UBaseType_t i = 0; i < _taskStateCount; i++)
+            {
+                const TaskStatus_t& task = _taskStates[i];
+
+                size_t index = 0;
+                while (index < _taskStackUsageCount && _taskStackUsage[index].handle != task.xHandle)
+                    index++;
+
+                size_t stackFree = task.usStackHighWaterMark * sizeof(StackType_t);
+                //The high water mark never rises for a running task, if it has then the handle belongs to a new task.
+                bool previouslySeen = index < _taskStackUsageCount && stackFree <= _taskStackUsage[index].stackFree;
+                if (index == _taskStackUsageCount)
+                {
+                    if (_taskStackUsageCount == DIAGNOSTICS_MAX_TASKS)
+                        continue;
+                    _taskStackUsageCount++;
+                }
+
+                STaskStackUsage& usage = _taskStackUsage[index];
+                if (!previouslySeen)
+                {
+                    usage.handle = task.xHandle;
+                    strncpy(usage.name, task.pcTaskName, sizeof(usage.name) - 1);
+                    usage.name[sizeof(usage.name) - 1] = '\0';
+                    usage.alerted = false;
+                }
+                usage.stackDepth = GetStackDepth(task.xHandle);
+                usage.stackFree = stackFree;
+                usage.stackUsed = usage.stackDepth == 0 || stackFree > usage.stackDepth ? 0 : (usage.stackDepth - stackFree) * 100.0f / usage.stackDepth;
+                seen[index] = true;
+
+                if (!usage.alerted && (usage.stackFree < _stackAlertBytes || usage.stackUsed > _stackAlertPercent))
+                {
+                    usage.alerted = true;
+                    if (alertCount < DIAGNOSTICS_TOP_TASKS)
+                        alerts[alertCount++] = usage;
+                }
+            }
+
+            //Drop the tasks that have been deleted and sort what's left by headroom.
+            size_t kept = 0;
+            for (size_t i = 0; i < _taskStackUsageCount; i++)
+            {
+                if (!seen[i])
+                    continue;
+
+                STaskStackUsage usage = _taskStackUsage[i];
+                size_t position = kept++;
+                while (position > 0 && _taskStackUsage[position - 1].stackFree > usage.stackFree)
+                {
+                    _taskStackUsage[position] = _taskStackUsage[position - 1];
+                    position--;
+                }
+                _taskStackUsage[position] = usage;
+            }
+            _taskStackUsageCount = kept;
+            _stackUsageMutex.unlock();
 
-            //Get system state (task status).
-            UBaseType_t totalTasks = uxTaskGetSystemState(tasksArray, arraySize, NULL);
+            //Registrations for tasks that no longer exist would otherwise be picked up by a new task that reuses the handle.
+            _registeredStacksMutex.lock();
+            size_t registered = 0;
+            for (size_t i = 0; i < _registeredStackCount; i++)
+            {
+                bool exists = false;
+                for (UBaseType_t j = 0; j < _taskStateCount && !exists; j++)
+                    exists = _taskStates[j].xHandle == _registeredStacks[i].handle;
+                if (exists)
+                    _registeredStacks[registered++] = _registeredStacks[i];
+            }
+            _registeredStackCount = registered;
+            _registeredStacksMutex.unlock();
+
+            //Dispatched without any locks held so the handlers are free to call back into the service.
+            for (size_t i = 0; i < alertCount; i++)
+            {
+                if (alerts[i].stackDepth == 0)
+                    LOGW(nameof(DiagnosticsService), "Task %s is low on stack: %u bytes free", alerts[i].name, alerts[i].stackFree);
+                else
+                    LOGW(nameof(DiagnosticsService), "Task %s is low on stack: %u bytes free (%.0f%% of %u used)",
+                        alerts[i].name, alerts[i].stackFree, alerts[i].stackUsed, alerts[i].stackDepth);
+                OnStackAlert.Dispatch(alerts[i]);
+            }
+            return true;
+            #else
+            return false;
+            #endif
+        }
+
+        bool SampleServiceResources()
+        {
+            #if configUSE_TRACE_FACILITY == 1 && configGENERATE_RUN_TIME_STATS == 1
+            //The total run time is the elapsed time for a single core, so scale it to cover all cores.
+            uint64_t elapsedRunTime = (uint64_t)(_taskStatesRunTime - _previousTotalRunTime) * configNUM_CORES;
+            _previousTotalRunTime = _taskStatesRunTime;
+
+            SServiceRunTime runTimes[DIAGNOSTICS_MAX_SERVICES];
+            size_t serviceCount = 0;
+
+            Service::ServiceManager::_mutex.lock();
+            _serviceResourcesMutex.lock();
+            for (auto &&kvp : Service::ServiceManager::_services)
+            {
+                if (serviceCount == DIAGNOSTICS_MAX_SERVICES)
+                    break;
 
-            //Print free stack space for each task.
-            for (UBaseType_t i = 0; i < totalTasks; i++)
-                outRecordings[tasksArray[i].pcTaskName] = tasksArray[i].usStackHighWaterMark * sizeof(StackType_t);
+                Service::AService* service = kvp.second;
+                SServiceResourceUsage& usage = _serviceResources[serviceCount];
+                usage =
+                {
+                    .name = service->GetServiceName(),
+                    .taskCount = 0,
+                    .cpuUsage = 0,
+                    .stackDepth = 0,
+                    .stackFree = 0,
+                    .heapAllocations = service->_resources.heapAllocations.load(std::memory_order_relaxed),
+                    .heapFrees = service->_resources.heapFrees.load(std::memory_order_relaxed),
+                    .heapAllocatedBytes = service->_resources.heapAllocatedBytes.load(std::memory_order_relaxed)
+                };
+
+                _trackedTasks.clear();
+                service->GetTrackedTasks(_trackedTasks);
+
+                uint32_t runTime = 0;
+                for (auto &&trackedTask : _trackedTasks)
+                {
+                    for (UBaseType_t i = 0; i < _taskStateCount; i++)
+                    {
+                        if (_taskStates[i].xHandle != trackedTask.handle)
+                            continue;
+
+                        usage.taskCount++;
+                        usage.stackDepth += trackedTask.stackDepth;
+                        usage.stackFree += _taskStates[i].usStackHighWaterMark * sizeof(StackType_t);
+                        runTime += _taskStates[i].ulRunTimeCounter;
+                        break;
+                    }
+                }
+
+                uint32_t previousRunTime = 0;
+                for (size_t i = 0; i < _previousServiceRunTimeCount; i++)
+                {
+                    if (_previousServiceRunTimes[i].service == service)
+                    {
+                        previousRunTime = _previousServiceRunTimes[i].runTime;
+                        break;
+                    }
+                }
+
+                //The summed run time can go backwards when a child task ends, treat that sample as idle.
+                if (elapsedRunTime > 0 && runTime >= previousRunTime)
+                    usage.cpuUsage = (runTime - previousRunTime) * 100.0f / elapsedRunTime;
+                runTimes[serviceCount++] = { .service = service, .runTime = runTime };
+            }
+            _serviceResourceCount = serviceCount;
+            _serviceResourcesMutex.unlock();
+            Service::ServiceManager::_mutex.unlock();
 
-            //Free allocated memory for taskStatusArray.
-            free(tasksArray);
+            std::copy(runTimes, runTimes + serviceCount, _previousServiceRunTimes);
+            _previousServiceRunTimeCount = serviceCount;
             return true;
             #else
-            // auto a = ReadieFur::Service::ServiceManager::_services;
             return false;
             #endif
         }
 
+        void SampleSchedulingLatency()
+        {
+            #ifdef _ENABLE_SCHEDULING_PROBE
+            _schedulingLatencyMutex.lock();
+            _schedulingProbe.Sample(_schedulingLatency);
+            _schedulingLatencyMutex.unlock();
+            #endif
+        }
+
     protected:
         void RunServiceImpl() override
         {
+            //Only one callback can be registered with the IDF, so this is left in place if the service is stopped.
+            if (!_allocFailedCallbackRegistered.exchange(true))
+                heap_caps_register_failed_alloc_callback(&OnAllocFailed);
+
+            #ifdef _ENABLE_SCHEDULING_PROBE
+            //Owned by this service so that they stop with it and their CPU time is attributed to it.
+            _schedulingProbe.Start(ServiceCancellationToken, [this](TaskFunction_t function, const char* name, uint32_t stackDepth, void* param, UBaseType_t priority, int core)
+            {
+                return CreateServiceTask(function, name, stackDepth, param, priority, nullptr, core);
+            });
+            #endif
+
+            TickType_t lastReport = xTaskGetTickCount();
             while (!ServiceCancellationToken.IsCancellationRequested())
             {
-                std::map<BaseType_t, int32_t> cpuRecordings;
-                if (GetCpuTime(cpuRecordings))
+                vTaskDelay(pdMS_TO_TICKS(CPU_SAMPLE_INTERVAL_MS));
+
+                bool snapshotTaken = SnapshotTasks();
+                bool cpuSampled = snapshotTaken && SampleCpuUsage();
+                //Checked every sample so that a task nearing overflow is caught as early as possible.
+                bool stackSampled = snapshotTaken && SampleStackUsage();
+
+                if (xTaskGetTickCount() - lastReport < pdMS_TO_TICKS(DIAGNOSTICS_REPORT_INTERVAL_MS))
+                    continue;
+                lastReport = xTaskGetTickCount();
+
+                if (cpuSampled)
                 {
-                    std::string cpuLogString;
-                    for (auto &&recording : cpuRecordings)
+                    for (size_t i = 0; i < configNUM_CORES; i++)
+                    {
+                        SCoreCpuUsage usage = GetCoreCpuUsage(i);
+                        LOGD(nameof(DiagnosticsService), "CPU%u: %.1f%% (1s), %.1f%% (10s), %.1f%% (60s)", i, usage.load1s, usage.load10s, usage.load60s);
+                    }
+
+                    STaskCpuUsage topTasks[DIAGNOSTICS_TOP_TASKS];
+                    size_t topTaskCount = GetTopTasks(topTasks, DIAGNOSTICS_TOP_TASKS);
+                    for (size_t i = 0; i < topTaskCount; i++)
                     {
-                        cpuLogString += "CPU";
-                        cpuLogString += recording.first;
-                        cpuLogString += ": ";
-                        cpuLogString += recording.second;
-                        cpuLogString += ", ";
+                        const STaskCpuUsage& task = topTasks[i];
+                        LOGD(nameof(DiagnosticsService), "Task %s (core %d): %.1f%%, average: %.1f%%",
+                            task.name, task.core == tskNO_AFFINITY ? -1 : (int)task.core, task.cpuUsage, task.averageCpuUsage);
                     }
-                    //Remove trailing comma and space if they exist.
-                    // if (cpuLogString.ends_with(", "))
-                    //     cpuLogString = cpuLogString.substr(0, cpuLogString.length() - 2);
-                    cpuRecordings.clear();
-                    LOGD(nameof(DiagnosticsService), "%s", cpuLogString.c_str());
-                    cpuLogString.clear();
                 }
 
-                size_t iram, dram;
-                GetFreeMemory(iram, dram);
-                LOGD(nameof(DiagnosticsService), "Memory free: IRAM: %u, DRAM: %u", iram, dram);
+                if (stackSampled)
+                {
+                    for (size_t i = 0; i < _taskStackUsageCount && i < DIAGNOSTICS_TOP_TASKS; i++)
+                    {
+                        const STaskStackUsage& usage = _taskStackUsage[i];
+                        if (usage.stackDepth == 0)
+                            LOGD(nameof(DiagnosticsService), "Stack %s: %u bytes free", usage.name, usage.stackFree);
+                        else
+                            LOGD(nameof(DiagnosticsService), "Stack %s: %u bytes free, %u/%u used (%.0f%%)",
+                                usage.name, usage.stackFree, usage.stackDepth - usage.stackFree, usage.stackDepth, usage.stackUsed);
+                    }
+                }
+
+                SampleHeapUsage();
+                for (size_t i = 0; i < _heapUsageCount; i++)
+                {
+                    const SHeapUsage& usage = _heapUsage[i];
+                    LOGD(nameof(DiagnosticsService), "Heap %s: Free: %u (min %u), Largest block: %u, Fragmentation: %.1f%%, Blocks: %u allocated, %u free",
+                        usage.name, usage.totalFree, usage.minimumFree, usage.largestFreeBlock, usage.fragmentation, usage.allocatedBlocks, usage.freeBlocks);
+                }
+                if (uint32_t allocFailures = _allocFailures.load(std::memory_order_relaxed); allocFailures > 0)
+                    LOGD(nameof(DiagnosticsService), "Allocation failures: %u", allocFailures);
 
-                std::map<const char*, size_t> taskRecordings;
-                if (GetTasksFreeStack(taskRecordings))
+                #ifdef _ENABLE_HEAP_PROFILER
+                if (HeapProfiler::IsRunning())
                 {
-                    std::string tasksLogString;
-                    for (auto &&recording : taskRecordings)
+                    HeapProfiler::SAllocationSite sites[DIAGNOSTICS_TOP_ALLOCATION_SITES];
+                    size_t siteCount = HeapProfiler::GetTopSites(sites, DIAGNOSTICS_TOP_ALLOCATION_SITES);
+                    for (size_t i = 0; i < siteCount; i++)
                     {
+                        //Only the allocator's caller is logged, HeapProfiler::WriteProfile has the full backtrace.
+                        const HeapProfiler::SAllocationSite& site = sites[i];
+                        LOGD(nameof(DiagnosticsService), "Heap site 0x%08lx (%s): Live: ~%u bytes in ~%u allocs, Allocated: ~%llu bytes in ~%u allocs",
+                            (unsigned long)site.pcs[0], site.service[0] == '\0' ? "no service" : site.service, site.liveBytes, site.liveAllocations,
+                            (unsigned long long)site.allocatedBytes, site.allocations);
                     }
                 }
+                #endif
 
-                vTaskDelay(pdMS_TO_TICKS(5 * 1000));
+                #ifdef _ENABLE_MUTEX_PROFILING
+                SMutexStats locks[DIAGNOSTICS_TOP_LOCKS];
+                size_t lockCount = ProfiledMutex::GetStats(locks, DIAGNOSTICS_TOP_LOCKS);
+                for (size_t i = 0; i < lockCount; i++)
+                {
+                    const SMutexStats& lock = locks[i];
+                    LOGD(nameof(DiagnosticsService), "Lock %s: Acquisitions: %u, Contended: %u, Wait: %uus (max %uus), Max hold: %uus",
+                        lock.name, lock.acquisitions, lock.contentions, lock.totalWaitUs, lock.maxWaitUs, lock.maxHoldUs);
+                }
+                #endif
+
+                #ifdef _ENABLE_SCHEDULING_PROBE
+                SampleSchedulingLatency();
+                for (size_t i = 0; i < SchedulingProbe::CANARIES; i++)
+                {
+                    const SchedulingProbe::SSchedulingLatency& latency = _schedulingLatency[i];
+                    LOGD(nameof(DiagnosticsService), "Wake latency core %d priority %u: Average: %uus, p50: %uus, p99: %uus, Max: %uus, Jitter: %uus (%u samples)",
+                        latency.core, latency.priority, latency.averageUs, latency.p50Us, latency.p99Us, latency.maxUs, latency.jitterUs, latency.samples);
+                }
+                #endif
+
+                if (snapshotTaken && SampleServiceResources())
+                {
+                    for (size_t i = 0; i < _serviceResourceCount; i++)
+                    {
+                        const SServiceResourceUsage& recording = _serviceResources[i];
+                        LOGD(nameof(DiagnosticsService), "%s: Tasks: %u, CPU: %.1f%%, Stack free: %u/%u, Heap allocs: %u, frees: %u, bytes: %u",
+                            recording.name, recording.taskCount, recording.cpuUsage, recording.stackFree, recording.stackDepth,
+                            recording.heapAllocations, recording.heapFrees, recording.heapAllocatedBytes);
+                    }
+                }
             }
         }
-    
+
     public:
+        /// @brief Fired from the diagnostics task the first time a task's stack crosses one of the alert thresholds.
+        Event::Event<const STaskStackUsage&> OnStackAlert;
+
         DiagnosticsService()
         {
             ServiceEntrypointStackDepth += 1024;
         }
+
+        ~DiagnosticsService()
+        {
+            free(_taskStates);
+        }
+
+        /// @brief Gets the per-service resource table from the most recent sample.
+        void GetServiceResources(std::vector<SServiceResourceUsage>& outRecordings)
+        {
+            _serviceResourcesMutex.lock();
+            outRecordings.assign(_serviceResources, _serviceResources + _serviceResourceCount);
+            _serviceResourcesMutex.unlock();
+        }
+
+        /// @brief Copies up to capacity entries of the per-service resource table from the most recent sample.
+        /// @return The number of entries copied.
+        size_t GetServiceResources(SServiceResourceUsage* outRecordings, size_t capacity)
+        {
+            _serviceResourcesMutex.lock();
+            size_t count = std::min(capacity, _serviceResourceCount);
+            std::copy(_serviceResources, _serviceResources + count, outRecordings);
+            _serviceResourcesMutex.unlock();
+            return count;
+        }
+
+        /// @brief Copies up to capacity entries of the stack table from the most recent sample, lowest headroom first.
+        /// @return The number of entries copied.
+        size_t GetStackUsage(STaskStackUsage* outUsage, size_t capacity)
+        {
+            std::lock_guard<ProfiledMutex> lock(_stackUsageMutex);
+            size_t count = std::min(capacity, _taskStackUsageCount);
+            std::copy(_taskStackUsage, _taskStackUsage + count, outUsage);
+            return count;
+        }
+
+        /// @brief Sets when OnStackAlert fires, whichever threshold is crossed first triggers the alert.
+        /// @param percentUsed Percentage of the configured depth, only applies to tasks whose depth is known.
+        /// @param minimumFreeBytes Headroom in bytes, applies to every task.
+        void SetStackAlertThresholds(float percentUsed, size_t minimumFreeBytes)
+        {
+            std::lock_guard<ProfiledMutex> lock(_stackUsageMutex);
+            _stackAlertPercent = percentUsed;
+            _stackAlertBytes = minimumFreeBytes;
+        }
+
+        /// @brief Records the stack depth of a task that wasn't created through a service so that its usage can be reported as a percentage.
+        /// @param stackDepth In bytes, as passed to xTaskCreate.
+        /// @return False if DIAGNOSTICS_MAX_REGISTERED_STACKS tasks are already registered.
+        static bool RegisterTaskStack(TaskHandle_t handle, size_t stackDepth)
+        {
+            std::lock_guard<ProfiledMutex> lock(_registeredStacksMutex);
+            for (size_t i = 0; i < _registeredStackCount; i++)
+            {
+                if (_registeredStacks[i].handle == handle)
+                {
+                    _registeredStacks[i].stackDepth = stackDepth;
+                    return true;
+                }
+            }
+
+            if (_registeredStackCount == DIAGNOSTICS_MAX_REGISTERED_STACKS)
+                return false;
+            _registeredStacks[_registeredStackCount++] = { .handle = handle, .stackDepth = stackDepth };
+            return true;
+        }
+
+        /// @brief Copies up to capacity entries of the per capability heap table from the most recent sample.
+        /// @return The number of entries copied.
+        size_t GetHeapUsage(SHeapUsage* outUsage, size_t capacity)
+        {
+            std::lock_guard<ProfiledMutex> lock(_heapUsageMutex);
+            size_t count = std::min(capacity, _heapUsageCount);
+            std::copy(_heapUsage, _heapUsage + count, outUsage);
+            return count;
+        }
+
+        /// @brief Copies up to capacity entries of the scheduling latency table, one per canary, covering the most recent report interval.
+        /// @return The number of entries copied, always 0 unless _ENABLE_SCHEDULING_PROBE is defined.
+        size_t GetSchedulingLatency(SchedulingProbe::SSchedulingLatency* outLatency, size_t capacity)
+        {
+            #ifdef _ENABLE_SCHEDULING_PROBE
+            std::lock_guard<ProfiledMutex> lock(_schedulingLatencyMutex);
+            size_t count = std::min(capacity, SchedulingProbe::CANARIES);
+            std::copy(_schedulingLatency, _schedulingLatency + count, outLatency);
+            return count;
+            #else
+            return 0;
+            #endif
+        }
+
+        /// @brief The number of allocations that have failed since the service first started.
+        static uint32_t GetAllocFailures()
+        {
+            return _allocFailures.load(std::memory_order_relaxed);
+        }
+
+        /// @brief Gets the load of a core, windows that haven't been filled yet average over the samples taken so far.
+        SCoreCpuUsage GetCoreCpuUsage(size_t core)
+        {
+            if (core >= configNUM_CORES)
+                return {};
+
+            std::lock_guard<ProfiledMutex> lock(_cpuUsageMutex);
+            return SCoreCpuUsage
+            {
+                .load1s = GetCoreLoad(core, 1),
+                .load10s = GetCoreLoad(core, 10),
+                .load60s = GetCoreLoad(core, 60)
+            };
+        }
+
+        /// @brief Gets the tasks with the highest averageCpuUsage, busiest first. The idle tasks are left out, see GetCoreCpuUsage for those.
+        /// @return The number of entries written to outTasks.
+        size_t GetTopTasks(STaskCpuUsage* outTasks, size_t count)
+        {
+            TaskHandle_t idleHandles[configNUM_CORES];
+            for (size_t i = 0; i < configNUM_CORES; i++)
+                idleHandles[i] = GetIdleTaskHandle(i);
+
+            std::lock_guard<ProfiledMutex> lock(_cpuUsageMutex);
+            size_t found = 0;
+            for (size_t i = 0; i < _taskCpuUsageCount; i++)
+            {
+                const STaskCpuUsage& task = _taskCpuUsage[i];
+                if (std::find(idleHandles, idleHandles + configNUM_CORES, task.handle) != idleHandles + configNUM_CORES)
+                    continue;
+
+                //Insertion into the sorted output, the table is small enough that this beats sorting a copy.
+                size_t position = found;
+                while (position > 0 && outTasks[position - 1].averageCpuUsage < task.averageCpuUsage)
+                {
+                    if (position < count)
+                        outTasks[position] = outTasks[position - 1];
+                    position--;
+                }
+                if (position < count)
+                    outTasks[position] = task;
+                if (found < count)
+                    found++;
+            }
+            return found;
+        }
     };
 };
+
+std::atomic<uint32_t> ReadieFur::Diagnostic::DiagnosticsService::_allocFailures = 0;
+std::atomic<bool> ReadieFur::Diagnostic::DiagnosticsService::_allocFailedCallbackRegistered = false;
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Diagnostic::DiagnosticsService::_registeredStacksMutex("DiagnosticsService.RegisteredStacks");
+ReadieFur::Diagnostic::DiagnosticsService::SStackRegistration ReadieFur::Diagnostic::DiagnosticsService::_registeredStacks[DIAGNOSTICS_MAX_REGISTERED_STACKS];
+size_t ReadieFur::Diagnostic::DiagnosticsService::_registeredStackCount = 0;
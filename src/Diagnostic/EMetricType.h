@@ -0,0 +1,11 @@
+#pragma once
+
+namespace ReadieFur::Diagnostic
+{
+    enum EMetricType
+    {
+        Metric_Counter,
+        Metric_Gauge,
+        Metric_Histogram
+    };
+};
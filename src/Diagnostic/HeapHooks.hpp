@@ -0,0 +1,75 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_heap_caps.h>
+#include <esp_attr.h>
+#include "Service/SServiceResources.h"
+#ifdef _ENABLE_HEAP_PROFILER
+#include "HeapProfiler.hpp"
+#endif
+
+#ifndef CONFIG_HEAP_USE_HOOKS
+#error "Heap hooks require CONFIG_HEAP_USE_HOOKS to be enabled in the sdkconfig."
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    //The IDF only allows for a single definition of each hook, so every consumer of the heap hooks is dispatched from here.
+    class HeapHooks
+    {
+    private:
+        HeapHooks() {}
+
+        static inline Service::SServiceResources* GetCurrentServiceResources()
+        {
+            //Allocations can happen before the scheduler has started or from an ISR, neither of which belong to a service.
+            if (xPortInIsrContext() || xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED)
+                return nullptr;
+            return reinterpret_cast<Service::SServiceResources*>(pvTaskGetThreadLocalStoragePointer(NULL, SERVICE_TLS_INDEX));
+        }
+
+    public:
+        static inline void OnAlloc(void* ptr, size_t size, uint32_t caps)
+        {
+            #ifdef _ENABLE_SERVICE_HEAP_ACCOUNTING
+            Service::SServiceResources* resources = GetCurrentServiceResources();
+            if (resources != nullptr)
+            {
+                resources->heapAllocations.fetch_add(1, std::memory_order_relaxed);
+                resources->heapAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+            }
+            #endif
+
+            #ifdef _ENABLE_HEAP_PROFILER
+            //The service is only looked up for the allocations that are sampled.
+            if (int core = HeapProfiler::ShouldSample(size); core != -1)
+                HeapProfiler::Sample(core, ptr, size, GetCurrentServiceResources());
+            #endif
+        }
+
+        static inline void OnFree(void* ptr)
+        {
+            #ifdef _ENABLE_SERVICE_HEAP_ACCOUNTING
+            //The free hook is called after the block has been released so the size is no longer available, only the count can be attributed.
+            Service::SServiceResources* resources = GetCurrentServiceResources();
+            if (resources != nullptr)
+                resources->heapFrees.fetch_add(1, std::memory_order_relaxed);
+            #endif
+
+            #ifdef _ENABLE_HEAP_PROFILER
+            HeapProfiler::OnFree(ptr);
+            #endif
+        }
+    };
+};
+
+extern "C" IRAM_ATTR void esp_heap_trace_alloc_hook(void* ptr, size_t size, uint32_t caps)
+{
+    ReadieFur::Diagnostic::HeapHooks::OnAlloc(ptr, size, caps);
+}
+
+extern "C" IRAM_ATTR void esp_heap_trace_free_hook(void* ptr)
+{
+    ReadieFur::Diagnostic::HeapHooks::OnFree(ptr);
+}
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "Service/SServiceResources.h"
+#if CONFIG_IDF_TARGET_ARCH_XTENSA
+#include <esp_debug_helpers.h>
+#include <esp_cpu.h>
+#endif
+
+#ifndef HEAP_PROFILER_SAMPLE_INTERVAL
+#define HEAP_PROFILER_SAMPLE_INTERVAL (256 * 1024) //Average number of bytes allocated between samples, lower values give a finer profile at a higher cost.
+#endif
+
+#ifndef HEAP_PROFILER_MAX_SITES
+#define HEAP_PROFILER_MAX_SITES 64 //Capacity of the call site table, samples from new sites beyond this are dropped.
+#endif
+
+#ifndef HEAP_PROFILER_MAX_LIVE
+#define HEAP_PROFILER_MAX_LIVE 256 //Capacity of the table of sampled allocations that haven't been freed yet, samples beyond this are dropped.
+#endif
+
+#ifndef HEAP_PROFILER_BACKTRACE_DEPTH
+#define HEAP_PROFILER_BACKTRACE_DEPTH 6 //Return addresses recorded per call site (Xtensa targets only), starting from the allocator's caller.
+#endif
+
+#ifndef HEAP_PROFILER_SKIP_FRAMES
+#define HEAP_PROFILER_SKIP_FRAMES 1 //Frames above the profiler that are always left out of the backtrace, by default the heap hook itself. The allocator's own frames are recognised separately (see Calibrate).
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    /// @brief A sampling heap profiler fed by HeapHooks, attributing allocations to their call site and owning service.
+    /// @note Roughly one allocation per HEAP_PROFILER_SAMPLE_INTERVAL bytes is sampled, with the interval randomised so that periodic allocations can't dodge it.
+    /// Each sample stands for the bytes allocated since the previous one, so the counts and sizes reported are estimates that converge as samples build up.
+    /// Allocations that aren't sampled only cost a per-core subtraction, frees a few loads while there are sampled allocations alive.
+    /// Nothing is recorded until Start is called. Backtraces are only taken on Xtensa targets, elsewhere sites are distinguished by service alone.
+    /// How many frames malloc, new, heap_caps_* etc. add above the hook differs between them, so the first Start learns their return addresses instead of skipping a fixed count.
+    class HeapProfiler
+    {
+    public:
+        struct SAllocationSite
+        {
+            uint32_t pcs[HEAP_PROFILER_BACKTRACE_DEPTH]; //Innermost first, zero filled when the backtrace is shorter or unavailable.
+            char service[configMAX_TASK_NAME_LEN]; //Empty for allocations made outside of a service.
+            uint32_t samples;
+            uint32_t allocations;
+            uint64_t allocatedBytes;
+            uint32_t liveAllocations;
+            uint32_t liveBytes;
+        };
+
+    private:
+        static constexpr size_t LIVE_PROBES = 8;
+        static constexpr size_t MAX_ALLOCATOR_PCS = 32;
+
+        struct SLiveAllocation
+        {
+            std::atomic<void*> ptr;
+            uint16_t site;
+            uint32_t bytes; //Estimated bytes the sample stands for.
+            uint32_t allocations;
+        };
+
+        static portMUX_TYPE _lock;
+        static std::atomic<bool> _enabled;
+        static uint32_t _sampleInterval;
+        static int64_t _startedAt;
+        static std::atomic<int32_t> _countdown[configNUM_CORES]; //Bytes left until the next sample on each core.
+        static uint32_t _random[configNUM_CORES];
+        static std::atomic<uint32_t> _liveCount;
+        static std::atomic<uint32_t> _dropped;
+        static SAllocationSite _sites[HEAP_PROFILER_MAX_SITES];
+        static size_t _siteCount;
+        static SLiveAllocation _live[HEAP_PROFILER_MAX_LIVE];
+        static std::atomic<TaskHandle_t> _calibrationTask;
+        static uint32_t _calibrationSp;
+        static bool _calibrated;
+        static uint32_t _allocatorPcs[MAX_ALLOCATOR_PCS]; //Return addresses inside the allocators, learnt by Calibrate.
+        static size_t _allocatorPcCount;
+
+        HeapProfiler() {}
+
+        //Uniform over [1, 2 * _sampleInterval] so the mean is the interval. Xorshift rather than esp_random so the hook doesn't depend on the RNG peripheral.
+        static inline int32_t NextInterval(size_t core)
+        {
+            uint32_t x = _random[core];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            _random[core] = x;
+            return (int32_t)(x % (2 * _sampleInterval) + 1);
+        }
+
+        static inline size_t LiveSlot(const void* ptr)
+        {
+            //Heap blocks are at least 4 byte aligned so the low bits carry no information.
+            return ((uintptr_t)ptr >> 3) % HEAP_PROFILER_MAX_LIVE;
+        }
+
+        static inline bool IsAllocatorPc(uint32_t pc)
+        {
+            for (size_t i = 0; i < _allocatorPcCount; i++)
+                if (_allocatorPcs[i] == pc)
+                    return true;
+            return false;
+        }
+
+        static size_t IRAM_ATTR Backtrace(uint32_t (&pcs)[HEAP_PROFILER_BACKTRACE_DEPTH])
+        {
+            size_t depth = 0;
+            #if CONFIG_IDF_TARGET_ARCH_XTENSA
+            //The starting frame is Sample, the first frame returned after it is the heap hook, followed by the allocator's own frames which are left out so that pcs[0] is its caller.
+            esp_backtrace_frame_t frame = {};
+            esp_backtrace_get_start(&frame.pc, &frame.sp, &frame.next_pc);
+            for (size_t i = 0; depth < HEAP_PROFILER_BACKTRACE_DEPTH && i < HEAP_PROFILER_SKIP_FRAMES + MAX_ALLOCATOR_PCS + HEAP_PROFILER_BACKTRACE_DEPTH
+                && frame.next_pc != 0 && esp_backtrace_get_next_frame(&frame); i++)
+            {
+                uint32_t pc = esp_cpu_process_stack_pc(frame.pc);
+                if (i >= HEAP_PROFILER_SKIP_FRAMES && (depth > 0 || !IsAllocatorPc(pc)))
+                    pcs[depth++] = pc;
+            }
+            #endif
+            return depth;
+        }
+
+        //Called from Sample for the allocations made by Calibrate, every frame between here and Calibrate's is the profiler's, the hook's or the allocator's.
+        static void __attribute__((noinline)) LearnAllocatorFrames()
+        {
+            #if CONFIG_IDF_TARGET_ARCH_XTENSA
+            uint32_t found[MAX_ALLOCATOR_PCS];
+            size_t count = 0;
+            esp_backtrace_frame_t frame = {};
+            esp_backtrace_get_start(&frame.pc, &frame.sp, &frame.next_pc);
+            while (frame.next_pc != 0 && esp_backtrace_get_next_frame(&frame))
+            {
+                if (frame.sp == _calibrationSp)
+                {
+                    for (size_t i = 0; i < count && _allocatorPcCount < MAX_ALLOCATOR_PCS; i++)
+                        if (!IsAllocatorPc(found[i]))
+                            _allocatorPcs[_allocatorPcCount++] = found[i];
+                    return;
+                }
+                //Calibrate's frame wasn't reached, so none of the frames can be trusted to be the allocator's.
+                if (count == MAX_ALLOCATOR_PCS)
+                    return;
+                found[count++] = esp_cpu_process_stack_pc(frame.pc);
+            }
+            #endif
+        }
+
+        //Allocates through each of the common entry points while sampling is stopped, so that LearnAllocatorFrames sees the frames each one adds above the hook.
+        static void __attribute__((noinline)) Calibrate()
+        {
+            #if CONFIG_IDF_TARGET_ARCH_XTENSA
+            //The stack pointer identifies this frame in the backtraces, it doesn't change after entry with the windowed ABI.
+            _calibrationSp = (uint32_t)(uintptr_t)esp_cpu_get_sp();
+            _calibrationTask.store(xTaskGetCurrentTaskHandle(), std::memory_order_relaxed);
+
+            //Volatile so that the compiler can't elide the allocation and free pairs.
+            void* volatile block = malloc(1);
+            free(block);
+            block = calloc(1, 1);
+            free(block);
+            block = malloc(1);
+            void* volatile grown = realloc(block, 64);
+            free(grown != nullptr ? grown : block);
+            block = heap_caps_malloc(1, MALLOC_CAP_DEFAULT);
+            heap_caps_free(block);
+            block = heap_caps_calloc(1, 1, MALLOC_CAP_DEFAULT);
+            heap_caps_free(block);
+            block = heap_caps_malloc(1, MALLOC_CAP_DEFAULT);
+            grown = heap_caps_realloc(block, 64, MALLOC_CAP_DEFAULT);
+            heap_caps_free(grown != nullptr ? grown : block);
+            uint8_t* volatile object = new uint8_t;
+            delete object;
+            object = new uint8_t[2];
+            delete[] object;
+
+            _calibrationTask.store(nullptr, std::memory_order_relaxed);
+            #endif
+            _calibrated = true;
+        }
+
+        //Must be called with the lock held.
+        static SAllocationSite* IRAM_ATTR FindOrAddSite(const uint32_t (&pcs)[HEAP_PROFILER_BACKTRACE_DEPTH], const char* service)
+        {
+            for (size_t i = 0; i < _siteCount; i++)
+                if (memcmp(_sites[i].pcs, pcs, sizeof(pcs)) == 0 && strncmp(_sites[i].service, service, sizeof(_sites[i].service)) == 0)
+                    return &_sites[i];
+
+            if (_siteCount == HEAP_PROFILER_MAX_SITES)
+                return nullptr;
+
+            SAllocationSite& site = _sites[_siteCount++];
+            memset(&site, 0, sizeof(site));
+            memcpy(site.pcs, pcs, sizeof(pcs));
+            strncpy(site.service, service, sizeof(site.service) - 1);
+            return &site;
+        }
+
+    public:
+        /// @return The core whose countdown picked the allocation to be sampled, in which case Sample must be called for it with that core, otherwise -1.
+        static inline int ShouldSample(size_t size)
+        {
+            if (!_enabled.load(std::memory_order_relaxed))
+            {
+                TaskHandle_t calibrationTask = _calibrationTask.load(std::memory_order_relaxed);
+                return calibrationTask != nullptr && !xPortInIsrContext() && xTaskGetCurrentTaskHandle() == calibrationTask ? xPortGetCoreID() : -1;
+            }
+            if (size == 0)
+                return -1;
+
+            //Only the allocation that takes the countdown past zero samples, any that race it on the same core (i.e. from an ISR) see a negative value.
+            int core = xPortGetCoreID();
+            int32_t remaining = _countdown[core].fetch_sub((int32_t)size, std::memory_order_relaxed);
+            return (remaining > 0 && remaining <= (int32_t)size) || size >= _sampleInterval ? core : -1;
+        }
+
+        /// @param core As returned by ShouldSample, the task may have moved to the other core since, which must not be left with a spent countdown.
+        static void IRAM_ATTR __attribute__((noinline)) Sample(int core, void* ptr, size_t size, const Service::SServiceResources* resources)
+        {
+            if (_calibrationTask.load(std::memory_order_relaxed) != nullptr)
+            {
+                LearnAllocatorFrames();
+                return;
+            }
+
+            _countdown[core].store(NextInterval(core), std::memory_order_relaxed);
+            if (ptr == nullptr)
+                return;
+
+            uint32_t pcs[HEAP_PROFILER_BACKTRACE_DEPTH] = {};
+            Backtrace(pcs);
+
+            //Large allocations are always sampled and stand for themselves, smaller ones for the interval they were picked from.
+            uint32_t bytes = size > _sampleInterval ? size : _sampleInterval;
+            uint32_t allocations = bytes / size;
+
+            portENTER_CRITICAL_SAFE(&_lock);
+            SAllocationSite* site = FindOrAddSite(pcs, resources == nullptr ? "" : resources->name);
+            if (site == nullptr)
+            {
+                portEXIT_CRITICAL_SAFE(&_lock);
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            site->samples++;
+            site->allocations += allocations;
+            site->allocatedBytes += bytes;
+
+            size_t slot = LiveSlot(ptr);
+            bool tracked = false;
+            for (size_t i = 0; i < LIVE_PROBES && !tracked; i++)
+            {
+                SLiveAllocation& live = _live[(slot + i) % HEAP_PROFILER_MAX_LIVE];
+                if (live.ptr.load(std::memory_order_relaxed) != nullptr)
+                    continue;
+                live.site = site - _sites;
+                live.bytes = bytes;
+                live.allocations = allocations;
+                live.ptr.store(ptr, std::memory_order_release);
+                tracked = true;
+            }
+            if (tracked)
+            {
+                site->liveAllocations += allocations;
+                site->liveBytes += bytes;
+                _liveCount.fetch_add(1, std::memory_order_relaxed);
+            }
+            portEXIT_CRITICAL_SAFE(&_lock);
+
+            if (!tracked)
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static inline void OnFree(void* ptr)
+        {
+            if (!_enabled.load(std::memory_order_relaxed) || _liveCount.load(std::memory_order_relaxed) == 0 || ptr == nullptr)
+                return;
+
+            size_t slot = LiveSlot(ptr);
+            for (size_t i = 0; i < LIVE_PROBES; i++)
+            {
+                SLiveAllocation& live = _live[(slot + i) % HEAP_PROFILER_MAX_LIVE];
+                if (live.ptr.load(std::memory_order_acquire) != ptr)
+                    continue;
+
+                portENTER_CRITICAL_SAFE(&_lock);
+                //Checked again as Start may have cleared the table in between.
+                if (live.ptr.load(std::memory_order_relaxed) == ptr)
+                {
+                    SAllocationSite& site = _sites[live.site];
+                    site.liveAllocations -= live.allocations;
+                    site.liveBytes -= live.bytes;
+                    live.ptr.store(nullptr, std::memory_order_relaxed);
+                    _liveCount.fetch_sub(1, std::memory_order_relaxed);
+                }
+                portEXIT_CRITICAL_SAFE(&_lock);
+                return;
+            }
+        }
+
+        /// @brief Clears any previous profile and starts sampling.
+        /// @param sampleInterval Average bytes between samples, must be less than 1GB.
+        static void Start(uint32_t sampleInterval = HEAP_PROFILER_SAMPLE_INTERVAL)
+        {
+            _enabled.store(false, std::memory_order_relaxed);
+            if (!_calibrated)
+                Calibrate();
+
+            portENTER_CRITICAL_SAFE(&_lock);
+            _sampleInterval = sampleInterval == 0 ? 1 : sampleInterval;
+            _siteCount = 0;
+            for (size_t i = 0; i < HEAP_PROFILER_MAX_LIVE; i++)
+                _live[i].ptr.store(nullptr, std::memory_order_relaxed);
+            _liveCount.store(0, std::memory_order_relaxed);
+            _dropped.store(0, std::memory_order_relaxed);
+            for (size_t i = 0; i < configNUM_CORES; i++)
+            {
+                _random[i] = (uint32_t)esp_timer_get_time() * 2654435761u + i + 1; //Xorshift gets stuck at 0.
+                _countdown[i].store(NextInterval(i), std::memory_order_relaxed);
+            }
+            _startedAt = esp_timer_get_time();
+            portEXIT_CRITICAL_SAFE(&_lock);
+
+            _enabled.store(true, std::memory_order_release);
+        }
+
+        /// @brief Stops sampling, the profile is kept as it was at this point until the next Start.
+        static void Stop()
+        {
+            _enabled.store(false, std::memory_order_relaxed);
+        }
+
+        static bool IsRunning()
+        {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        /// @return The number of samples that couldn't be fully recorded because the site or live allocation tables were full.
+        static uint32_t GetDroppedSamples()
+        {
+            return _dropped.load(std::memory_order_relaxed);
+        }
+
+        /// @brief Gets the capacity call sites holding the most live bytes, largest first.
+        /// @return The number of entries written to outSites.
+        static size_t GetTopSites(SAllocationSite* outSites, size_t capacity)
+        {
+            size_t found = 0;
+            for (size_t i = 0; i < HEAP_PROFILER_MAX_SITES; i++)
+            {
+                SAllocationSite site;
+                portENTER_CRITICAL_SAFE(&_lock);
+                bool exists = i < _siteCount;
+                if (exists)
+                    site = _sites[i];
+                portEXIT_CRITICAL_SAFE(&_lock);
+                if (!exists)
+                    break;
+
+                //Insertion into the sorted output, as with DiagnosticsService::GetTopTasks.
+                size_t position = found;
+                while (position > 0 && outSites[position - 1].liveBytes < site.liveBytes)
+                {
+                    if (position < capacity)
+                        outSites[position] = outSites[position - 1];
+                    position--;
+                }
+                if (position < capacity)
+                    outSites[position] = site;
+                if (found < capacity)
+                    found++;
+            }
+            return found;
+        }
+
+        /// @brief Writes the profile as text, one line per call site.
+        /// @param writer void(const char* data, size_t length), called once per line.
+        /// @note The pcs can be symbolised offline, e.g. with "xtensa-esp32-elf-addr2line -pfiaC -e firmware.elf <pcs>". Rates are averaged since Start.
+        template <typename TWriter>
+        static void WriteProfile(TWriter&& writer)
+        {
+            char line[192 + HEAP_PROFILER_BACKTRACE_DEPTH * 11];
+            int64_t elapsedUs = esp_timer_get_time() - _startedAt;
+            uint32_t elapsedMs = elapsedUs / 1000;
+
+            int length = snprintf(line, sizeof(line), "heap_profile interval=%lu elapsed_ms=%lu dropped=%lu running=%d\n",
+                (unsigned long)_sampleInterval, (unsigned long)elapsedMs, (unsigned long)GetDroppedSamples(), IsRunning() ? 1 : 0);
+            writer(line, length < (int)sizeof(line) ? length : sizeof(line) - 1);
+
+            for (size_t i = 0; i < HEAP_PROFILER_MAX_SITES; i++)
+            {
+                //Copied out so that formatting doesn't happen inside the critical section.
+                SAllocationSite site;
+                portENTER_CRITICAL_SAFE(&_lock);
+                bool exists = i < _siteCount;
+                if (exists)
+                    site = _sites[i];
+                portEXIT_CRITICAL_SAFE(&_lock);
+                if (!exists)
+                    break;
+
+                uint32_t rate = elapsedUs <= 0 ? 0 : (uint32_t)(site.allocatedBytes * 1000000 / elapsedUs);
+                length = snprintf(line, sizeof(line), "site service=\"%s\" live_bytes=%lu live_allocs=%lu alloc_bytes=%llu allocs=%lu rate_bps=%lu samples=%lu pcs=",
+                    site.service, (unsigned long)site.liveBytes, (unsigned long)site.liveAllocations, (unsigned long long)site.allocatedBytes,
+                    (unsigned long)site.allocations, (unsigned long)rate, (unsigned long)site.samples);
+                for (size_t pc = 0; pc < HEAP_PROFILER_BACKTRACE_DEPTH && site.pcs[pc] != 0 && length < (int)sizeof(line); pc++)
+                    length += snprintf(line + length, sizeof(line) - length, pc == 0 ? "0x%08lx" : ",0x%08lx", (unsigned long)site.pcs[pc]);
+                if (length < (int)sizeof(line) - 1)
+                    line[length++] = '\n';
+                writer(line, length < (int)sizeof(line) ? length : sizeof(line) - 1);
+            }
+        }
+
+        static void WriteProfile(FILE* stream)
+        {
+            WriteProfile([stream](const char* data, size_t length) { fwrite(data, 1, length, stream); });
+        }
+    };
+};
+
+portMUX_TYPE ReadieFur::Diagnostic::HeapProfiler::_lock = portMUX_INITIALIZER_UNLOCKED;
+std::atomic<bool> ReadieFur::Diagnostic::HeapProfiler::_enabled = false;
+uint32_t ReadieFur::Diagnostic::HeapProfiler::_sampleInterval = HEAP_PROFILER_SAMPLE_INTERVAL;
+int64_t ReadieFur::Diagnostic::HeapProfiler::_startedAt = 0;
+std::atomic<int32_t> ReadieFur::Diagnostic::HeapProfiler::_countdown[configNUM_CORES] = {};
+uint32_t ReadieFur::Diagnostic::HeapProfiler::_random[configNUM_CORES] = {};
+std::atomic<uint32_t> ReadieFur::Diagnostic::HeapProfiler::_liveCount = 0;
+std::atomic<uint32_t> ReadieFur::Diagnostic::HeapProfiler::_dropped = 0;
+ReadieFur::Diagnostic::HeapProfiler::SAllocationSite ReadieFur::Diagnostic::HeapProfiler::_sites[HEAP_PROFILER_MAX_SITES];
+size_t ReadieFur::Diagnostic::HeapProfiler::_siteCount = 0;
+ReadieFur::Diagnostic::HeapProfiler::SLiveAllocation ReadieFur::Diagnostic::HeapProfiler::_live[HEAP_PROFILER_MAX_LIVE] = {};
+std::atomic<TaskHandle_t> ReadieFur::Diagnostic::HeapProfiler::_calibrationTask = nullptr;
+uint32_t ReadieFur::Diagnostic::HeapProfiler::_calibrationSp = 0;
+bool ReadieFur::Diagnostic::HeapProfiler::_calibrated = false;
+uint32_t ReadieFur::Diagnostic::HeapProfiler::_allocatorPcs[MAX_ALLOCATOR_PCS] = {};
+size_t ReadieFur::Diagnostic::HeapProfiler::_allocatorPcCount = 0;
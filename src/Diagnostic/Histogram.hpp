@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ReadieFur::Diagnostic
+{
+    /// @brief A fixed size histogram with power of two buckets, bucket 0 holds 0 and bucket n holds [2^(n-1), 2^n).
+    /// @note Not thread safe, intended to be written by a single task.
+    class Histogram
+    {
+    public:
+        static constexpr size_t BUCKETS = 33;
+
+    private:
+        uint32_t _buckets[BUCKETS] = {};
+        uint32_t _count = 0;
+        uint32_t _min = UINT32_MAX;
+        uint32_t _max = 0;
+        uint64_t _sum = 0;
+
+    public:
+        static inline size_t BucketOf(uint32_t value)
+        {
+            return value == 0 ? 0 : 32 - __builtin_clz(value);
+        }
+
+        /// @return The largest value that falls into the bucket.
+        static inline uint32_t BucketUpperBound(size_t bucket)
+        {
+            return bucket == 0 ? 0 : (bucket >= 32 ? UINT32_MAX : (UINT32_C(1) << bucket) - 1);
+        }
+
+        void Record(uint32_t value)
+        {
+            _buckets[BucketOf(value)]++;
+            _count++;
+            _sum += value;
+            if (value < _min)
+                _min = value;
+            if (value > _max)
+                _max = value;
+        }
+
+        void Reset()
+        {
+            for (size_t i = 0; i < BUCKETS; i++)
+                _buckets[i] = 0;
+            _count = 0;
+            _min = UINT32_MAX;
+            _max = 0;
+            _sum = 0;
+        }
+
+        uint32_t Count() const { return _count; }
+        uint32_t Min() const { return _count == 0 ? 0 : _min; }
+        uint32_t Max() const { return _max; }
+        uint32_t Mean() const { return _count == 0 ? 0 : (uint32_t)(_sum / _count); }
+        uint32_t GetBucket(size_t bucket) const { return bucket < BUCKETS ? _buckets[bucket] : 0; }
+
+        /// @param percentile Between 0 and 100.
+        /// @return The upper bound of the bucket containing the percentile, clamped to the largest recorded value.
+        uint32_t Percentile(float percentile) const
+        {
+            if (_count == 0)
+                return 0;
+
+            uint32_t target = (uint32_t)(_count * (percentile / 100.0f));
+            if (target == 0)
+                target = 1;
+
+            uint32_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++)
+            {
+                seen += _buckets[i];
+                if (seen >= target)
+                    return BucketUpperBound(i) < _max ? BucketUpperBound(i) : _max;
+            }
+            return _max;
+        }
+    };
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include "EMetricType.h"
+
+namespace ReadieFur::Diagnostic
+{
+    /// @brief A named metric, every instance adds itself to the registry on construction so they are best declared as statics.
+    /// @note Writes only touch the current core's shard with relaxed atomics, reads merge the shards without stopping writers so a snapshot may miss writes that are in flight.
+    class AMetric
+    {
+    friend class Metrics;
+    private:
+        static std::atomic<AMetric*> _head;
+
+        const char* _name;
+        const char* _help;
+        AMetric* _next = nullptr;
+
+    protected:
+        AMetric(const char* name, const char* help)
+            : _name(name), _help(help)
+        {
+            _next = _head.load(std::memory_order_relaxed);
+            while (!_head.compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        //Metrics are never unregistered as the list is read without a lock.
+        AMetric(const AMetric&) = delete;
+        AMetric& operator=(const AMetric&) = delete;
+
+    public:
+        const char* GetName() const { return _name; }
+        const char* GetHelp() const { return _help; }
+        virtual EMetricType GetType() const = 0;
+    };
+
+    /// @brief A monotonically increasing count.
+    class Counter : public AMetric
+    {
+    private:
+        std::atomic<uint32_t> _shards[configNUM_CORES] = {};
+
+    public:
+        Counter(const char* name, const char* help = nullptr) : AMetric(name, help) {}
+
+        EMetricType GetType() const override { return Metric_Counter; }
+
+        inline void Increment(uint32_t amount = 1)
+        {
+            _shards[xPortGetCoreID()].fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        /// @note The shards are 32 bits each so the total wraps once a shard passes UINT32_MAX, as rate calculations do with any other counter.
+        uint64_t Value() const
+        {
+            uint64_t value = 0;
+            for (size_t i = 0; i < configNUM_CORES; i++)
+                value += _shards[i].load(std::memory_order_relaxed);
+            return value;
+        }
+    };
+
+    /// @brief A value that can go up and down, e.g. a queue depth, along with the highest value it has been set to.
+    class Gauge : public AMetric
+    {
+    private:
+        //Not sharded, a gauge's value only makes sense as a single number.
+        std::atomic<int32_t> _value = 0;
+        std::atomic<int32_t> _max = INT32_MIN;
+
+        inline void UpdateMax(int32_t value)
+        {
+            int32_t max = _max.load(std::memory_order_relaxed);
+            while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+        }
+
+    public:
+        Gauge(const char* name, const char* help = nullptr) : AMetric(name, help) {}
+
+        EMetricType GetType() const override { return Metric_Gauge; }
+
+        inline void Set(int32_t value)
+        {
+            _value.store(value, std::memory_order_relaxed);
+            UpdateMax(value);
+        }
+
+        inline void Add(int32_t amount)
+        {
+            UpdateMax(_value.fetch_add(amount, std::memory_order_relaxed) + amount);
+        }
+
+        int32_t Value() const { return _value.load(std::memory_order_relaxed); }
+
+        /// @return The highest value seen, or 0 if the gauge has never been written.
+        int32_t Max() const
+        {
+            int32_t max = _max.load(std::memory_order_relaxed);
+            return max == INT32_MIN ? 0 : max;
+        }
+    };
+
+    /// @brief A log-linear histogram (as in HdrHistogram), each power of two range is split into SUB_BUCKETS linear buckets so values are kept to within 25%.
+    /// @note Each shard is 504 bytes, so a histogram costs ~1KB on a dual core chip.
+    class LatencyHistogram : public AMetric
+    {
+    public:
+        static constexpr uint32_t SUB_BUCKET_BITS = 2;
+        static constexpr uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+        static constexpr size_t BUCKETS = SUB_BUCKETS + (32 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+        /// @brief The merged shards at one point in time.
+        struct SSnapshot
+        {
+            uint32_t count;
+            uint32_t max;
+            uint64_t sum; //Wraps in the same way as Counter::Value.
+            uint32_t buckets[BUCKETS];
+
+            /// @param percentile Between 0 and 100.
+            /// @return The upper bound of the bucket containing the percentile, clamped to the largest recorded value.
+            uint32_t Percentile(float percentile) const
+            {
+                if (count == 0)
+                    return 0;
+
+                uint32_t target = (uint32_t)(count * (percentile / 100.0f));
+                if (target == 0)
+                    target = 1;
+
+                uint32_t seen = 0;
+                for (size_t i = 0; i < BUCKETS; i++)
+                {
+                    seen += buckets[i];
+                    if (seen >= target)
+                        return BucketUpperBound(i) < max ? BucketUpperBound(i) : max;
+                }
+                return max;
+            }
+        };
+
+    private:
+        struct SShard
+        {
+            std::atomic<uint32_t> buckets[BUCKETS];
+            std::atomic<uint32_t> max;
+            std::atomic<uint32_t> sum;
+        };
+
+        SShard _shards[configNUM_CORES] = {};
+
+    public:
+        LatencyHistogram(const char* name, const char* help = nullptr) : AMetric(name, help) {}
+
+        EMetricType GetType() const override { return Metric_Histogram; }
+
+        static inline size_t BucketOf(uint32_t value)
+        {
+            if (value < SUB_BUCKETS)
+                return value;
+            uint32_t magnitude = 31 - __builtin_clz(value);
+            uint32_t subBucket = (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+            return SUB_BUCKETS + (magnitude - SUB_BUCKET_BITS) * SUB_BUCKETS + subBucket;
+        }
+
+        /// @return The largest value that falls into the bucket.
+        static inline uint32_t BucketUpperBound(size_t bucket)
+        {
+            if (bucket < SUB_BUCKETS)
+                return bucket;
+            uint32_t magnitude = (bucket - SUB_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS;
+            uint32_t subBucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+            uint64_t lower = ((uint64_t)(SUB_BUCKETS + subBucket)) << (magnitude - SUB_BUCKET_BITS);
+            uint64_t upper = lower + (UINT64_C(1) << (magnitude - SUB_BUCKET_BITS)) - 1;
+            return upper > UINT32_MAX ? UINT32_MAX : (uint32_t)upper;
+        }
+
+        inline void Record(uint32_t value)
+        {
+            SShard& shard = _shards[xPortGetCoreID()];
+            shard.buckets[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            shard.sum.fetch_add(value, std::memory_order_relaxed);
+            uint32_t max = shard.max.load(std::memory_order_relaxed);
+            while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+        }
+
+        void Snapshot(SSnapshot& outSnapshot) const
+        {
+            outSnapshot.count = 0;
+            outSnapshot.max = 0;
+            outSnapshot.sum = 0;
+            for (size_t i = 0; i < BUCKETS; i++)
+            {
+                uint32_t bucket = 0;
+                for (size_t core = 0; core < configNUM_CORES; core++)
+                    bucket += _shards[core].buckets[i].load(std::memory_order_relaxed);
+                outSnapshot.buckets[i] = bucket;
+                outSnapshot.count += bucket;
+            }
+            for (size_t core = 0; core < configNUM_CORES; core++)
+            {
+                uint32_t max = _shards[core].max.load(std::memory_order_relaxed);
+                if (max > outSnapshot.max)
+                    outSnapshot.max = max;
+                outSnapshot.sum += _shards[core].sum.load(std::memory_order_relaxed);
+            }
+        }
+    };
+
+    class Metrics
+    {
+    private:
+        Metrics() {}
+
+    public:
+        /// @brief Calls the callback with every registered metric, newest first.
+        /// @param callback void(const AMetric&), cast to the class matching GetType() to read the value.
+        template <typename TCallback>
+        static void ForEach(TCallback&& callback)
+        {
+            for (const AMetric* metric = AMetric::_head.load(std::memory_order_acquire); metric != nullptr; metric = metric->_next)
+                callback(*metric);
+        }
+
+        /// @return The metric with the given name, or nullptr if there isn't one.
+        static const AMetric* Find(const char* name)
+        {
+            for (const AMetric* metric = AMetric::_head.load(std::memory_order_acquire); metric != nullptr; metric = metric->_next)
+                if (strcmp(metric->_name, name) == 0)
+                    return metric;
+            return nullptr;
+        }
+    };
+};
+
+std::atomic<ReadieFur::Diagnostic::AMetric*> ReadieFur::Diagnostic::AMetric::_head = nullptr;
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <esp_http_server.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <mutex>
+#include "Metrics.hpp"
+#include "ProfiledMutex.hpp"
+#include "DiagnosticsService.hpp"
+#include "Service/ServiceManager.hpp"
+#include "Logging.hpp"
+
+#ifndef METRICS_CHUNK_SIZE
+#define METRICS_CHUNK_SIZE 512 //Bytes sent per httpd_resp_send_chunk call, this is the most of the response that is held in RAM at once.
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    /// @brief Serves the metrics registry and the DiagnosticsService tables in the Prometheus text format (version 0.0.4).
+    /// @note Scrapes are serialised, the tables are copied into static scratch buffers rather than onto the HTTP server's stack.
+    class MetricsEndpoint
+    {
+    private:
+        static constexpr const char* CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+        static constexpr size_t LINE_SIZE = 160;
+        static constexpr size_t LABEL_SIZE = 48;
+        static constexpr size_t HEAP_CAPS_CAPACITY = 8;
+
+        //Only one table is in use at a time so they share the same memory.
+        union UScratch
+        {
+            LatencyHistogram::SSnapshot histogram;
+            DiagnosticsService::STaskCpuUsage tasks[DIAGNOSTICS_MAX_TASKS];
+            DiagnosticsService::STaskStackUsage stacks[DIAGNOSTICS_MAX_TASKS];
+            DiagnosticsService::SHeapUsage heaps[HEAP_CAPS_CAPACITY];
+            DiagnosticsService::SServiceResourceUsage services[DIAGNOSTICS_MAX_SERVICES];
+            SchedulingProbe::SSchedulingLatency scheduling[SchedulingProbe::CANARIES];
+            SMutexStats locks[MUTEX_PROFILING_MAX_LOCKS];
+        };
+
+        //Collects lines into METRICS_CHUNK_SIZE pieces so the writer isn't called once per line.
+        template <typename TWriter>
+        class ChunkWriter
+        {
+        private:
+            TWriter& _writer;
+            char _chunk[METRICS_CHUNK_SIZE];
+            size_t _length = 0;
+
+        public:
+            ChunkWriter(TWriter& writer) : _writer(writer) {}
+
+            void Line(const char* format, ...) __attribute__((format(printf, 2, 3)))
+            {
+                char line[LINE_SIZE];
+                va_list args;
+                va_start(args, format);
+                int length = vsnprintf(line, sizeof(line), format, args);
+                va_end(args);
+
+                //A cut off line would corrupt the exposition, so drop it instead.
+                if (length < 0 || length >= (int)sizeof(line) - 1)
+                {
+                    LOGW(nameof(Diagnostic::MetricsEndpoint), "Dropped a metric line longer than %u bytes.", (unsigned)sizeof(line) - 2);
+                    return;
+                }
+                line[length++] = '\n';
+
+                if (_length + length > sizeof(_chunk))
+                    Flush();
+                memcpy(_chunk + _length, line, length);
+                _length += length;
+            }
+
+            void Flush()
+            {
+                if (_length == 0)
+                    return;
+                _writer(_chunk, _length);
+                _length = 0;
+            }
+        };
+
+        static ProfiledMutex _mutex;
+        static UScratch _scratch;
+
+        /// @brief Escapes a label value as the exposition format requires, truncating it to fit.
+        static const char* EscapeLabel(const char* value, char (&buffer)[LABEL_SIZE])
+        {
+            size_t length = 0;
+            for (const char* c = value == nullptr ? "" : value; *c != '\0'; c++)
+            {
+                bool escape = *c == '\\' || *c == '"' || *c == '\n';
+                if (length + (escape ? 2 : 1) >= LABEL_SIZE)
+                    break;
+                if (escape)
+                    buffer[length++] = '\\';
+                buffer[length++] = *c == '\n' ? 'n' : *c;
+            }
+            buffer[length] = '\0';
+            return buffer;
+        }
+
+        template <typename TWriter>
+        static void Family(ChunkWriter<TWriter>& out, const char* name, const char* type, const char* help)
+        {
+            if (help != nullptr)
+                out.Line("# HELP %s %s", name, help);
+            out.Line("# TYPE %s %s", name, type);
+        }
+
+        template <typename TWriter>
+        static void WriteRegistry(ChunkWriter<TWriter>& out)
+        {
+            Metrics::ForEach([&out](const AMetric& metric)
+            {
+                const char* name = metric.GetName();
+                switch (metric.GetType())
+                {
+                case Metric_Counter:
+                {
+                    Family(out, name, "counter", metric.GetHelp());
+                    out.Line("%s %llu", name, (unsigned long long)static_cast<const Counter&>(metric).Value());
+                    break;
+                }
+                case Metric_Gauge:
+                {
+                    const Gauge& gauge = static_cast<const Gauge&>(metric);
+                    Family(out, name, "gauge", metric.GetHelp());
+                    out.Line("%s %ld", name, (long)gauge.Value());
+                    out.Line("# TYPE %s_max gauge", name);
+                    out.Line("%s_max %ld", name, (long)gauge.Max());
+                    break;
+                }
+                case Metric_Histogram:
+                {
+                    LatencyHistogram::SSnapshot& snapshot = _scratch.histogram;
+                    static_cast<const LatencyHistogram&>(metric).Snapshot(snapshot);
+                    Family(out, name, "histogram", metric.GetHelp());
+
+                    //Empty buckets are left out, a cumulative histogram is still valid without them and most of the 124 are always empty.
+                    uint32_t cumulative = 0;
+                    for (size_t i = 0; i < LatencyHistogram::BUCKETS && cumulative < snapshot.count; i++)
+                    {
+                        if (snapshot.buckets[i] == 0)
+                            continue;
+                        cumulative += snapshot.buckets[i];
+                        out.Line("%s_bucket{le=\"%lu\"} %lu", name, (unsigned long)LatencyHistogram::BucketUpperBound(i), (unsigned long)cumulative);
+                    }
+                    out.Line("%s_bucket{le=\"+Inf\"} %lu", name, (unsigned long)snapshot.count);
+                    out.Line("%s_sum %llu", name, (unsigned long long)snapshot.sum);
+                    out.Line("%s_count %lu", name, (unsigned long)snapshot.count);
+                    break;
+                }
+                default:
+                    break;
+                }
+            });
+        }
+
+        template <typename TWriter>
+        static void WriteLocks(ChunkWriter<TWriter>& out)
+        {
+            size_t count = ProfiledMutex::GetStats(_scratch.locks, MUTEX_PROFILING_MAX_LOCKS);
+            if (count == 0)
+                return;
+
+            char label[LABEL_SIZE];
+            const SMutexStats* locks = _scratch.locks;
+            Family(out, "mutex_acquisitions", "counter", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("mutex_acquisitions{lock=\"%s\"} %lu", EscapeLabel(locks[i].name, label), (unsigned long)locks[i].acquisitions);
+            Family(out, "mutex_contentions", "counter", "Acquisitions that had to wait for another task to release the lock.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("mutex_contentions{lock=\"%s\"} %lu", EscapeLabel(locks[i].name, label), (unsigned long)locks[i].contentions);
+            Family(out, "mutex_wait_us", "counter", "Total time spent waiting for the lock in microseconds.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("mutex_wait_us{lock=\"%s\"} %lu", EscapeLabel(locks[i].name, label), (unsigned long)locks[i].totalWaitUs);
+            Family(out, "mutex_max_wait_us", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("mutex_max_wait_us{lock=\"%s\"} %lu", EscapeLabel(locks[i].name, label), (unsigned long)locks[i].maxWaitUs);
+            Family(out, "mutex_max_hold_us", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("mutex_max_hold_us{lock=\"%s\"} %lu", EscapeLabel(locks[i].name, label), (unsigned long)locks[i].maxHoldUs);
+        }
+
+        template <typename TWriter>
+        static void WriteDiagnostics(ChunkWriter<TWriter>& out, DiagnosticsService* diagnostics)
+        {
+            char label[LABEL_SIZE];
+
+            Family(out, "cpu_core_usage_percent", "gauge", "Time each core spent outside of its idle task, averaged over the window.");
+            for (size_t core = 0; core < configNUM_CORES; core++)
+            {
+                DiagnosticsService::SCoreCpuUsage usage = diagnostics->GetCoreCpuUsage(core);
+                out.Line("cpu_core_usage_percent{core=\"%u\",window=\"1s\"} %.2f", (unsigned)core, usage.load1s);
+                out.Line("cpu_core_usage_percent{core=\"%u\",window=\"10s\"} %.2f", (unsigned)core, usage.load10s);
+                out.Line("cpu_core_usage_percent{core=\"%u\",window=\"60s\"} %.2f", (unsigned)core, usage.load60s);
+            }
+
+            size_t count = diagnostics->GetTopTasks(_scratch.tasks, DIAGNOSTICS_MAX_TASKS);
+            Family(out, "task_cpu_usage_percent", "gauge", "Percentage of a single core used by the task in the last second.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("task_cpu_usage_percent{task=\"%s\"} %.2f", EscapeLabel(_scratch.tasks[i].name, label), _scratch.tasks[i].cpuUsage);
+            Family(out, "task_cpu_usage_average_percent", "gauge", "task_cpu_usage_percent smoothed over roughly 10 seconds.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("task_cpu_usage_average_percent{task=\"%s\"} %.2f", EscapeLabel(_scratch.tasks[i].name, label), _scratch.tasks[i].averageCpuUsage);
+
+            count = diagnostics->GetStackUsage(_scratch.stacks, DIAGNOSTICS_MAX_TASKS);
+            Family(out, "task_stack_free_bytes", "gauge", "Least stack headroom the task has had since it started.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("task_stack_free_bytes{task=\"%s\"} %u", EscapeLabel(_scratch.stacks[i].name, label), (unsigned)_scratch.stacks[i].stackFree);
+            Family(out, "task_stack_depth_bytes", "gauge", "Configured stack depth, only known for service and registered tasks.");
+            for (size_t i = 0; i < count; i++)
+                if (_scratch.stacks[i].stackDepth != 0)
+                    out.Line("task_stack_depth_bytes{task=\"%s\"} %u", EscapeLabel(_scratch.stacks[i].name, label), (unsigned)_scratch.stacks[i].stackDepth);
+
+            count = diagnostics->GetHeapUsage(_scratch.heaps, HEAP_CAPS_CAPACITY);
+            Family(out, "heap_free_bytes", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("heap_free_bytes{caps=\"%s\"} %u", _scratch.heaps[i].name, (unsigned)_scratch.heaps[i].totalFree);
+            Family(out, "heap_allocated_bytes", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("heap_allocated_bytes{caps=\"%s\"} %u", _scratch.heaps[i].name, (unsigned)_scratch.heaps[i].totalAllocated);
+            Family(out, "heap_largest_free_block_bytes", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("heap_largest_free_block_bytes{caps=\"%s\"} %u", _scratch.heaps[i].name, (unsigned)_scratch.heaps[i].largestFreeBlock);
+            Family(out, "heap_minimum_free_bytes", "gauge", "Lowest heap_free_bytes has been since boot.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("heap_minimum_free_bytes{caps=\"%s\"} %u", _scratch.heaps[i].name, (unsigned)_scratch.heaps[i].minimumFree);
+            Family(out, "heap_fragmentation_percent", "gauge", "Free memory that can't be handed out as a single block.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("heap_fragmentation_percent{caps=\"%s\"} %.2f", _scratch.heaps[i].name, _scratch.heaps[i].fragmentation);
+
+            Family(out, "heap_alloc_failures", "counter", nullptr);
+            out.Line("heap_alloc_failures %lu", (unsigned long)DiagnosticsService::GetAllocFailures());
+
+            count = diagnostics->GetServiceResources(_scratch.services, DIAGNOSTICS_MAX_SERVICES);
+            Family(out, "service_cpu_usage_percent", "gauge", "Percentage of the total CPU time used by the service's tasks.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("service_cpu_usage_percent{service=\"%s\"} %.2f", EscapeLabel(_scratch.services[i].name, label), _scratch.services[i].cpuUsage);
+            Family(out, "service_tasks", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("service_tasks{service=\"%s\"} %u", EscapeLabel(_scratch.services[i].name, label), (unsigned)_scratch.services[i].taskCount);
+            Family(out, "service_stack_free_bytes", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("service_stack_free_bytes{service=\"%s\"} %u", EscapeLabel(_scratch.services[i].name, label), (unsigned)_scratch.services[i].stackFree);
+            //The heap counters are 32 bit and wrap, which rate() treats as a counter reset.
+            Family(out, "service_heap_allocations", "counter", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("service_heap_allocations{service=\"%s\"} %lu", EscapeLabel(_scratch.services[i].name, label), (unsigned long)_scratch.services[i].heapAllocations);
+            Family(out, "service_heap_frees", "counter", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("service_heap_frees{service=\"%s\"} %lu", EscapeLabel(_scratch.services[i].name, label), (unsigned long)_scratch.services[i].heapFrees);
+            Family(out, "service_heap_allocated_bytes", "counter", "Total bytes allocated by the service's tasks.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("service_heap_allocated_bytes{service=\"%s\"} %lu", EscapeLabel(_scratch.services[i].name, label), (unsigned long)_scratch.services[i].heapAllocatedBytes);
+
+            count = diagnostics->GetSchedulingLatency(_scratch.scheduling, SchedulingProbe::CANARIES);
+            if (count == 0)
+                return;
+            const SchedulingProbe::SSchedulingLatency* scheduling = _scratch.scheduling;
+            Family(out, "sched_wake_latency_average_us", "gauge", "How late the canary at each core and priority was woken, over the last report interval.");
+            for (size_t i = 0; i < count; i++)
+                out.Line("sched_wake_latency_average_us{core=\"%d\",priority=\"%u\"} %lu", (int)scheduling[i].core, (unsigned)scheduling[i].priority, (unsigned long)scheduling[i].averageUs);
+            Family(out, "sched_wake_latency_p99_us", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("sched_wake_latency_p99_us{core=\"%d\",priority=\"%u\"} %lu", (int)scheduling[i].core, (unsigned)scheduling[i].priority, (unsigned long)scheduling[i].p99Us);
+            Family(out, "sched_wake_latency_max_us", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("sched_wake_latency_max_us{core=\"%d\",priority=\"%u\"} %lu", (int)scheduling[i].core, (unsigned)scheduling[i].priority, (unsigned long)scheduling[i].maxUs);
+            Family(out, "sched_wake_jitter_us", "gauge", nullptr);
+            for (size_t i = 0; i < count; i++)
+                out.Line("sched_wake_jitter_us{core=\"%d\",priority=\"%u\"} %lu", (int)scheduling[i].core, (unsigned)scheduling[i].priority, (unsigned long)scheduling[i].jitterUs);
+        }
+
+        static esp_err_t HandleRequest(httpd_req_t* req)
+        {
+            httpd_resp_set_type(req, CONTENT_TYPE);
+
+            esp_err_t err = ESP_OK;
+            Write([req, &err](const char* data, size_t length)
+            {
+                //Once the client has gone there is no point sending the rest.
+                if (err == ESP_OK)
+                    err = httpd_resp_send_chunk(req, data, length);
+            });
+            if (err != ESP_OK)
+            {
+                LOGW(nameof(Diagnostic::MetricsEndpoint), "Failed to send metrics: %s", esp_err_to_name(err));
+                return err;
+            }
+
+            return httpd_resp_send_chunk(req, NULL, 0);
+        }
+
+        MetricsEndpoint() {}
+
+    public:
+        /// @brief Adds a GET handler to an already running server, e.g. the one returned by WiFi::OTA::GetServer.
+        static esp_err_t Register(httpd_handle_t server, const char* uri = "/metrics")
+        {
+            if (server == NULL)
+                return ESP_ERR_INVALID_ARG;
+
+            httpd_uri_t handler = {
+                .uri = uri,
+                .method = HTTP_GET,
+                .handler = HandleRequest,
+                .user_ctx = NULL
+            };
+            esp_err_t err = httpd_register_uri_handler(server, &handler);
+            if (err != ESP_OK)
+                LOGE(nameof(Diagnostic::MetricsEndpoint), "Failed to register URI handler: %s", esp_err_to_name(err));
+            return err;
+        }
+
+        static esp_err_t Unregister(httpd_handle_t server, const char* uri = "/metrics")
+        {
+            if (server == NULL)
+                return ESP_ERR_INVALID_ARG;
+            return httpd_unregister_uri_handler(server, uri, HTTP_GET);
+        }
+
+        /// @brief Writes every registered metric and the lock statistics, followed by the DiagnosticsService tables if the service is running.
+        /// @param writer void(const char* data, size_t length), called with up to METRICS_CHUNK_SIZE bytes at a time in order.
+        template <typename TWriter>
+        static void Write(TWriter&& writer)
+        {
+            std::lock_guard<ProfiledMutex> lock(_mutex);
+            ChunkWriter<TWriter> out(writer);
+
+            Family(out, "uptime_seconds", "gauge", nullptr);
+            out.Line("uptime_seconds %lld", (long long)(esp_timer_get_time() / 1000000));
+
+            WriteRegistry(out);
+            WriteLocks(out);
+
+            DiagnosticsService* diagnostics = Service::ServiceManager::GetService<DiagnosticsService>();
+            if (diagnostics != nullptr && diagnostics->IsRunning())
+                WriteDiagnostics(out, diagnostics);
+
+            out.Flush();
+        }
+
+        static void Write(FILE* stream)
+        {
+            Write([stream](const char* data, size_t length) { fwrite(data, 1, length, stream); });
+        }
+    };
+};
+
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Diagnostic::MetricsEndpoint::_mutex("MetricsEndpoint");
+ReadieFur::Diagnostic::MetricsEndpoint::UScratch ReadieFur::Diagnostic::MetricsEndpoint::_scratch;
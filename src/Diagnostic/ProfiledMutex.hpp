@@ -0,0 +1,170 @@
+#pragma once
+
+#include <mutex>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#ifdef _ENABLE_MUTEX_PROFILING
+#include <esp_timer.h>
+#endif
+
+#ifndef MUTEX_PROFILING_MAX_LOCKS
+#define MUTEX_PROFILING_MAX_LOCKS 32 //Capacity of the lock statistics table, mutexes with a name beyond this are not profiled.
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    struct SMutexStats
+    {
+        const char* name;
+        uint32_t acquisitions;
+        uint32_t contentions; //Acquisitions that had to wait for another task to release the lock.
+        uint32_t totalWaitUs; //Wraps in the same way as a Counter.
+        uint32_t maxWaitUs;
+        uint32_t maxHoldUs;
+    };
+
+    #ifdef _ENABLE_MUTEX_PROFILING
+    /// @brief A std::mutex that records how often it is taken, how often and how long tasks wait for it and how long it is held.
+    /// @note Statistics are kept per name rather than per instance, so every instance of e.g. Event<T> adds to the same entry.
+    class ProfiledMutex
+    {
+    private:
+        struct SLockCounters
+        {
+            std::atomic<const char*> name;
+            std::atomic<uint32_t> acquisitions;
+            std::atomic<uint32_t> contentions;
+            std::atomic<uint32_t> totalWaitUs;
+            std::atomic<uint32_t> maxWaitUs;
+            std::atomic<uint32_t> maxHoldUs;
+        };
+
+        //Constant initialised, so mutexes constructed during static initialisation in any order can register with it.
+        static SLockCounters _locks[MUTEX_PROFILING_MAX_LOCKS];
+
+        std::mutex _mutex;
+        SLockCounters* _counters;
+        int64_t _acquiredAt = 0; //Only touched by the holder.
+
+        static SLockCounters* Register(const char* name)
+        {
+            for (size_t i = 0; i < MUTEX_PROFILING_MAX_LOCKS; i++)
+            {
+                const char* existing = nullptr;
+                if (_locks[i].name.compare_exchange_strong(existing, name, std::memory_order_acq_rel) || strcmp(existing, name) == 0)
+                    return &_locks[i];
+            }
+            return nullptr;
+        }
+
+        static inline void UpdateMax(std::atomic<uint32_t>& max, uint32_t value)
+        {
+            uint32_t current = max.load(std::memory_order_relaxed);
+            while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed));
+        }
+
+        inline void OnAcquired(int64_t now, bool contended, uint32_t waitUs)
+        {
+            _acquiredAt = now;
+            if (_counters == nullptr)
+                return;
+            _counters->acquisitions.fetch_add(1, std::memory_order_relaxed);
+            if (!contended)
+                return;
+            _counters->contentions.fetch_add(1, std::memory_order_relaxed);
+            _counters->totalWaitUs.fetch_add(waitUs, std::memory_order_relaxed);
+            UpdateMax(_counters->maxWaitUs, waitUs);
+        }
+
+    public:
+        ProfiledMutex(const char* name) : _counters(Register(name)) {}
+
+        ProfiledMutex(const ProfiledMutex&) = delete;
+        ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+        void lock()
+        {
+            //Uncontended acquisitions skip the wait timing.
+            if (_mutex.try_lock())
+            {
+                OnAcquired(esp_timer_get_time(), false, 0);
+                return;
+            }
+
+            int64_t waitStart = esp_timer_get_time();
+            _mutex.lock();
+            int64_t now = esp_timer_get_time();
+            OnAcquired(now, true, now - waitStart);
+        }
+
+        bool try_lock()
+        {
+            if (!_mutex.try_lock())
+                return false;
+            OnAcquired(esp_timer_get_time(), false, 0);
+            return true;
+        }
+
+        void unlock()
+        {
+            if (_counters != nullptr)
+                UpdateMax(_counters->maxHoldUs, esp_timer_get_time() - _acquiredAt);
+            _mutex.unlock();
+        }
+
+        /// @brief Gets the statistics of the capacity named locks with the longest total wait, longest first.
+        /// @return The number of entries written to outStats.
+        static size_t GetStats(SMutexStats* outStats, size_t capacity)
+        {
+            size_t found = 0;
+            for (size_t i = 0; i < MUTEX_PROFILING_MAX_LOCKS; i++)
+            {
+                const char* name = _locks[i].name.load(std::memory_order_acquire);
+                if (name == nullptr)
+                    break;
+                SMutexStats stats =
+                {
+                    .name = name,
+                    .acquisitions = _locks[i].acquisitions.load(std::memory_order_relaxed),
+                    .contentions = _locks[i].contentions.load(std::memory_order_relaxed),
+                    .totalWaitUs = _locks[i].totalWaitUs.load(std::memory_order_relaxed),
+                    .maxWaitUs = _locks[i].maxWaitUs.load(std::memory_order_relaxed),
+                    .maxHoldUs = _locks[i].maxHoldUs.load(std::memory_order_relaxed)
+                };
+
+                //Insertion into the sorted output, as with DiagnosticsService::GetTopTasks.
+                size_t position = found;
+                while (position > 0 && outStats[position - 1].totalWaitUs < stats.totalWaitUs)
+                {
+                    if (position < capacity)
+                        outStats[position] = outStats[position - 1];
+                    position--;
+                }
+                if (position < capacity)
+                    outStats[position] = stats;
+                if (found < capacity)
+                    found++;
+            }
+            return found;
+        }
+    };
+    #else
+    /// @brief A plain std::mutex, define _ENABLE_MUTEX_PROFILING to record statistics for it.
+    class ProfiledMutex : public std::mutex
+    {
+    public:
+        constexpr ProfiledMutex(const char*) noexcept {}
+
+        static size_t GetStats(SMutexStats*, size_t)
+        {
+            return 0;
+        }
+    };
+    #endif
+};
+
+#ifdef _ENABLE_MUTEX_PROFILING
+ReadieFur::Diagnostic::ProfiledMutex::SLockCounters ReadieFur::Diagnostic::ProfiledMutex::_locks[MUTEX_PROFILING_MAX_LOCKS] = {};
+#endif
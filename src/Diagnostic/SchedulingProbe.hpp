@@ -0,0 +1,256 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <sdkconfig.h>
+#include <stdio.h>
+#include <atomic>
+#include "Metrics.hpp"
+#include "Event/CancellationToken.hpp"
+#include "Logging.hpp"
+
+#ifndef SCHEDULING_PROBE_PRIORITIES
+#define SCHEDULING_PROBE_PRIORITIES 1, configMAX_PRIORITIES / 2, configMAX_PRIORITIES - 2 //Priorities a canary runs at on each core, the highest sits alongside the WiFi/BLE tasks.
+#endif
+
+#ifndef SCHEDULING_PROBE_INTERVAL_US
+#define SCHEDULING_PROBE_INTERVAL_US 20000 //How long each canary asks to sleep for between wakes.
+#endif
+
+#ifndef SCHEDULING_PROBE_STACK_SIZE
+#define SCHEDULING_PROBE_STACK_SIZE 2048
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    /// @brief Canary tasks at several priorities on each core that ask to be woken at a known time and record how late they actually ran.
+    /// @note The wake comes from an esp_timer, dispatched from its ISR where the IDF supports it, otherwise from the esp_timer task (priority 22) whose own delay is then included.
+    /// The timers and the semaphores they signal belong to the probe rather than the canary tasks, so a canary deleted while its timer is armed (e.g. by ServiceManager force stopping the service) leaves nothing behind that refers to it.
+    class SchedulingProbe
+    {
+    public:
+        static constexpr UBaseType_t PRIORITIES[] = { SCHEDULING_PROBE_PRIORITIES };
+        static constexpr size_t PRIORITY_COUNT = sizeof(PRIORITIES) / sizeof(PRIORITIES[0]);
+        static constexpr size_t CANARIES = configNUM_CORES * PRIORITY_COUNT;
+
+        /// @brief Wake latency of one canary over the window since the previous Sample.
+        struct SSchedulingLatency
+        {
+            BaseType_t core;
+            UBaseType_t priority;
+            uint32_t samples;
+            uint32_t averageUs;
+            uint32_t p50Us;
+            uint32_t p99Us;
+            uint32_t maxUs;
+            uint32_t jitterUs; //Smoothed difference between consecutive latencies (as RFC 3550 does for packet arrival), not reset between windows.
+        };
+
+    private:
+        static constexpr TickType_t WAKE_TIMEOUT_TICKS = pdMS_TO_TICKS(SCHEDULING_PROBE_INTERVAL_US / 1000 + 100);
+
+        struct SCanary
+        {
+            BaseType_t core;
+            UBaseType_t priority;
+            esp_timer_handle_t timer;
+            SemaphoreHandle_t wake;
+            StaticSemaphore_t wakeBuffer;
+            Event::CancellationTokenSource::SCancellationToken cancellationToken;
+            //Written only by the canary, drained by Sample.
+            std::atomic<uint32_t> buckets[LatencyHistogram::BUCKETS];
+            std::atomic<uint32_t> max;
+            std::atomic<uint32_t> sum;
+            std::atomic<uint32_t> jitter; //Scaled by 16 so that the smoothing can be done in integers.
+        };
+
+        SCanary _canaries[CANARIES];
+
+        static void IRAM_ATTR OnWakeTimer(void* arg)
+        {
+            SemaphoreHandle_t wake = reinterpret_cast<SCanary*>(arg)->wake;
+            #if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+            BaseType_t higherPriorityTaskWoken = pdFALSE;
+            xSemaphoreGiveFromISR(wake, &higherPriorityTaskWoken);
+            if (higherPriorityTaskWoken == pdTRUE)
+                esp_timer_isr_dispatch_need_yield();
+            #else
+            xSemaphoreGive(wake);
+            #endif
+        }
+
+        static void Record(SCanary& canary, uint32_t latency, uint32_t& previousLatency)
+        {
+            canary.buckets[LatencyHistogram::BucketOf(latency)].fetch_add(1, std::memory_order_relaxed);
+            canary.sum.fetch_add(latency, std::memory_order_relaxed);
+            if (latency > canary.max.load(std::memory_order_relaxed))
+                canary.max.store(latency, std::memory_order_relaxed); //Only Sample competes with this, and it only ever lowers the value to 0.
+
+            uint32_t difference = latency > previousLatency ? latency - previousLatency : previousLatency - latency;
+            uint32_t jitter = canary.jitter.load(std::memory_order_relaxed);
+            canary.jitter.store(jitter + difference - (jitter >> 4), std::memory_order_relaxed);
+            previousLatency = latency;
+        }
+
+        static void CanaryTask(void* param)
+        {
+            SCanary& canary = *reinterpret_cast<SCanary*>(param);
+
+            uint32_t previousLatency = 0;
+            while (!canary.cancellationToken.IsCancellationRequested())
+            {
+                //Taken before arming so the latency can only be over reported, by the time esp_timer_start_once takes.
+                int64_t requestedAt = esp_timer_get_time() + SCHEDULING_PROBE_INTERVAL_US;
+                esp_timer_start_once(canary.timer, SCHEDULING_PROBE_INTERVAL_US);
+
+                if (xSemaphoreTake(canary.wake, WAKE_TIMEOUT_TICKS) != pdTRUE)
+                {
+                    //The timer was starved for over 100ms, which is still recorded. Clear a wake that may have raced the stop so it isn't taken as the next one.
+                    esp_timer_stop(canary.timer);
+                    xSemaphoreTake(canary.wake, 0);
+                }
+
+                int64_t latency = esp_timer_get_time() - requestedAt;
+                Record(canary, latency < 0 ? 0 : (uint32_t)latency, previousLatency);
+            }
+        }
+
+        //Disarms a timer left armed by a canary that was deleted, and clears any wake it already gave.
+        static void Disarm(SCanary& canary)
+        {
+            if (canary.timer != nullptr)
+                esp_timer_stop(canary.timer);
+            if (canary.wake != NULL)
+                xSemaphoreTake(canary.wake, 0);
+        }
+
+    public:
+        SchedulingProbe()
+        {
+            for (size_t i = 0; i < CANARIES; i++)
+            {
+                _canaries[i].timer = nullptr;
+                _canaries[i].wake = NULL;
+            }
+        }
+
+        ~SchedulingProbe()
+        {
+            Stop();
+        }
+
+        /// @brief Creates the canary tasks, they run until the cancellation token is cancelled.
+        /// @param createTask BaseType_t(TaskFunction_t function, const char* name, uint32_t stackDepth, void* param, UBaseType_t priority, int core), e.g. AService::CreateServiceTask so the canaries are owned by the calling service.
+        /// @return The number of canaries started.
+        /// @note Must not be called while canaries from a previous Start are still running, though they may have been deleted without stopping.
+        template <typename TCreateTask>
+        size_t Start(Event::CancellationTokenSource::SCancellationToken cancellationToken, TCreateTask&& createTask)
+        {
+            size_t started = 0;
+            for (size_t i = 0; i < CANARIES; i++)
+            {
+                SCanary& canary = _canaries[i];
+                Disarm(canary);
+                canary.core = i / PRIORITY_COUNT;
+                canary.priority = PRIORITIES[i % PRIORITY_COUNT];
+                canary.cancellationToken = cancellationToken;
+
+                //Created once and kept across restarts, they are only deleted by Stop.
+                if (canary.wake == NULL)
+                    canary.wake = xSemaphoreCreateBinaryStatic(&canary.wakeBuffer);
+                if (canary.timer == nullptr)
+                {
+                    esp_timer_create_args_t timerArgs = {
+                        .callback = OnWakeTimer,
+                        .arg = &canary,
+                        #if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+                        .dispatch_method = ESP_TIMER_ISR,
+                        #else
+                        .dispatch_method = ESP_TIMER_TASK,
+                        #endif
+                        .name = "SchedulingProbe",
+                        .skip_unhandled_events = false
+                    };
+                    if (esp_err_t err = esp_timer_create(&timerArgs, &canary.timer); err != ESP_OK)
+                    {
+                        LOGE(nameof(Diagnostic::SchedulingProbe), "Failed to create the wake timer for core %d priority %u: %s", canary.core, canary.priority, esp_err_to_name(err));
+                        canary.timer = nullptr;
+                        continue;
+                    }
+                }
+
+                for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; bucket++)
+                    canary.buckets[bucket].store(0, std::memory_order_relaxed);
+                canary.max.store(0, std::memory_order_relaxed);
+                canary.sum.store(0, std::memory_order_relaxed);
+                canary.jitter.store(0, std::memory_order_relaxed);
+
+                char name[configMAX_TASK_NAME_LEN];
+                snprintf(name, sizeof(name), "Canary%d_%u", canary.core, canary.priority);
+                if (createTask(CanaryTask, name, SCHEDULING_PROBE_STACK_SIZE, &canary, canary.priority, canary.core) != pdPASS)
+                {
+                    LOGE(nameof(Diagnostic::SchedulingProbe), "Failed to create canary %s.", name);
+                    continue;
+                }
+                started++;
+            }
+            return started;
+        }
+
+        /// @brief Deletes the wake timers, the canaries must have exited or been deleted first.
+        void Stop()
+        {
+            for (size_t i = 0; i < CANARIES; i++)
+            {
+                SCanary& canary = _canaries[i];
+                Disarm(canary);
+                if (canary.timer != nullptr)
+                {
+                    esp_timer_delete(canary.timer);
+                    canary.timer = nullptr;
+                }
+                if (canary.wake != NULL)
+                {
+                    vSemaphoreDelete(canary.wake);
+                    canary.wake = NULL;
+                }
+            }
+        }
+
+        /// @brief Reads and resets the window of every canary.
+        /// @param outLatency Must have room for CANARIES entries.
+        void Sample(SSchedulingLatency* outLatency)
+        {
+            //Static rather than on the caller's stack, only the diagnostics task samples.
+            static LatencyHistogram::SSnapshot snapshot;
+
+            for (size_t i = 0; i < CANARIES; i++)
+            {
+                SCanary& canary = _canaries[i];
+                snapshot.count = 0;
+                for (size_t bucket = 0; bucket < LatencyHistogram::BUCKETS; bucket++)
+                {
+                    snapshot.buckets[bucket] = canary.buckets[bucket].exchange(0, std::memory_order_relaxed);
+                    snapshot.count += snapshot.buckets[bucket];
+                }
+                snapshot.max = canary.max.exchange(0, std::memory_order_relaxed);
+                snapshot.sum = canary.sum.exchange(0, std::memory_order_relaxed);
+
+                outLatency[i] = SSchedulingLatency
+                {
+                    .core = canary.core,
+                    .priority = canary.priority,
+                    .samples = snapshot.count,
+                    .averageUs = snapshot.count == 0 ? 0 : (uint32_t)(snapshot.sum / snapshot.count),
+                    .p50Us = snapshot.Percentile(50),
+                    .p99Us = snapshot.Percentile(99),
+                    .maxUs = snapshot.max,
+                    .jitterUs = canary.jitter.load(std::memory_order_relaxed) >> 4
+                };
+            }
+        }
+    };
+};
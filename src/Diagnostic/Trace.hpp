@@ -0,0 +1,325 @@
+#pragma once
+
+//Spans and instant events that are recorded into per core ring buffers and exported in the Chrome trace event format (open with ui.perfetto.dev or chrome://tracing).
+//Everything here compiles to nothing unless _ENABLE_TRACE is defined.
+#ifdef _ENABLE_TRACE
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_cpu.h>
+#include <esp_timer.h>
+#include <esp_rom_sys.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 256 //Records kept per core, must be a power of two. Each record is 28 bytes.
+#endif
+
+#ifndef TRACE_RESYNC_MS
+#define TRACE_RESYNC_MS 1000 //How often each core records the wall clock alongside its cycle counter, must be well under the cycle counter's wrap period.
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    class Trace
+    {
+    private:
+        static_assert((TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) == 0, "TRACE_BUFFER_SIZE must be a power of two.");
+
+        enum ERecordType : uint8_t
+        {
+            TraceRecord_Span,
+            TraceRecord_Instant,
+            TraceRecord_Sync
+        };
+
+        //Timestamps are cycle counts as they are a single register read. The cycle counters of the cores aren't aligned and wrap every few seconds,
+        //so each core records a sync (its cycle count alongside esp_timer) at least every TRACE_RESYNC_MS that it is tracing, which places the records that follow it in time.
+        struct STraceRecord
+        {
+            uint32_t cycles; //Start of a span, or when a sync was taken.
+            ERecordType type;
+            union
+            {
+                struct
+                {
+                    uint32_t duration; //In cycles.
+                    const char* category;
+                    const char* name;
+                    uint32_t id;
+                    TaskHandle_t task; //NULL when recorded from an ISR.
+                } event;
+                struct
+                {
+                    uint32_t timeUs; //Low 32 bits of esp_timer_get_time.
+                    //The core's previous sync, used for the records between it and this one when the previous sync has been overwritten in the ring.
+                    uint32_t previousCycles;
+                    uint32_t previousTimeUs;
+                } sync;
+            };
+        };
+
+        static STraceRecord _records[configNUM_CORES][TRACE_BUFFER_SIZE];
+        static std::atomic<uint32_t> _heads[configNUM_CORES];
+        static std::atomic<TickType_t> _syncTicks[configNUM_CORES];
+        static std::atomic<uint32_t> _syncCycles[configNUM_CORES];
+        static std::atomic<uint32_t> _syncTimeUs[configNUM_CORES];
+        static std::atomic<bool> _synced[configNUM_CORES];
+        static std::atomic<bool> _enabled;
+
+        Trace() {}
+
+        static inline STraceRecord& Claim(uint32_t core)
+        {
+            //Preemption on the same core just claims the next slot, so the ring needs no lock.
+            return _records[core][_heads[core].fetch_add(1, std::memory_order_relaxed) & (TRACE_BUFFER_SIZE - 1)];
+        }
+
+        static void Sync(uint32_t core, TickType_t ticks)
+        {
+            uint32_t timeUs = (uint32_t)esp_timer_get_time();
+            uint32_t cycles = esp_cpu_get_cycle_count();
+            bool synced = _synced[core].load(std::memory_order_relaxed);
+
+            STraceRecord& record = Claim(core);
+            record.cycles = cycles;
+            record.type = TraceRecord_Sync;
+            record.sync.timeUs = timeUs;
+            //Nothing on this core can precede the first sync after Start.
+            record.sync.previousCycles = synced ? _syncCycles[core].load(std::memory_order_relaxed) : cycles;
+            record.sync.previousTimeUs = synced ? _syncTimeUs[core].load(std::memory_order_relaxed) : timeUs;
+
+            _syncCycles[core].store(cycles, std::memory_order_relaxed);
+            _syncTimeUs[core].store(timeUs, std::memory_order_relaxed);
+            _syncTicks[core].store(ticks, std::memory_order_relaxed);
+            _synced[core].store(true, std::memory_order_relaxed);
+        }
+
+        static inline void Record(ERecordType type, const char* category, const char* name, uint32_t id, uint32_t cycles, uint32_t duration)
+        {
+            bool isr = xPortInIsrContext();
+            uint32_t core = xPortGetCoreID();
+            TickType_t ticks = isr ? xTaskGetTickCountFromISR() : xTaskGetTickCount();
+            if (!_synced[core].load(std::memory_order_relaxed) || ticks - _syncTicks[core].load(std::memory_order_relaxed) >= pdMS_TO_TICKS(TRACE_RESYNC_MS))
+                Sync(core, ticks);
+
+            STraceRecord& record = Claim(core);
+            record.cycles = cycles;
+            record.type = type;
+            record.event.duration = duration;
+            record.event.category = category;
+            record.event.name = name;
+            record.event.id = id;
+            record.event.task = isr ? NULL : xTaskGetCurrentTaskHandle();
+        }
+
+        static void LookupTaskName(TaskStatus_t* tasks, UBaseType_t taskCount, TaskHandle_t handle, char* outName, size_t size)
+        {
+            if (handle == NULL)
+            {
+                snprintf(outName, size, "ISR");
+                return;
+            }
+            for (UBaseType_t i = 0; i < taskCount; i++)
+            {
+                if (tasks[i].xHandle == handle)
+                {
+                    snprintf(outName, size, "%s", tasks[i].pcTaskName);
+                    return;
+                }
+            }
+            //The task has been deleted since the record was written.
+            snprintf(outName, size, "%p", handle);
+        }
+
+    public:
+        static inline bool IsEnabled()
+        {
+            return _enabled.load(std::memory_order_relaxed);
+        }
+
+        /// @brief Clears the buffers and starts recording, recording is on from boot.
+        static void Start()
+        {
+            _enabled.store(false, std::memory_order_relaxed);
+            for (size_t i = 0; i < configNUM_CORES; i++)
+            {
+                _heads[i].store(0, std::memory_order_relaxed);
+                _synced[i].store(false, std::memory_order_relaxed);
+            }
+            _enabled.store(true, std::memory_order_release);
+        }
+
+        /// @brief Stops recording and keeps what has been recorded so far.
+        static void Stop()
+        {
+            _enabled.store(false, std::memory_order_relaxed);
+        }
+
+        static inline uint32_t Now()
+        {
+            return esp_cpu_get_cycle_count();
+        }
+
+        static inline void Span(const char* category, const char* name, uint32_t id, uint32_t startCycles)
+        {
+            uint32_t now = esp_cpu_get_cycle_count();
+            Record(TraceRecord_Span, category, name, id, startCycles, now - startCycles);
+        }
+
+        static inline void Instant(const char* category, const char* name, uint32_t id = 0)
+        {
+            if (IsEnabled())
+                Record(TraceRecord_Instant, category, name, id, esp_cpu_get_cycle_count(), 0);
+        }
+
+        /// @brief Writes the recorded events as Chrome trace JSON, recording is paused while this runs.
+        /// @param writer void(const char* data, size_t length), called with pieces of the document in order.
+        /// @note category and name strings must still be valid, which is always the case for string literals.
+        template <typename TWriter>
+        static void WriteChromeJson(TWriter&& writer)
+        {
+            bool wasEnabled = _enabled.exchange(false, std::memory_order_acquire);
+            uint32_t cyclesPerUs = esp_rom_get_cpu_ticks_per_us();
+
+            //Only used to name the tasks, the trace itself is still exported if this fails.
+            UBaseType_t taskCount = uxTaskGetNumberOfTasks() + 4;
+            TaskStatus_t* tasks = (TaskStatus_t*)malloc(taskCount * sizeof(TaskStatus_t));
+            taskCount = tasks == nullptr ? 0 : uxTaskGetSystemState(tasks, taskCount, NULL);
+
+            char buffer[192];
+            int length;
+            const char* separator = "";
+            writer("{\"traceEvents\":[", 16);
+
+            //Timestamps are exported as microseconds since boot, the records only hold the low 32 bits so they are extended relative to now.
+            int64_t nowUs = esp_timer_get_time();
+
+            for (uint32_t core = 0; core < configNUM_CORES; core++)
+            {
+                uint32_t head = _heads[core].load(std::memory_order_relaxed);
+                uint32_t count = head < TRACE_BUFFER_SIZE ? head : TRACE_BUFFER_SIZE;
+                uint32_t tail = head - count;
+
+                //The records before the oldest sync still in the ring belong to the sync it points back to.
+                bool anchored = false;
+                uint32_t anchorCycles = 0;
+                uint32_t anchorUs = 0;
+                for (uint32_t i = tail; i != head && !anchored; i++)
+                {
+                    const STraceRecord& record = _records[core][i & (TRACE_BUFFER_SIZE - 1)];
+                    if (record.type != TraceRecord_Sync)
+                        continue;
+                    anchored = true;
+                    anchorCycles = record.sync.previousCycles;
+                    anchorUs = record.sync.previousTimeUs;
+                }
+
+                TaskHandle_t namedTasks[32];
+                size_t namedTaskCount = 0;
+
+                for (uint32_t i = tail; i != head && anchored; i++)
+                {
+                    const STraceRecord& record = _records[core][i & (TRACE_BUFFER_SIZE - 1)];
+                    if (record.type == TraceRecord_Sync)
+                    {
+                        anchorCycles = record.cycles;
+                        anchorUs = record.sync.timeUs;
+                        continue;
+                    }
+
+                    //Give each task a readable track name the first time it is seen.
+                    bool named = false;
+                    for (size_t j = 0; j < namedTaskCount && !named; j++)
+                        named = namedTasks[j] == record.event.task;
+                    if (!named && namedTaskCount < sizeof(namedTasks) / sizeof(namedTasks[0]))
+                    {
+                        namedTasks[namedTaskCount++] = record.event.task;
+                        char taskName[configMAX_TASK_NAME_LEN + 8];
+                        LookupTaskName(tasks, taskCount, record.event.task, taskName, sizeof(taskName));
+                        length = snprintf(buffer, sizeof(buffer), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+                            separator, (unsigned long)(uintptr_t)record.event.task, taskName);
+                        writer(buffer, length < (int)sizeof(buffer) ? length : sizeof(buffer) - 1);
+                        separator = ",";
+                    }
+
+                    double timestampUs = nowUs + (int32_t)(anchorUs - (uint32_t)nowUs) + (double)(int32_t)(record.cycles - anchorCycles) / cyclesPerUs;
+                    if (record.type == TraceRecord_Span)
+                        length = snprintf(buffer, sizeof(buffer), "%s{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%lu,\"args\":{\"core\":%lu,\"id\":%lu}}",
+                            separator, record.event.category, record.event.name, timestampUs, (double)record.event.duration / cyclesPerUs,
+                            (unsigned long)(uintptr_t)record.event.task, (unsigned long)core, (unsigned long)record.event.id);
+                    else
+                        length = snprintf(buffer, sizeof(buffer), "%s{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,\"tid\":%lu,\"args\":{\"core\":%lu,\"id\":%lu}}",
+                            separator, record.event.category, record.event.name, timestampUs,
+                            (unsigned long)(uintptr_t)record.event.task, (unsigned long)core, (unsigned long)record.event.id);
+                    writer(buffer, length < (int)sizeof(buffer) ? length : sizeof(buffer) - 1);
+                    separator = ",";
+                }
+            }
+
+            writer("]}\n", 3);
+            free(tasks);
+            if (wasEnabled)
+                _enabled.store(true, std::memory_order_release);
+        }
+
+        static void WriteChromeJson(FILE* stream)
+        {
+            WriteChromeJson([stream](const char* data, size_t length) { fwrite(data, 1, length, stream); });
+        }
+    };
+
+    /// @brief Records a span covering its own lifetime, use through TRACE_SPAN.
+    class TraceSpan
+    {
+    private:
+        const char* _category;
+        const char* _name;
+        uint32_t _id;
+        uint32_t _start;
+        uint8_t _core;
+        bool _enabled;
+
+    public:
+        inline TraceSpan(const char* category, const char* name, uint32_t id = 0)
+            : _category(category), _name(name), _id(id), _start(Trace::Now()), _core(xPortGetCoreID()), _enabled(Trace::IsEnabled()) {}
+
+        inline ~TraceSpan()
+        {
+            //The cycle counters of the cores differ, so a span whose task moved to the other core can't be measured.
+            if (_enabled && _core == xPortGetCoreID())
+                Trace::Span(_category, _name, _id, _start);
+        }
+
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+    };
+};
+
+#define __TRACE_CONCAT_INNER(a, b) a##b
+#define __TRACE_CONCAT(a, b) __TRACE_CONCAT_INNER(a, b)
+//category and name must outlive the trace buffer, in practice string literals.
+#define TRACE_SPAN(category, name) ReadieFur::Diagnostic::TraceSpan __TRACE_CONCAT(__traceSpan, __LINE__)(category, name)
+#define TRACE_SPAN_ID(category, name, id) ReadieFur::Diagnostic::TraceSpan __TRACE_CONCAT(__traceSpan, __LINE__)(category, name, (uint32_t)(id))
+#define TRACE_INSTANT(category, name) ReadieFur::Diagnostic::Trace::Instant(category, name)
+#define TRACE_INSTANT_ID(category, name, id) ReadieFur::Diagnostic::Trace::Instant(category, name, (uint32_t)(id))
+
+ReadieFur::Diagnostic::Trace::STraceRecord ReadieFur::Diagnostic::Trace::_records[configNUM_CORES][TRACE_BUFFER_SIZE];
+std::atomic<uint32_t> ReadieFur::Diagnostic::Trace::_heads[configNUM_CORES] = {};
+std::atomic<TickType_t> ReadieFur::Diagnostic::Trace::_syncTicks[configNUM_CORES] = {};
+std::atomic<uint32_t> ReadieFur::Diagnostic::Trace::_syncCycles[configNUM_CORES] = {};
+std::atomic<uint32_t> ReadieFur::Diagnostic::Trace::_syncTimeUs[configNUM_CORES] = {};
+std::atomic<bool> ReadieFur::Diagnostic::Trace::_synced[configNUM_CORES] = {};
+std::atomic<bool> ReadieFur::Diagnostic::Trace::_enabled = true;
+
+#else
+
+#define TRACE_SPAN(category, name)
+#define TRACE_SPAN_ID(category, name, id)
+#define TRACE_INSTANT(category, name)
+#define TRACE_INSTANT_ID(category, name, id)
+
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+
+enum EStreamDumpFormat
+{
+	StreamDump_Raw, //The bytes as they were sent, with no markers.
+	StreamDump_Hex, //Timestamped lines of hex bytes prefixed with the direction.
+	StreamDump_Annotated //Timestamped lines of text prefixed with the direction, non-printable bytes are escaped.
+};
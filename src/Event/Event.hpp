@@ -5,6 +5,8 @@
 #include <mutex>
 #include <list>
 #include <freertos/task.h>
+#include "Diagnostic/Trace.hpp"
+#include "Diagnostic/ProfiledMutex.hpp"
 
 namespace ReadieFur::Event
 {
@@ -14,12 +16,13 @@ namespace ReadieFur::Event
     class Event
     {
     private:
-        std::mutex _mutex;
+        Diagnostic::ProfiledMutex _mutex{"Event"};
         std::map<TickType_t, std::function<void(ArgTypes...)>> _callbacks;
 
     public:
         void Dispatch(ArgTypes... values)
         {
+            TRACE_SPAN("Event", "Dispatch");
             _mutex.lock();
 
             for (auto &&kvp : _callbacks)
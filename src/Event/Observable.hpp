@@ -6,6 +6,7 @@
 #include <mutex>
 #include <map>
 #include <esp_err.h>
+#include "Diagnostic/ProfiledMutex.hpp"
 
 namespace ReadieFur::Event
 {
@@ -22,7 +23,7 @@ namespace ReadieFur::Event
             std::vector<TObservableHandle> handles;
         };
 
-        std::mutex _mutex;
+        Diagnostic::ProfiledMutex _mutex{"Observable"};
         std::map<size_t, SGroupInfo> _groups;
         T _value;
 
@@ -56,7 +57,7 @@ namespace ReadieFur::Event
 
         esp_err_t Register(TObservableHandle& outHandle)
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
 
             //Find the first free handle.
             for (auto &&group : _groups)
@@ -98,7 +99,7 @@ namespace ReadieFur::Event
 
         esp_err_t Unregister(TObservableHandle& handle)
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
 
             //Prevent removal of the base handle.
             if (handle == 0)
@@ -7,117 +7,932 @@
 #include <esp32-hal-log.h>
 #endif
 #include <stdio.h>
-#include <vector>
-#include <functional>
-#ifdef _ENABLE_STDOUT_HOOK
-#include <freertos/semphr.h>
+#include <atomic>
+#include <algorithm>
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "Logging/LogRingBuffer.hpp"
+#include "Logging/ELogOverflowPolicy.h"
+#include "Logging/BinaryLogEncoder.hpp"
+#include "Logging/LogFilter.hpp"
+#include "Logging/SLogRecord.h"
+#include "Logging/SLogCallsite.h"
+#include "Logging/CborEncoder.hpp"
+#include "Logging/LogFields.hpp"
+#include <mutex>
+#include "Diagnostic/ProfiledMutex.hpp"
+#include <string.h>
+#include <sys/reent.h>
+#include <stdio_ext.h>
+
+#ifndef LOG_MAX_SINKS
+#define LOG_MAX_SINKS 4 //Including the console sink.
+#endif
+
+#ifndef LOG_RATE_LIMIT_PER_SECOND
+#define LOG_RATE_LIMIT_PER_SECOND 10 //Sustained messages per second allowed from each call site, 0 to disable rate limiting.
 #endif
 
-// #define _ENABLE_STDOUT_HOOK
+#ifndef LOG_RATE_LIMIT_BURST
+#define LOG_RATE_LIMIT_BURST 20 //Messages a call site can log back to back before the rate limit applies.
+#endif
+
+#ifndef LOG_REPEAT_REPORT_INTERVAL
+#define LOG_REPEAT_REPORT_INTERVAL 5000 //Milliseconds between reports of suppressed messages while they keep repeating.
+#endif
+
+#ifndef LOG_FORMAT_BUFFER_SIZE
+#define LOG_FORMAT_BUFFER_SIZE 256 //Per core, longer messages are truncated.
+#endif
+
+#ifndef LOG_STACK_FORMAT_BUFFER_SIZE
+#define LOG_STACK_FORMAT_BUFFER_SIZE 96 //Used when the core's buffer is already in use, this is taken from the logging task's stack.
+#endif
+
+#ifndef LOG_KV_MAX_SIZE
+#define LOG_KV_MAX_SIZE 128 //Maximum size of the CBOR encoding of a LOGx_KV call, in async mode this is also limited by LOG_ASYNC_RECORD_SIZE.
+#endif
+
+#ifndef LOG_STDOUT_LINE_SIZE
+#define LOG_STDOUT_LINE_SIZE 128 //Per task, captured stdout output is passed to the sinks a line at a time, longer lines are split.
+#endif
+
+#ifndef LOG_STDOUT_TASKS
+#define LOG_STDOUT_TASKS 8 //Tasks that can have a partial stdout line buffered at once, partial lines from any others are passed on as they are.
+#endif
+
+#ifndef LOG_ASYNC_RECORD_SIZE
+#define LOG_ASYNC_RECORD_SIZE 128 //Maximum length of a single message in async mode (including the null terminator), longer messages are truncated.
+#endif
 
 #define PRINT(format, ...) ReadieFur::Logging::Print(format, ##__VA_ARGS__)
 #define WRITE(c) ReadieFur::Logging::Write(c)
 
-#ifdef ARDUINO
+//Calls above the tag's compile time maximum level are discarded entirely, the rest check the runtime level through an ID cached at each call site and are then rate limited per call site.
+//Tags must be string literals (e.g. nameof(X)) so that the compile time check can be evaluated.
+#define __LOG_FILTERED(level, tag, ...) do { if constexpr (ReadieFur::LogFilter::MaxLevel(tag) >= level) { static ReadieFur::SLogCallsite __logCallsite; if (ReadieFur::Logging::IsEnabled(level, tag, __logCallsite)) { __VA_ARGS__; } } } while (0)
+
+#if defined(_ENABLE_BINARY_LOG)
+//Binary mode, formatting is deferred to the host so the raw format string is recorded without any prefix (the decoder adds the level, timestamp and tag).
+//The unevaluated printf call keeps the compiler's format checking, which the decoder relies on for the argument sizes.
+#define __LOG_BINARY(level, tag, format, ...) __LOG_FILTERED(level, tag, if (false) ReadieFur::Logging::CheckFormat(format, ##__VA_ARGS__); ReadieFur::Logging::LogBinary(level, tag, format, ##__VA_ARGS__))
+#define LOGE(tag, format, ...) __LOG_BINARY(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define LOGW(tag, format, ...) __LOG_BINARY(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define LOGI(tag, format, ...) __LOG_BINARY(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define LOGD(tag, format, ...) __LOG_BINARY(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define LOGV(tag, format, ...) __LOG_BINARY(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+#elif defined(ARDUINO)
 #define ARDUHAL_LOG_FORMAT2(letter, format) ARDUHAL_LOG_COLOR_ ## letter "[%6u][" #letter "][%s:%u]: " format ARDUHAL_LOG_RESET_COLOR "\r\n", (unsigned long) (esp_timer_get_time() / 1000ULL), pathToFileName(__FILE__), __LINE__
-#define LOGE(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_ERROR, tag, ARDUHAL_LOG_FORMAT2(E, format), ##__VA_ARGS__)
-#define LOGW(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_WARN, tag, ARDUHAL_LOG_FORMAT2(W, format), ##__VA_ARGS__)
-#define LOGI(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_INFO, tag, ARDUHAL_LOG_FORMAT2(I, format), ##__VA_ARGS__)
-#define LOGD(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_DEBUG, tag, ARDUHAL_LOG_FORMAT2(D, format), ##__VA_ARGS__)
-#define LOGV(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_VERBOSE, tag, ARDUHAL_LOG_FORMAT2(V, format), ##__VA_ARGS__)
+#define LOGE(tag, format, ...) __LOG_FILTERED(ESP_LOG_ERROR, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_ERROR, tag, ARDUHAL_LOG_FORMAT2(E, format), ##__VA_ARGS__))
+#define LOGW(tag, format, ...) __LOG_FILTERED(ESP_LOG_WARN, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_WARN, tag, ARDUHAL_LOG_FORMAT2(W, format), ##__VA_ARGS__))
+#define LOGI(tag, format, ...) __LOG_FILTERED(ESP_LOG_INFO, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_INFO, tag, ARDUHAL_LOG_FORMAT2(I, format), ##__VA_ARGS__))
+#define LOGD(tag, format, ...) __LOG_FILTERED(ESP_LOG_DEBUG, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_DEBUG, tag, ARDUHAL_LOG_FORMAT2(D, format), ##__VA_ARGS__))
+#define LOGV(tag, format, ...) __LOG_FILTERED(ESP_LOG_VERBOSE, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_VERBOSE, tag, ARDUHAL_LOG_FORMAT2(V, format), ##__VA_ARGS__))
 #else
-#define LOGE(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_ERROR, tag, LOG_FORMAT(E, format), esp_log_timestamp(), tag, ##__VA_ARGS__)
-#define LOGW(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_WARN, tag, LOG_FORMAT(W, format), esp_log_timestamp(), tag, ##__VA_ARGS__)
-#define LOGI(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_INFO, tag, LOG_FORMAT(I, format), esp_log_timestamp(), tag, ##__VA_ARGS__)
-#define LOGD(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_DEBUG, tag, LOG_FORMAT(D, format), esp_log_timestamp(), tag, ##__VA_ARGS__)
-#define LOGV(tag, format, ...) ReadieFur::Logging::Log(ESP_LOG_VERBOSE, tag, LOG_FORMAT(V, format), esp_log_timestamp(), tag, ##__VA_ARGS__)
+#define LOGE(tag, format, ...) __LOG_FILTERED(ESP_LOG_ERROR, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_ERROR, tag, LOG_FORMAT(E, format), esp_log_timestamp(), tag, ##__VA_ARGS__))
+#define LOGW(tag, format, ...) __LOG_FILTERED(ESP_LOG_WARN, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_WARN, tag, LOG_FORMAT(W, format), esp_log_timestamp(), tag, ##__VA_ARGS__))
+#define LOGI(tag, format, ...) __LOG_FILTERED(ESP_LOG_INFO, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_INFO, tag, LOG_FORMAT(I, format), esp_log_timestamp(), tag, ##__VA_ARGS__))
+#define LOGD(tag, format, ...) __LOG_FILTERED(ESP_LOG_DEBUG, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_DEBUG, tag, LOG_FORMAT(D, format), esp_log_timestamp(), tag, ##__VA_ARGS__))
+#define LOGV(tag, format, ...) __LOG_FILTERED(ESP_LOG_VERBOSE, tag, ReadieFur::Logging::LogUnfiltered(ESP_LOG_VERBOSE, tag, LOG_FORMAT(V, format), esp_log_timestamp(), tag, ##__VA_ARGS__))
 #endif
 
+//Structured logging, fields are passed as key/value pairs, e.g. LOGI_KV(nameof(EspNow), "Received", "rssi", -62, "peer", ReadieFur::LogMac(mac)).
+#define LOGE_KV(tag, message, ...) __LOG_FILTERED(ESP_LOG_ERROR, tag, ReadieFur::Logging::LogKV(ESP_LOG_ERROR, tag, message, ##__VA_ARGS__))
+#define LOGW_KV(tag, message, ...) __LOG_FILTERED(ESP_LOG_WARN, tag, ReadieFur::Logging::LogKV(ESP_LOG_WARN, tag, message, ##__VA_ARGS__))
+#define LOGI_KV(tag, message, ...) __LOG_FILTERED(ESP_LOG_INFO, tag, ReadieFur::Logging::LogKV(ESP_LOG_INFO, tag, message, ##__VA_ARGS__))
+#define LOGD_KV(tag, message, ...) __LOG_FILTERED(ESP_LOG_DEBUG, tag, ReadieFur::Logging::LogKV(ESP_LOG_DEBUG, tag, message, ##__VA_ARGS__))
+#define LOGV_KV(tag, message, ...) __LOG_FILTERED(ESP_LOG_VERBOSE, tag, ReadieFur::Logging::LogKV(ESP_LOG_VERBOSE, tag, message, ##__VA_ARGS__))
+
 namespace ReadieFur
 {
+    typedef void (*TLogSinkWriter)(const SLogRecord& record, void* context);
+
     class Logging //: public Service::AService
     {
     private:
-        #ifdef _ENABLE_STDOUT_HOOK
-        static const size_t BUFFER_SIZE;
-        static FILE* ORIGINAL_STDOUT;
-        static SemaphoreHandle_t _mutex;
-        static char* _buffer;
-        #endif
-
-        static int FormatWrite(std::function<int(const char*, size_t)> writer, const char* format, va_list args)
-        {
-            //Based on esp32-hal-uart.c::log_printfv
-            
-            static char preallocBuffer[64]; //Static local buffer (persists across all calls, is faster than alloc each time).
-            char *temp = preallocBuffer; //Pointer to buffer.
-            // va_list args;
-            uint32_t len;
-            va_list copy;
-
-            //Copy the argument list because vsnprintf modifies it.
-            // va_start(args, format);
-            va_copy(copy, args);
-
-            //Determine the length of the formatted string.
-            len = vsnprintf(NULL, 0, format, copy);
-            va_end(copy);
-
-            //If the formatted string exceeds the size of the static buffer, allocate memory dynamically.
-            if (len >= sizeof(preallocBuffer))
-            {
-                //Allocate enough memory for the string and null terminator.
-                temp = (char*)malloc(len + 1);
-                if (temp == NULL)
-                {
-                    va_end(args); //End the variadic arguments if malloc fails.
-                    return 0; //Return if memory allocation failed.
+        static std::atomic<bool> _outputCaptured;
+        static std::atomic<FILE*> _consoleStream; //The original stdout once it has been overridden.
+
+        struct SStdoutLine
+        {
+            std::atomic<TaskHandle_t> task; //nullptr if the slot is free, a slot is only held while its task has a partial line.
+            size_t length;
+            char data[LOG_STDOUT_LINE_SIZE];
+        };
+
+        static SStdoutLine _stdoutLines[LOG_STDOUT_TASKS];
+
+        struct SLogSink
+        {
+            std::atomic<TLogSinkWriter> writer; //nullptr if the slot is free.
+            std::atomic<void*> context;
+            std::atomic<uint8_t> levelMask;
+            std::atomic<const char*> tagPrefix;
+            std::atomic<bool> structured; //Receives LOGx_KV messages as CBOR rather than text.
+            std::atomic<uint32_t> writing; //Writes that have read the writer and may still be using the context.
+        };
+
+        struct SAsyncLogRecord
+        {
+            uint32_t sinks; //The sinks that accepted the message when it was logged.
+            const char* tag;
+            uint32_t timestamp;
+            uint8_t level;
+            uint8_t core;
+            uint16_t length;
+            bool structured;
+            bool binary;
+            bool deduplicate;
+            char data[LOG_ASYNC_RECORD_SIZE];
+        };
+
+        static constexpr size_t MAX_ASYNC_EVICTIONS = 4; //Records a single message may evict under LogOverflow_DropOldest before it is dropped itself.
+
+        static_assert(LOG_MAX_SINKS <= 32, "LOG_MAX_SINKS must fit in a 32 bit mask.");
+        static SLogSink _sinks[LOG_MAX_SINKS];
+        static Diagnostic::ProfiledMutex _sinksMutex;
+
+        static LogRingBuffer<SAsyncLogRecord> _asyncBuffer;
+        static std::atomic<bool> _asyncEnabled;
+
+        static char _formatBuffers[configNUM_CORES][LOG_FORMAT_BUFFER_SIZE];
+        static std::atomic<bool> _formatBufferInUse[configNUM_CORES];
+        static ELogOverflowPolicy _overflowPolicy;
+        static TaskHandle_t _flushTask;
+        static std::atomic<uint32_t> _droppedMessages;
+        static uint32_t _reportedDroppedMessages;
+
+        //Runtime levels of the tags seen by the LOGx macros, indexed by the tag ID - 1.
+        static Diagnostic::ProfiledMutex _tagsMutex;
+        static const char* _tagNames[LOG_MAX_TAGS];
+        static std::atomic<uint8_t> _tagLevels[LOG_MAX_TAGS];
+        static size_t _tagCount;
+
+        static std::atomic<SLogCallsite*> _callsites;
+
+        //Duplicate suppression state, the last message written and how many identical messages have followed it.
+        static std::atomic<uint32_t> _lastMessageHash;
+        static std::atomic<uint32_t> _lastMessageSinks;
+        static std::atomic<uint32_t> _repeatedMessages;
+        static std::atomic<uint32_t> _lastRepeatReport;
+        static std::atomic<uint32_t> _lastSuppressedReport;
+
+        static constexpr uint16_t UNREGISTERED_TAG = 0;
+        static constexpr uint16_t UNCACHED_TAG = UINT16_MAX; //The tag table was full, the level is looked up by name instead.
+
+        static uint16_t RegisterTag(const char* tag)
+        {
+            //Can't take the mutex from an ISR, the call site will try again on its next call.
+            if (xPortInIsrContext())
+                return UNREGISTERED_TAG;
+
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_tagsMutex);
+            for (size_t i = 0; i < _tagCount; i++)
+                if (strcmp(_tagNames[i], tag) == 0)
+                    return i + 1;
+
+            if (_tagCount >= LOG_MAX_TAGS)
+                return UNCACHED_TAG;
+
+            _tagNames[_tagCount] = tag;
+            _tagLevels[_tagCount].store(esp_log_level_get(tag), std::memory_order_relaxed);
+            return ++_tagCount;
+        }
+
+        static FILE* GetConsoleStream()
+        {
+            FILE* stream = _consoleStream.load(std::memory_order_relaxed);
+            return stream != nullptr ? stream : stdout;
+        }
+
+        static void ConsoleSink(const SLogRecord& record, void* context)
+        {
+            FILE* stream = GetConsoleStream();
+            #ifdef _ENABLE_BINARY_LOG
+            if (record.binary)
+            {
+                BinaryLogEncoder::WriteEscaped((const uint8_t*)record.message, record.length, [stream](const uint8_t* data, size_t length) { fwrite(data, 1, length, stream); });
+                return;
+            }
+            #endif
+            fwrite(record.message, 1, record.length, stream);
+        }
+
+        /// @return A mask of the sinks that want the message, checked before formatting so messages that no sink wants are never formatted.
+        static uint32_t AcceptingSinks(esp_log_level_t level, const char* tag)
+        {
+            uint32_t sinks = 0;
+            for (size_t i = 0; i < LOG_MAX_SINKS; i++)
+            {
+                if (_sinks[i].writer.load(std::memory_order_acquire) == nullptr
+                    || (_sinks[i].levelMask.load(std::memory_order_relaxed) & LOG_LEVEL_MASK(level)) == 0)
+                    continue;
+
+                const char* tagPrefix = _sinks[i].tagPrefix.load(std::memory_order_relaxed);
+                if (tagPrefix != nullptr && (tag == nullptr || strncmp(tag, tagPrefix, strlen(tagPrefix)) != 0))
+                    continue;
+
+                sinks |= 1 << i;
+            }
+            return sinks;
+        }
+
+        /// @return True if the message is allowed by the call site's rate limit, allowing a burst of LOG_RATE_LIMIT_BURST messages and LOG_RATE_LIMIT_PER_SECOND after that.
+        static bool TryAcquireRate(SLogCallsite& callsite)
+        {
+            #if LOG_RATE_LIMIT_PER_SECOND == 0
+            return true;
+            #else
+            constexpr uint32_t interval = LOG_RATE_LIMIT_PER_SECOND >= 1000 ? 1 : 1000 / LOG_RATE_LIMIT_PER_SECOND;
+            constexpr uint32_t tolerance = interval * (LOG_RATE_LIMIT_BURST > 1 ? LOG_RATE_LIMIT_BURST - 1 : 0);
+
+            //Generic cell rate algorithm, equivalent to a token bucket but the whole state is a single timestamp so it can be updated with one CAS.
+            uint32_t now = esp_log_timestamp();
+            uint32_t theoreticalArrival = callsite.theoreticalArrival.load(std::memory_order_relaxed);
+            while (true)
+            {
+                uint32_t base = (int32_t)(theoreticalArrival - now) > 0 ? theoreticalArrival : now;
+                if (base - now > tolerance)
+                {
+                    callsite.suppressed.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (callsite.theoreticalArrival.compare_exchange_weak(theoreticalArrival, base + interval, std::memory_order_relaxed))
+                    return true;
+            }
+            #endif
+        }
+
+        /// @brief Hashes the parts of the message that identify it, skipping the prefix so that the timestamp doesn't make repeats look different.
+        static uint32_t HashMessage(const SLogRecord& record)
+        {
+            const char* begin = record.message;
+            const char* end = record.message + record.length;
+            #ifdef _ENABLE_BINARY_LOG
+            //From the format address onwards, which covers the tag and arguments.
+            begin += std::min<size_t>(record.length, BinaryLogEncoder::HEADER_SIZE - sizeof(uint32_t) * 2);
+            #else
+            for (const char* c = begin; c + 1 < end; c++)
+            {
+                if (c[0] == ':' && c[1] == ' ')
+                {
+                    begin = c + 2;
+                    break;
+                }
+            }
+            #endif
+
+            //FNV-1a.
+            uint32_t hash = 2166136261u ^ record.level;
+            hash *= 16777619u;
+            for (const char* c = begin; c < end; c++)
+            {
+                hash ^= (uint8_t)*c;
+                hash *= 16777619u;
+            }
+            for (uintptr_t tag = (uintptr_t)record.tag, i = 0; i < sizeof(tag); i++, tag >>= 8)
+            {
+                hash ^= (uint8_t)tag;
+                hash *= 16777619u;
+            }
+            return hash;
+        }
+
+        static void WriteNotice(uint32_t sinks, const char* format, ...)
+        {
+            char buf[96];
+            va_list args;
+            va_start(args, format);
+            int len = vsnprintf(buf, sizeof(buf), format, args);
+            va_end(args);
+            WriteToSinks(sinks, SLogRecord
+            {
+                .level = ESP_LOG_WARN,
+                .tag = "Logging",
+                .timestamp = esp_log_timestamp(),
+                .core = (uint8_t)xPortGetCoreID(),
+                .message = buf,
+                .length = len < 0 ? 0 : std::min<size_t>(len, sizeof(buf) - 1)
+            });
+        }
+
+        /// @brief Reports the number of times the last message was repeated if there are any pending.
+        static void ReportRepeats()
+        {
+            uint32_t repeated = _repeatedMessages.exchange(0, std::memory_order_relaxed);
+            _lastRepeatReport.store(esp_log_timestamp(), std::memory_order_relaxed);
+            if (repeated > 0)
+                WriteNotice(_lastMessageSinks.load(std::memory_order_relaxed), "[Logging] Last message repeated %u times.\r\n", (unsigned)repeated);
+        }
+
+        /// @brief Writes the message to the sinks unless it is identical to the previous message, in which case it is counted and reported later.
+        static void Dispatch(uint32_t sinks, const SLogRecord& record)
+        {
+            uint32_t hash = HashMessage(record);
+            if (_lastMessageHash.exchange(hash, std::memory_order_relaxed) == hash)
+            {
+                _repeatedMessages.fetch_add(1, std::memory_order_relaxed);
+                if (esp_log_timestamp() - _lastRepeatReport.load(std::memory_order_relaxed) >= LOG_REPEAT_REPORT_INTERVAL)
+                    ReportRepeats();
+                return;
+            }
+
+            ReportRepeats();
+            _lastMessageSinks.store(sinks, std::memory_order_relaxed);
+            WriteToSinks(sinks, record);
+        }
+
+        static void RegisterCallsite(SLogCallsite& callsite, const char* tag, uint16_t tagId)
+        {
+            //Only the first task to resolve the call site's tag adds it to the list.
+            uint16_t expected = UNREGISTERED_TAG;
+            if (!callsite.tagId.compare_exchange_strong(expected, tagId, std::memory_order_relaxed))
+                return;
+
+            callsite.tag = tag;
+            callsite.next = _callsites.load(std::memory_order_relaxed);
+            while (!_callsites.compare_exchange_weak(callsite.next, &callsite, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        static void MaybeReportSuppressed()
+        {
+            uint32_t now = esp_log_timestamp();
+            uint32_t lastReport = _lastSuppressedReport.load(std::memory_order_relaxed);
+            if (now - lastReport >= LOG_REPEAT_REPORT_INTERVAL && _lastSuppressedReport.compare_exchange_strong(lastReport, now, std::memory_order_relaxed))
+                ReportSuppressed();
+        }
+
+        static void WriteToSinks(uint32_t sinks, const SLogRecord& record)
+        {
+            for (size_t i = 0; sinks != 0; i++, sinks >>= 1)
+            {
+                if ((sinks & 1) == 0)
+                    continue;
+                //The sink may have been removed since the message was accepted. The write is counted before the writer is read so that RemoveSink can wait for it.
+                _sinks[i].writing.fetch_add(1);
+                TLogSinkWriter writer = _sinks[i].writer.load();
+                if (writer != nullptr)
+                    writer(record, _sinks[i].context.load(std::memory_order_relaxed));
+                _sinks[i].writing.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        static SAsyncLogRecord* ClaimAsyncRecord(size_t& position)
+        {
+            SAsyncLogRecord* record;
+            size_t evictions = 0;
+            while ((record = _asyncBuffer.TryClaim(position)) == nullptr)
+            {
+                //Blocking from the flush task (e.g. a sink that logs) or an ISR would never complete.
+                if (_overflowPolicy == LogOverflow_DropOldest)
+                {
+                    //The oldest record can't be evicted while its producer is between claiming and publishing it, which may be a task this one has preempted.
+                    //Spinning would then never let it finish, so fall back to dropping the new message, as with the bounded retries when other producers keep taking the freed cell.
+                    if (++evictions > MAX_ASYNC_EVICTIONS || !_asyncBuffer.TryConsume([](SAsyncLogRecord&) {}))
+                    {
+                        _droppedMessages.fetch_add(1, std::memory_order_relaxed);
+                        return nullptr;
+                    }
+                    _droppedMessages.fetch_add(1, std::memory_order_relaxed);
+                }
+                else if (_overflowPolicy == LogOverflow_Block && !xPortInIsrContext() && xTaskGetCurrentTaskHandle() != _flushTask)
+                {
+                    xTaskNotifyGive(_flushTask);
+                    vTaskDelay(1);
+                }
+                else
+                {
+                    _droppedMessages.fetch_add(1, std::memory_order_relaxed);
+                    return nullptr;
                 }
             }
+            return record;
+        }
 
-            //Format the string into the buffer.
-            vsnprintf(temp, len + 1, format, args);
+        static void PublishAsyncRecord(size_t position)
+        {
+            _asyncBuffer.Publish(position);
 
-            int written = writer(temp, len);
+            if (xPortInIsrContext())
+                vTaskNotifyGiveFromISR(_flushTask, NULL);
+            else
+                xTaskNotifyGive(_flushTask);
+        }
 
-            //Free dynamically allocated memory if it was used.
-            if (temp != preallocBuffer)
-                free(temp);
+        static void LogAsync(esp_log_level_t level, const char* tag, uint32_t sinks, const char* format, va_list args)
+        {
+            size_t position;
+            SAsyncLogRecord* record = ClaimAsyncRecord(position);
+            if (record == nullptr)
+                return;
 
-            // va_end(args); //End the variadic arguments.
+            record->sinks = sinks;
+            record->tag = tag;
+            record->timestamp = esp_log_timestamp();
+            record->level = level;
+            record->core = xPortGetCoreID();
+            record->structured = false;
+            record->binary = false;
+            record->deduplicate = true;
 
+            //Format directly into the claimed record, the flush task won't read it until it is published.
+            int len = vsnprintf(record->data, sizeof(record->data), format, args);
+            record->length = len < 0 ? 0 : std::min<size_t>(len, sizeof(record->data) - 1);
+            PublishAsyncRecord(position);
+        }
+
+        static void DrainAsync()
+        {
+            //Records are written in batches with a single flush at the end.
+            while (_asyncBuffer.TryConsume([](SAsyncLogRecord& record)
+            {
+                SLogRecord logRecord =
+                {
+                    .level = (esp_log_level_t)record.level,
+                    .tag = record.tag,
+                    .timestamp = record.timestamp,
+                    .core = record.core,
+                    .message = record.data,
+                    .length = record.length,
+                    .structured = record.structured,
+                    .binary = record.binary
+                };
+                if (record.deduplicate)
+                    Dispatch(record.sinks, logRecord);
+                else
+                    WriteToSinks(record.sinks, logRecord);
+            }));
+
+            uint32_t dropped = _droppedMessages.load(std::memory_order_relaxed);
+            if (dropped != _reportedDroppedMessages)
+            {
+                char buf[48];
+                int len = snprintf(buf, sizeof(buf), "[Logging] %u messages dropped.\r\n", (unsigned)(dropped - _reportedDroppedMessages));
+                WriteToSinks(AcceptingSinks(ESP_LOG_WARN, "Logging"), SLogRecord
+                {
+                    .level = ESP_LOG_WARN,
+                    .tag = "Logging",
+                    .timestamp = esp_log_timestamp(),
+                    .core = (uint8_t)xPortGetCoreID(),
+                    .message = buf,
+                    .length = std::min<size_t>(len, sizeof(buf) - 1)
+                });
+                _reportedDroppedMessages = dropped;
+            }
+
+            fflush(GetConsoleStream());
+        }
+
+        static void FlushTask(void* param)
+        {
+            while (true)
+            {
+                //Wakes up periodically even when idle so that suppressed messages are reported.
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_REPEAT_REPORT_INTERVAL));
+                DrainAsync();
+                MaybeReportSuppressed();
+            }
+        }
+
+        /// @brief Calls the callback with a buffer that isn't shared with any other in-progress call.
+        /// @param callback int(char* buffer, size_t size)
+        template <typename TCallback>
+        static int WithFormatBuffer(TCallback&& callback)
+        {
+            //Use this core's buffer if it is free, otherwise another task on this core was preempted while logging (or this is an ISR that interrupted one) so fall back to a small stack buffer.
+            size_t core = xPortGetCoreID();
+            bool ownsCoreBuffer = !_formatBufferInUse[core].exchange(true, std::memory_order_acquire);
+            char stackBuffer[LOG_STACK_FORMAT_BUFFER_SIZE];
+
+            int written = ownsCoreBuffer
+                ? callback(_formatBuffers[core], (size_t)LOG_FORMAT_BUFFER_SIZE)
+                : callback(stackBuffer, (size_t)LOG_STACK_FORMAT_BUFFER_SIZE);
+
+            if (ownsCoreBuffer)
+                _formatBufferInUse[core].store(false, std::memory_order_release);
             return written;
         }
 
-        #ifdef _ENABLE_STDOUT_HOOK
+        /// @brief Ends a message that didn't fit in its buffer with "...", keeping the trailing newline so the next message still starts on its own line.
+        /// @return The length of the truncated message.
+        static size_t MarkTruncated(char* buffer, size_t size, bool newline)
+        {
+            const char* marker = newline ? "...\n" : "...";
+            size_t markerLength = strlen(marker);
+            size_t length = size - 1;
+            memcpy(buffer + length - markerLength, marker, markerLength);
+            buffer[length] = '\0';
+            return length;
+        }
+
+        /// @brief Formats into a buffer that isn't shared with any other in-progress call and passes the result to the writer as a single block, without using the heap.
+        /// @note Messages longer than the buffer are truncated and end with "...".
+        template <typename TWriter>
+        static int FormatWrite(TWriter&& writer, const char* format, va_list args)
+        {
+            return WithFormatBuffer([&](char* buffer, size_t size)
+            {
+                int len = vsnprintf(buffer, size, format, args);
+                if (len < 0)
+                {
+                    len = 0;
+                }
+                else if ((size_t)len >= size)
+                {
+                    size_t formatLength = strlen(format);
+                    len = MarkTruncated(buffer, size, formatLength > 0 && format[formatLength - 1] == '\n');
+                }
+                return writer(buffer, (size_t)len);
+            });
+        }
+
+        /// @brief Writes a record that has already been formatted, through the async buffer if it is enabled.
+        /// @param deduplicate Whether the record takes part in the repeated message suppression.
+        static void EmitRecord(uint32_t sinks, const SLogRecord& record, bool deduplicate)
+        {
+            if (!_asyncEnabled.load(std::memory_order_relaxed))
+            {
+                if (deduplicate)
+                    Dispatch(sinks, record);
+                else
+                    WriteToSinks(sinks, record);
+                return;
+            }
+
+            //Text can be cut short, but a truncated CBOR map or binary frame can't be decoded so it is dropped instead.
+            if ((record.structured || record.binary) && record.length > sizeof(SAsyncLogRecord::data))
+            {
+                _droppedMessages.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            size_t position;
+            SAsyncLogRecord* asyncRecord = ClaimAsyncRecord(position);
+            if (asyncRecord == nullptr)
+                return;
+
+            asyncRecord->sinks = sinks;
+            asyncRecord->tag = record.tag;
+            asyncRecord->timestamp = record.timestamp;
+            asyncRecord->level = record.level;
+            asyncRecord->core = record.core;
+            asyncRecord->length = std::min(record.length, sizeof(asyncRecord->data));
+            asyncRecord->structured = record.structured;
+            asyncRecord->binary = record.binary;
+            asyncRecord->deduplicate = deduplicate;
+            memcpy(asyncRecord->data, record.message, asyncRecord->length);
+            PublishAsyncRecord(position);
+        }
+
+        static uint32_t StructuredSinks()
+        {
+            uint32_t sinks = 0;
+            for (size_t i = 0; i < LOG_MAX_SINKS; i++)
+                if (_sinks[i].structured.load(std::memory_order_relaxed))
+                    sinks |= 1 << i;
+            return sinks;
+        }
+
+        static void EncodeFields(CborEncoder& encoder) {}
+
+        template <typename TValue, typename... TFields>
+        static void EncodeFields(CborEncoder& encoder, const char* key, const TValue& value, const TFields&... fields)
+        {
+            encoder.Text(key);
+            LogFields::Encode(encoder, value);
+            EncodeFields(encoder, fields...);
+        }
+
+        static void RenderFields(char* buffer, size_t size, size_t& length) {}
+
+        template <typename TValue, typename... TFields>
+        static void RenderFields(char* buffer, size_t size, size_t& length, const char* key, const TValue& value, const TFields&... fields)
+        {
+            if (length < size)
+                length += snprintf(buffer + length, size - length, " %s=", key);
+            if (length < size)
+                length += LogFields::Render(buffer + length, size - length, value);
+            RenderFields(buffer, size, length, fields...);
+        }
+
+        /// @brief Passes output that didn't come through the LOGx macros to the sinks that accept ESP_LOG_NONE, through the async buffer if it is enabled.
+        static void LogRaw(const char* data, size_t length)
+        {
+            uint32_t sinks = AcceptingSinks(ESP_LOG_NONE, nullptr);
+            if (sinks == 0)
+                return;
+
+            //Split so that long output isn't truncated by the async record size.
+            size_t chunkSize = _asyncEnabled.load(std::memory_order_relaxed) ? LOG_ASYNC_RECORD_SIZE : length;
+            for (size_t offset = 0; offset < length; offset += chunkSize)
+            {
+                EmitRecord(sinks, SLogRecord
+                {
+                    .level = ESP_LOG_NONE,
+                    .tag = nullptr,
+                    .timestamp = esp_log_timestamp(),
+                    .core = (uint8_t)xPortGetCoreID(),
+                    .message = data + offset,
+                    .length = std::min(chunkSize, length - offset)
+                }, false);
+            }
+        }
+
+        static SStdoutLine* FindStdoutLine(TaskHandle_t task, bool claim)
+        {
+            for (size_t i = 0; i < LOG_STDOUT_TASKS; i++)
+                if (_stdoutLines[i].task.load(std::memory_order_relaxed) == task)
+                    return &_stdoutLines[i];
+            if (!claim)
+                return nullptr;
+
+            for (size_t i = 0; i < LOG_STDOUT_TASKS; i++)
+            {
+                TaskHandle_t expected = nullptr;
+                if (_stdoutLines[i].task.compare_exchange_strong(expected, task, std::memory_order_acquire, std::memory_order_relaxed))
+                {
+                    _stdoutLines[i].length = 0;
+                    return &_stdoutLines[i];
+                }
+            }
+            return nullptr;
+        }
+
+        //Only the task that owns the line touches it, so the sinks are run straight from its buffer.
+        static void AppendStdoutLine(SStdoutLine& line, const char* data, size_t length, bool complete)
+        {
+            while (length > 0)
+            {
+                size_t chunk = std::min(length, LOG_STDOUT_LINE_SIZE - line.length);
+                memcpy(line.data + line.length, data, chunk);
+                line.length += chunk;
+                data += chunk;
+                length -= chunk;
+                if (line.length == LOG_STDOUT_LINE_SIZE)
+                {
+                    LogRaw(line.data, line.length);
+                    line.length = 0;
+                }
+            }
+            if (complete && line.length > 0)
+            {
+                LogRaw(line.data, line.length);
+                line.length = 0;
+            }
+        }
+
         static int StdoutHook(void* cookie, const char* data, int size)
         {
-            int retval = fputs(data, ORIGINAL_STDOUT); //Avoids the newline character that puts adds.
-            for (auto logger : AdditionalLoggers)
-                logger(data, size);
-            return retval;
+            //Locking is disabled on the stream (see OverrideStdout) so no lock is held here while the sinks run.
+            //Partial lines are kept per task so that a line from a task that was preempted part way through isn't joined with one from the task that preempted it.
+            TaskHandle_t task = xTaskGetCurrentTaskHandle();
+            SStdoutLine* line = task == nullptr ? nullptr : FindStdoutLine(task, false);
+            for (int offset = 0; offset < size;)
+            {
+                const char* newline = (const char*)memchr(data + offset, '\n', size - offset);
+                int end = newline == nullptr ? size : newline - data + 1;
+                if (newline == nullptr && line == nullptr && task != nullptr)
+                    line = FindStdoutLine(task, true);
+
+                if (line != nullptr)
+                    AppendStdoutLine(*line, data + offset, end - offset, newline != nullptr);
+                else
+                    LogRaw(data + offset, end - offset); //Complete lines (or partial ones when there is no free slot) don't need buffering.
+                offset = end;
+            }
+
+            if (line != nullptr && line->length == 0)
+                line->task.store(nullptr, std::memory_order_release);
+            return size;
+        }
+
+        /// @return The level of a message written by esp_log, from the letter at the start of its LOG_FORMAT prefix (after the optional colour code).
+        static esp_log_level_t ParseEspLogLevel(const char* format)
+        {
+            if (format[0] == '\033')
+            {
+                format = strchr(format, 'm');
+                if (format == nullptr)
+                    return ESP_LOG_NONE;
+                format++;
+            }
+
+            if (format[0] == '\0' || format[1] != ' ' || format[2] != '(')
+                return ESP_LOG_NONE;
+
+            switch (format[0])
+            {
+            case 'E': return ESP_LOG_ERROR;
+            case 'W': return ESP_LOG_WARN;
+            case 'I': return ESP_LOG_INFO;
+            case 'D': return ESP_LOG_DEBUG;
+            case 'V': return ESP_LOG_VERBOSE;
+            default: return ESP_LOG_NONE;
+            }
+        }
+
+        static int EspLogVprintf(const char* format, va_list args)
+        {
+            //esp_log has already filtered by its own levels. The tag is only available as formatted text so component output shares a single tag.
+            LogUnfilteredV(ParseEspLogLevel(format), "esp_log", format, args);
+            return 0;
         }
-        #endif
 
     public:
-        static std::vector<std::function<int(const char*, size_t)>> AdditionalLoggers;
+        static constexpr int CONSOLE_SINK = 0; //Writes to stdout, registered by default.
 
-        #ifdef _ENABLE_STDOUT_HOOK
-        //DO NOT USE THIS FOR NOW, IT IS NOT COMPLETE.
-        static void OverrideStdout()
+        /// @brief Registers a sink that is called with every message that passes its filters.
+        /// @param writer Called on the logging task (or the flush task in async mode), it must not block for long and must be safe to call from any task the application logs from.
+        /// @param levelMask A mask of LOG_LEVEL_MASK values, messages are formatted once no matter how many sinks accept them.
+        /// @param tagPrefix Only accept tags that start with this string (e.g. nameof(Network)), nullptr to accept all tags. Must remain valid while the sink is registered.
+        /// @param structured Receive LOGx_KV messages as a CBOR map (with SLogRecord::structured set) instead of rendered text.
+        /// @return The sink ID, or -1 if LOG_MAX_SINKS sinks are already registered.
+        static int AddSink(TLogSinkWriter writer, void* context = nullptr, uint8_t levelMask = LOG_LEVEL_MASK_ALL, const char* tagPrefix = nullptr, bool structured = false)
         {
-            xSemaphoreTake(_mutex, portMAX_DELAY);
-            if (_buffer != nullptr)
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_sinksMutex);
+            for (size_t i = 0; i < LOG_MAX_SINKS; i++)
             {
-                xSemaphoreGive(_mutex);
+                if (_sinks[i].writer.load(std::memory_order_relaxed) != nullptr)
+                    continue;
+
+                _sinks[i].context.store(context, std::memory_order_relaxed);
+                _sinks[i].levelMask.store(levelMask, std::memory_order_relaxed);
+                _sinks[i].tagPrefix.store(tagPrefix, std::memory_order_relaxed);
+                _sinks[i].structured.store(structured, std::memory_order_relaxed);
+                _sinks[i].writer.store(writer, std::memory_order_release);
+                return i;
+            }
+            return -1;
+        }
+
+        /// @brief Removes the sink and waits for any writes to it that are in progress, after which its context can be freed.
+        /// @note Must not be called from the sink's own writer or from an ISR.
+        static void RemoveSink(int sink)
+        {
+            if (sink < 0 || sink >= LOG_MAX_SINKS)
                 return;
+            {
+                std::lock_guard<Diagnostic::ProfiledMutex> lock(_sinksMutex);
+                _sinks[sink].writer.store(nullptr);
+            }
+            while (_sinks[sink].writing.load(std::memory_order_acquire) != 0)
+                vTaskDelay(1);
+        }
+
+        static void SetSinkFilter(int sink, uint8_t levelMask, const char* tagPrefix = nullptr)
+        {
+            if (sink < 0 || sink >= LOG_MAX_SINKS)
+                return;
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_sinksMutex);
+            _sinks[sink].levelMask.store(levelMask, std::memory_order_relaxed);
+            _sinks[sink].tagPrefix.store(tagPrefix, std::memory_order_relaxed);
+        }
+
+        /// @brief Routes esp_log output from ESP-IDF components and anything printed to stdout through the sinks, so they share the filtering, async buffer and outputs of the LOGx macros.
+        /// @note esp_log output is captured with the tag "esp_log" and the level read from its prefix, stdout output is passed on a line at a time with the level ESP_LOG_NONE.
+        /// stdout is per task in newlib, tasks that were created before this is called keep writing to the original stdout (their esp_log output is still captured).
+        static esp_err_t OverrideStdout()
+        {
+            if (_outputCaptured.exchange(true))
+                return ESP_OK;
+
+            //Unbuffered, the line buffering is done per task in StdoutHook.
+            FILE* stream = fwopen(NULL, &StdoutHook);
+            if (stream == NULL)
+            {
+                _outputCaptured = false;
+                return ESP_FAIL;
+            }
+            setvbuf(stream, NULL, _IONBF, 0);
+            //Otherwise newlib holds the stream's lock across StdoutHook, and so across every sink. An unbuffered stream has no shared buffer for the lock to protect.
+            __fsetlocking(stream, FSETLOCKING_BYCALLER);
+
+            _consoleStream = stdout;
+            #ifdef _REENT_STDOUT
+            _REENT_STDOUT(_GLOBAL_REENT) = stream;
+            #else
+            _GLOBAL_REENT->_stdout = stream;
+            #endif
+            stdout = stream;
+
+            esp_log_set_vprintf(&EspLogVprintf);
+            return ESP_OK;
+        }
+
+        /// @brief Switches logging to async mode, where callers format into a lock-free ring buffer and a low priority task writes the messages to stdout and the additional loggers.
+        /// @param capacity The number of messages that can be queued, rounded up to a power of two. The buffer is only allocated on the first call.
+        static esp_err_t EnableAsync(size_t capacity = 32, ELogOverflowPolicy overflowPolicy = LogOverflow_DropNewest, UBaseType_t priority = tskIDLE_PRIORITY + 1, uint32_t stackDepth = 3072, int core = -1)
+        {
+            _overflowPolicy = overflowPolicy;
+
+            if (_flushTask == NULL)
+            {
+                if (!_asyncBuffer.Init(capacity))
+                    return ESP_ERR_NO_MEM;
+
+                BaseType_t taskCreateResult;
+                #if configNUM_CORES > 1
+                if (core != -1)
+                    taskCreateResult = xTaskCreatePinnedToCore(FlushTask, "logFlush", stackDepth, NULL, priority, &_flushTask, core);
+                else
+                #endif
+                    taskCreateResult = xTaskCreate(FlushTask, "logFlush", stackDepth, NULL, priority, &_flushTask);
+
+                if (taskCreateResult != pdPASS)
+                {
+                    _flushTask = NULL;
+                    return ESP_FAIL;
+                }
+            }
+
+            _asyncEnabled = true;
+            return ESP_OK;
+        }
+
+        /// @brief Returns to synchronous logging once the queued messages have been written.
+        static void DisableAsync()
+        {
+            _asyncEnabled = false;
+            Flush();
+        }
+
+        /// @brief Waits for all queued messages to be written.
+        static bool Flush(TickType_t timeout = portMAX_DELAY)
+        {
+            if (_flushTask == NULL)
+                return true;
+
+            TickType_t start = xTaskGetTickCount();
+            while (!_asyncBuffer.Empty())
+            {
+                if (timeout != portMAX_DELAY && xTaskGetTickCount() - start >= timeout)
+                    return false;
+                xTaskNotifyGive(_flushTask);
+                vTaskDelay(1);
+            }
+            return true;
+        }
+
+        /// @return The total number of messages dropped because the async buffer was full.
+        static uint32_t GetDroppedMessages()
+        {
+            return _droppedMessages.load(std::memory_order_relaxed);
+        }
+
+        /// @brief Checks the runtime level of a tag and the call site's rate limit, used by the LOGx macros.
+        /// @param callsite The call site's state, its tag ID is resolved on the first call.
+        static inline bool IsEnabled(esp_log_level_t level, const char* tag, SLogCallsite& callsite)
+        {
+            uint16_t id = callsite.tagId.load(std::memory_order_relaxed);
+            if (id == UNREGISTERED_TAG)
+            {
+                id = RegisterTag(tag);
+                if (id != UNREGISTERED_TAG)
+                    RegisterCallsite(callsite, tag, id);
+            }
+
+            esp_log_level_t localLevel;
+            if (id == UNREGISTERED_TAG || id == UNCACHED_TAG)
+                localLevel = esp_log_level_get(tag);
+            else
+                localLevel = (esp_log_level_t)_tagLevels[id - 1].load(std::memory_order_relaxed);
+            if (level == ESP_LOG_NONE || level > localLevel)
+                return false;
+
+            //Checked after the level so that disabled messages don't use up the call site's rate.
+            if (!TryAcquireRate(callsite))
+                return false;
+
+            //In async mode the flush task reports periodically instead.
+            if (!_asyncEnabled.load(std::memory_order_relaxed))
+                MaybeReportSuppressed();
+            return true;
+        }
+
+        /// @brief Writes out the counts of messages dropped by the rate limit and duplicate suppression since they were last reported.
+        /// @note This is called periodically by the flush task in async mode and by later log calls otherwise.
+        static void ReportSuppressed()
+        {
+            ReportRepeats();
+            for (SLogCallsite* callsite = _callsites.load(std::memory_order_acquire); callsite != nullptr; callsite = callsite->next)
+            {
+                uint32_t suppressed = callsite->suppressed.exchange(0, std::memory_order_relaxed);
+                if (suppressed > 0)
+                    WriteNotice(AcceptingSinks(ESP_LOG_WARN, callsite->tag), "[Logging] %s: %u messages suppressed by the rate limit.\r\n", callsite->tag, (unsigned)suppressed);
             }
-            _buffer = (char*)malloc(BUFFER_SIZE);
-            stdout = fwopen(NULL, &StdoutHook);
-            setvbuf(stdout, _buffer, _IOLBF, BUFFER_SIZE);
-            xSemaphoreGive(_mutex);
         }
-        #endif
+
+        /// @brief Sets the runtime level of a tag (or "*" for the default), this should be used instead of esp_log_level_set so that the levels cached for the LOGx macros are updated.
+        /// @note Levels above the tag's compile time maximum (LOG_MAX_LEVEL or LOG_TAG_LEVELS) have no effect on the LOGx macros.
+        static void SetLevel(const char* tag, esp_log_level_t level)
+        {
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_tagsMutex);
+            esp_log_level_set(tag, level);
+            //Setting the default changes every tag without its own level so refresh them all from the esp_log table.
+            for (size_t i = 0; i < _tagCount; i++)
+                _tagLevels[i].store(esp_log_level_get(_tagNames[i]), std::memory_order_relaxed);
+        }
 
         static void Log(esp_log_level_t level, const char* tag, const char* format, ...)
         {
@@ -127,30 +942,187 @@ namespace ReadieFur
 
             va_list args;
             va_start(args, format);
+            LogUnfilteredV(level, tag, format, args);
+            va_end(args);
+        }
 
-            //The more loggers that are added the slower the program will be, even adding just one additional logger will slow the program down as we now have to do the formatting twice.
-            //I can resolve the above issue by outputting directly to the ESP log buffer instead of using the esp_log_writev function which will format the message internally.
-            //Reading through the esp-idf source code esp_log_writev writes to vprintf from stdio.h, so I should instead find a direct write function in this file.
-            //Given the internal log method uses vprintf, the output will go to the default IO stream so I don't need to find the output file that is used.
+        /// @brief Writes a message that has already passed the level checks to the sinks that accept it.
+        static void LogUnfiltered(esp_log_level_t level, const char* tag, const char* format, ...)
+        {
+            va_list args;
+            va_start(args, format);
+            LogUnfilteredV(level, tag, format, args);
+            va_end(args);
+        }
 
-            #ifdef _ENABLE_STDOUT_HOOK
-            esp_log_writev(level, tag, format, args);
-            #endif
+        static void LogUnfilteredV(esp_log_level_t level, const char* tag, const char* format, va_list args)
+        {
+            uint32_t sinks = AcceptingSinks(level, tag);
+            if (sinks == 0)
+                return;
 
-            //TODO: Set a custom log level/tag for each additional logger.
-            //TODO: Change the stdout stream to a wrapped one that I can intercept and send to the additional loggers.
-            #ifndef _ENABLE_STDOUT_HOOK
-            FormatWrite([](const char* data, size_t len)
+            if (_asyncEnabled.load(std::memory_order_relaxed))
             {
-                // puts(data);
-                fputs(data, stdout); //Avoids the newline character that puts adds.
-                for (auto logger : AdditionalLoggers)
-                    logger(data, len);
+                LogAsync(level, tag, sinks, format, args);
+                return;
+            }
+
+            SLogRecord record =
+            {
+                .level = level,
+                .tag = tag,
+                .timestamp = esp_log_timestamp(),
+                .core = (uint8_t)xPortGetCoreID()
+            };
+            FormatWrite([&record, sinks](const char* data, size_t len)
+            {
+                record.message = data;
+                record.length = len;
+                Dispatch(sinks, record);
                 return 0;
             }, format, args);
-            #endif
+        }
 
-            va_end(args);
+        /// @brief Logs a message with typed key/value fields, the level is not checked here, that is done by the LOGx_KV macros.
+        /// @note Structured sinks receive a CBOR map of {"tag", "level", "ts", "msg", fields...}, other sinks receive a text line with the fields as key=value.
+        /// These messages don't take part in the repeated message suppression since the values are the point of them.
+        template <typename... TFields>
+        static void LogKV(esp_log_level_t level, const char* tag, const char* message, const TFields&... fields)
+        {
+            static_assert(sizeof...(TFields) % 2 == 0, "Log fields must be passed as key/value pairs.");
+
+            uint32_t sinks = AcceptingSinks(level, tag);
+            if (sinks == 0)
+                return;
+
+            uint32_t structuredSinks = sinks & StructuredSinks();
+            uint32_t textSinks = sinks & ~structuredSinks;
+            SLogRecord record =
+            {
+                .level = level,
+                .tag = tag,
+                .timestamp = esp_log_timestamp(),
+                .core = (uint8_t)xPortGetCoreID()
+            };
+
+            if (structuredSinks != 0)
+            {
+                uint8_t buffer[LOG_KV_MAX_SIZE];
+                //In async mode the encoding also has to fit in a ring buffer record, so that an oversized map falls back to the truncated marker below rather than being dropped.
+                size_t capacity = _asyncEnabled.load(std::memory_order_relaxed) ? std::min<size_t>(sizeof(buffer), LOG_ASYNC_RECORD_SIZE) : sizeof(buffer);
+                CborEncoder encoder(buffer, capacity);
+                auto encodeHeader = [&](CborEncoder& encoder, size_t extraPairs)
+                {
+                    encoder.Map(4 + extraPairs);
+                    encoder.Text("tag");
+                    encoder.Text(tag);
+                    encoder.Text("level");
+                    encoder.Unsigned(level);
+                    encoder.Text("ts");
+                    encoder.Unsigned(record.timestamp);
+                    encoder.Text("msg");
+                    encoder.Text(message);
+                };
+                encodeHeader(encoder, sizeof...(TFields) / 2);
+                EncodeFields(encoder, fields...);
+
+                if (encoder.Truncated())
+                {
+                    //Drop the fields rather than send invalid CBOR.
+                    encoder = CborEncoder(buffer, capacity);
+                    encodeHeader(encoder, 1);
+                    encoder.Text("truncated");
+                    encoder.Bool(true);
+                }
+
+                if (!encoder.Truncated())
+                {
+                    record.message = (const char*)buffer;
+                    record.length = encoder.Length();
+                    record.structured = true;
+                    EmitRecord(structuredSinks, record, false);
+                }
+            }
+
+            if (textSinks != 0)
+            {
+                WithFormatBuffer([&](char* buffer, size_t size)
+                {
+                    size_t length = snprintf(buffer, size, "%c (%u) %s: %s", "NEWIDV"[level], (unsigned)record.timestamp, tag, message);
+                    RenderFields(buffer, size, length, fields...);
+                    if (length + 1 < size)
+                    {
+                        buffer[length++] = '\n';
+                        buffer[length] = '\0';
+                    }
+                    else
+                    {
+                        length = MarkTruncated(buffer, size, true);
+                    }
+
+                    record.message = buffer;
+                    record.length = length;
+                    record.structured = false;
+                    EmitRecord(textSinks, record, false);
+                    return 0;
+                });
+            }
+        }
+
+        //Never called, exists so that the binary log macros keep the compiler's printf format checking.
+        static inline void CheckFormat(const char* format, ...) __attribute__((format(printf, 1, 2))) {}
+
+        /// @brief Records the log call as a binary frame containing the format string address and the raw arguments, see BinaryLogEncoder for the layout.
+        /// @note The frames are written to stdout and the additional loggers in place of text, use tools/log_decoder.py with the firmware ELF to read them.
+        /// The level is not checked here, that is done by the LOGx macros.
+        template <typename... TArgs>
+        static void LogBinary(esp_log_level_t level, const char* tag, const char* format, TArgs... args)
+        {
+            uint32_t sinks = AcceptingSinks(level, tag);
+            if (sinks == 0)
+                return;
+
+            uint32_t timestamp = esp_log_timestamp();
+            uint8_t core = xPortGetCoreID();
+
+            if (_asyncEnabled.load(std::memory_order_relaxed))
+            {
+                //Encode straight into the ring buffer, the cost on the calling task is then just copying the arguments.
+                size_t position;
+                SAsyncLogRecord* record = ClaimAsyncRecord(position);
+                if (record == nullptr)
+                    return;
+
+                record->sinks = sinks;
+                record->tag = tag;
+                record->timestamp = timestamp;
+                record->level = level;
+                record->core = core;
+                record->structured = false;
+                record->binary = true;
+                record->deduplicate = true;
+                BinaryLogEncoder encoder((uint8_t*)record->data, sizeof(record->data));
+                encoder.EncodeAll(args...);
+                record->length = encoder.Finish(level, core, timestamp, format, tag);
+                PublishAsyncRecord(position);
+                return;
+            }
+
+            uint8_t frame[LOG_BINARY_MAX_FRAME_SIZE];
+            BinaryLogEncoder encoder(frame, sizeof(frame));
+            encoder.EncodeAll(args...);
+            size_t len = encoder.Finish(level, core, timestamp, format, tag);
+            Dispatch(sinks, SLogRecord
+            {
+                .level = level,
+                .tag = tag,
+                .timestamp = timestamp,
+                .core = core,
+                .message = (const char*)frame,
+                .length = len,
+                .structured = false,
+                .binary = true
+            });
         }
 
         static int Write(char c)
@@ -178,10 +1150,26 @@ namespace ReadieFur
     };
 };
 
-#ifdef _ENABLE_STDOUT_HOOK
-const size_t ReadieFur::Logging::BUFFER_SIZE = 128; //This value sets the maximum buffer before flushing. If the data is larger than this then it will be flushed in multiple parts.
-FILE* ReadieFur::Logging::ORIGINAL_STDOUT = stdout; //Set at program startup, should always be the original stdout.
-SemaphoreHandle_t ReadieFur::Logging::_mutex = xSemaphoreCreateMutex();
-char* ReadieFur::Logging::_buffer = nullptr;
-#endif
-std::vector<std::function<int(const char*, size_t)>> ReadieFur::Logging::AdditionalLoggers;
+std::atomic<bool> ReadieFur::Logging::_outputCaptured = false;
+std::atomic<FILE*> ReadieFur::Logging::_consoleStream = nullptr;
+ReadieFur::Logging::SStdoutLine ReadieFur::Logging::_stdoutLines[LOG_STDOUT_TASKS] = {};
+ReadieFur::Logging::SLogSink ReadieFur::Logging::_sinks[LOG_MAX_SINKS] = { { &ReadieFur::Logging::ConsoleSink, nullptr, LOG_LEVEL_MASK_ALL, nullptr, false } };
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Logging::_sinksMutex("Logging.Sinks");
+ReadieFur::LogRingBuffer<ReadieFur::Logging::SAsyncLogRecord> ReadieFur::Logging::_asyncBuffer;
+std::atomic<bool> ReadieFur::Logging::_asyncEnabled = false;
+std::atomic<ReadieFur::SLogCallsite*> ReadieFur::Logging::_callsites = nullptr;
+std::atomic<uint32_t> ReadieFur::Logging::_lastMessageHash = 0;
+std::atomic<uint32_t> ReadieFur::Logging::_lastMessageSinks = 0;
+std::atomic<uint32_t> ReadieFur::Logging::_repeatedMessages = 0;
+std::atomic<uint32_t> ReadieFur::Logging::_lastRepeatReport = 0;
+std::atomic<uint32_t> ReadieFur::Logging::_lastSuppressedReport = 0;
+char ReadieFur::Logging::_formatBuffers[configNUM_CORES][LOG_FORMAT_BUFFER_SIZE];
+std::atomic<bool> ReadieFur::Logging::_formatBufferInUse[configNUM_CORES] = {};
+ReadieFur::ELogOverflowPolicy ReadieFur::Logging::_overflowPolicy = ReadieFur::LogOverflow_DropNewest;
+TaskHandle_t ReadieFur::Logging::_flushTask = NULL;
+std::atomic<uint32_t> ReadieFur::Logging::_droppedMessages = 0;
+uint32_t ReadieFur::Logging::_reportedDroppedMessages = 0;
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Logging::_tagsMutex("Logging.Tags");
+const char* ReadieFur::Logging::_tagNames[LOG_MAX_TAGS] = {};
+std::atomic<uint8_t> ReadieFur::Logging::_tagLevels[LOG_MAX_TAGS] = {};
+size_t ReadieFur::Logging::_tagCount = 0;
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+
+#ifndef LOG_BINARY_MAX_FRAME_SIZE
+#define LOG_BINARY_MAX_FRAME_SIZE 128 //Arguments that don't fit are dropped and the frame is flagged as truncated.
+#endif
+
+namespace ReadieFur
+{
+    /// @brief Encodes log calls as compact frames that are formatted on the host (see tools/log_decoder.py).
+    /// @note Frame layout (little endian): sync (0xA5 0x5A), uint16 payload length, uint8 level (bit 7 set if truncated), uint8 core, uint32 timestamp (ms),
+    /// uint32 format string address, uint32 tag address, then the arguments. Arguments follow printf's default promotions: integers up to 32 bits are written as 4 bytes,
+    /// 64 bit integers as 8 bytes, floating point as an 8 byte double, strings as a uint8 length followed by the characters and any other pointer as its 4 byte address.
+    /// On the console the frame is escaped (see WriteEscaped) so that newlib's line ending translation can't alter it.
+    class BinaryLogEncoder
+    {
+    public:
+        static constexpr uint8_t SYNC_0 = 0xA5;
+        static constexpr uint8_t SYNC_1 = 0x5A;
+        static constexpr size_t HEADER_SIZE = 2 + sizeof(uint16_t) + sizeof(uint8_t) * 2 + sizeof(uint32_t) * 3;
+        static constexpr uint8_t TRUNCATED_FLAG = 0x80;
+        //SLIP style escaping, the escaped byte is followed by the original XORed with ESCAPE_XOR.
+        static constexpr uint8_t ESCAPE = 0xDB;
+        static constexpr uint8_t ESCAPE_XOR = 0x20;
+
+    private:
+        uint8_t* _buffer;
+        size_t _capacity;
+        size_t _length = HEADER_SIZE;
+        bool _truncated = false;
+
+        void Write(const void* data, size_t len)
+        {
+            if (_truncated || _length + len > _capacity)
+            {
+                _truncated = true;
+                return;
+            }
+            memcpy(_buffer + _length, data, len);
+            _length += len;
+        }
+
+        template <typename T>
+        void WriteValue(T value)
+        {
+            Write(&value, sizeof(T));
+        }
+
+        void WriteString(const char* value)
+        {
+            if (value == nullptr)
+                value = "(null)";
+            size_t len = strnlen(value, UINT8_MAX);
+            //Keep as much of a long string as fits, the remaining arguments are then dropped.
+            bool clipped = !_truncated && _length + 1 + len > _capacity && _length + 1 < _capacity;
+            if (clipped)
+                len = _capacity - _length - 1;
+            WriteValue<uint8_t>(len);
+            Write(value, len);
+            _truncated |= clipped;
+        }
+
+    public:
+        BinaryLogEncoder(uint8_t* buffer, size_t capacity) : _buffer(buffer), _capacity(capacity) {}
+
+        template <typename T>
+        void Encode(T value)
+        {
+            typedef typename std::decay<T>::type TValue;
+            if constexpr (std::is_same<TValue, const char*>::value || std::is_same<TValue, char*>::value)
+                WriteString(value);
+            else if constexpr (std::is_pointer<TValue>::value)
+                WriteValue<uint32_t>((uint32_t)(uintptr_t)value);
+            else if constexpr (std::is_floating_point<TValue>::value)
+                WriteValue<double>(value);
+            else if constexpr (std::is_enum<TValue>::value)
+                Encode(static_cast<typename std::underlying_type<TValue>::type>(value));
+            else if constexpr (std::is_integral<TValue>::value && sizeof(TValue) > sizeof(uint32_t))
+                WriteValue<uint64_t>((uint64_t)value);
+            else if constexpr (std::is_integral<TValue>::value && std::is_signed<TValue>::value)
+                WriteValue<int32_t>((int32_t)value);
+            else if constexpr (std::is_integral<TValue>::value)
+                WriteValue<uint32_t>((uint32_t)value);
+            else
+                static_assert(!std::is_same<TValue, TValue>::value, "Unsupported binary log argument type.");
+        }
+
+        template <typename... TArgs>
+        void EncodeAll(TArgs... args)
+        {
+            (Encode(args), ...);
+        }
+
+        /// @brief Writes the frame with every CR, LF and ESCAPE byte escaped, for streams that translate line endings (CONFIG_NEWLIB_STDOUT_LINE_ENDING_*).
+        /// @param writer void(const uint8_t* data, size_t length), called with chunks of the escaped frame.
+        template <typename TWriter>
+        static void WriteEscaped(const uint8_t* frame, size_t length, TWriter&& writer)
+        {
+            uint8_t chunk[64];
+            size_t chunkLength = 0;
+            for (size_t i = 0; i < length; i++)
+            {
+                if (chunkLength + 2 > sizeof(chunk))
+                {
+                    writer(chunk, chunkLength);
+                    chunkLength = 0;
+                }
+                uint8_t value = frame[i];
+                if (value == '\r' || value == '\n' || value == ESCAPE)
+                {
+                    chunk[chunkLength++] = ESCAPE;
+                    value ^= ESCAPE_XOR;
+                }
+                chunk[chunkLength++] = value;
+            }
+            if (chunkLength > 0)
+                writer(chunk, chunkLength);
+        }
+
+        /// @brief Writes the header once all arguments have been encoded.
+        /// @return The total frame length.
+        size_t Finish(uint8_t level, uint8_t core, uint32_t timestamp, const char* format, const char* tag)
+        {
+            _buffer[0] = SYNC_0;
+            _buffer[1] = SYNC_1;
+            uint16_t payloadLength = _length - HEADER_SIZE;
+            memcpy(_buffer + 2, &payloadLength, sizeof(payloadLength));
+            _buffer[4] = level | (_truncated ? TRUNCATED_FLAG : 0);
+            _buffer[5] = core;
+            uint32_t formatAddress = (uint32_t)(uintptr_t)format;
+            uint32_t tagAddress = (uint32_t)(uintptr_t)tag;
+            memcpy(_buffer + 6, &timestamp, sizeof(timestamp));
+            memcpy(_buffer + 10, &formatAddress, sizeof(formatAddress));
+            memcpy(_buffer + 14, &tagAddress, sizeof(tagAddress));
+            return _length;
+        }
+    };
+};
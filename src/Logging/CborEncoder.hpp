@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace ReadieFur
+{
+    /// @brief Writes CBOR (RFC 8949) items into a fixed size buffer.
+    /// @note Writes that don't fit are dropped and the encoder is marked as truncated, the output is then not valid CBOR and should be discarded.
+    class CborEncoder
+    {
+    private:
+        enum EMajorType : uint8_t
+        {
+            Cbor_Unsigned = 0,
+            Cbor_Negative = 1,
+            Cbor_Bytes = 2,
+            Cbor_Text = 3,
+            Cbor_Array = 4,
+            Cbor_Map = 5,
+            Cbor_Simple = 7
+        };
+
+        uint8_t* _buffer;
+        size_t _capacity;
+        size_t _length = 0;
+        bool _truncated = false;
+
+        bool Reserve(size_t length)
+        {
+            if (_truncated || _length + length > _capacity)
+            {
+                _truncated = true;
+                return false;
+            }
+            return true;
+        }
+
+        void WriteHead(EMajorType type, uint64_t argument)
+        {
+            uint8_t initial = type << 5;
+            if (argument < 24)
+            {
+                if (Reserve(1))
+                    _buffer[_length++] = initial | argument;
+                return;
+            }
+
+            //The argument follows in 1, 2, 4 or 8 big endian bytes.
+            uint8_t size = argument <= UINT8_MAX ? 1 : argument <= UINT16_MAX ? 2 : argument <= UINT32_MAX ? 4 : 8;
+            if (!Reserve(1 + size))
+                return;
+            _buffer[_length++] = initial | (size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27);
+            for (int i = size - 1; i >= 0; i--)
+                _buffer[_length++] = argument >> (i * 8);
+        }
+
+    public:
+        CborEncoder(uint8_t* buffer, size_t capacity) : _buffer(buffer), _capacity(capacity) {}
+
+        size_t Length() const { return _length; }
+        bool Truncated() const { return _truncated; }
+
+        void Map(size_t pairs) { WriteHead(Cbor_Map, pairs); }
+        void Array(size_t items) { WriteHead(Cbor_Array, items); }
+
+        void Unsigned(uint64_t value) { WriteHead(Cbor_Unsigned, value); }
+
+        void Signed(int64_t value)
+        {
+            if (value >= 0)
+                WriteHead(Cbor_Unsigned, value);
+            else
+                WriteHead(Cbor_Negative, (uint64_t)(-1 - value));
+        }
+
+        void Bool(bool value)
+        {
+            if (Reserve(1))
+                _buffer[_length++] = (Cbor_Simple << 5) | (value ? 21 : 20);
+        }
+
+        void Null()
+        {
+            if (Reserve(1))
+                _buffer[_length++] = (Cbor_Simple << 5) | 22;
+        }
+
+        void Double(double value)
+        {
+            if (!Reserve(9))
+                return;
+            uint64_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            _buffer[_length++] = (Cbor_Simple << 5) | 27;
+            for (int i = 7; i >= 0; i--)
+                _buffer[_length++] = bits >> (i * 8);
+        }
+
+        void Text(const char* value, size_t length)
+        {
+            WriteHead(Cbor_Text, length);
+            if (Reserve(length))
+            {
+                memcpy(_buffer + _length, value, length);
+                _length += length;
+            }
+        }
+
+        void Text(const char* value)
+        {
+            if (value == nullptr)
+                Null();
+            else
+                Text(value, strlen(value));
+        }
+
+        void Bytes(const uint8_t* value, size_t length)
+        {
+            WriteHead(Cbor_Bytes, length);
+            if (Reserve(length))
+            {
+                memcpy(_buffer + _length, value, length);
+                _length += length;
+            }
+        }
+    };
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+namespace ReadieFur
+{
+    enum ELogOverflowPolicy
+    {
+        LogOverflow_DropNewest, //Discard the message being logged.
+        LogOverflow_DropOldest, //Discard the oldest queued message to make room, or the new one if the oldest is still being written.
+        LogOverflow_Block //Wait for the flush task to make room, must not be used from an ISR.
+    };
+};
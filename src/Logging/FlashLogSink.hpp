@@ -0,0 +1,345 @@
+#pragma once
+
+#include "Logging.hpp"
+#include "SLogRecord.h"
+#include "SFlashLogEntry.h"
+#include <esp_partition.h>
+#include <esp_err.h>
+#include <esp_idf_version.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include "Diagnostic/ProfiledMutex.hpp"
+
+#ifndef LOG_FLASH_PAGE_SIZE
+#define LOG_FLASH_PAGE_SIZE 256 //Records are buffered in RAM until a whole flash page can be programmed.
+#endif
+
+namespace ReadieFur
+{
+    /// @brief A log sink that appends records to a raw data partition, used as a circular log so that the logs survive a reboot.
+    /// @note Sectors are used in turn so every sector sees the same number of erases. Each sector starts with a sequence number that is used to find the newest sector on boot.
+    /// Writes are buffered until a flash page is full, Flush is called or an error is logged. Programming and erasing flash stalls the writer so this works best with Logging::EnableAsync.
+    /// The default partition tables have no room for the log, so a custom one is required (CONFIG_PARTITION_TABLE_CUSTOM=y, CONFIG_PARTITION_TABLE_CUSTOM_FILENAME="partitions.csv"
+    /// or board_build.partitions in platformio.ini) with a data partition for it, e.g. the single app layout plus a log:
+    ///   nvs,      data, nvs,     0x9000,  0x6000,
+    ///   phy_init, data, phy,     0xf000,  0x1000,
+    ///   factory,  app,  factory, 0x10000, 1M,
+    ///   logs,     data, 0x40,    ,        64K,
+    class FlashLogSink
+    {
+    private:
+        static constexpr size_t SECTOR_SIZE = 4096;
+        static constexpr uint32_t SECTOR_MAGIC = 0x474F4C46; //"FLOG".
+        static constexpr uint16_t ERASED_LENGTH = 0xFFFF;
+
+        struct SSectorHeader
+        {
+            uint32_t magic;
+            uint32_t sequence;
+        };
+
+        struct SRecordHeader
+        {
+            uint16_t length; //ERASED_LENGTH marks the end of the records in a sector.
+            uint8_t level;
+            uint8_t core;
+            uint32_t timestamp;
+        };
+
+        static constexpr size_t MAX_MESSAGE_LENGTH = SECTOR_SIZE - sizeof(SSectorHeader) - sizeof(SRecordHeader);
+
+        Diagnostic::ProfiledMutex _mutex{"FlashLogSink"};
+        const esp_partition_t* _partition = nullptr;
+        size_t _sectorCount = 0;
+        size_t _sector = 0;
+        uint32_t _sequence = 0;
+        size_t _writeOffset = 0; //Partition offset of the next byte to append.
+        size_t _pendingOffset = 0; //Partition offset of _page[0].
+        size_t _pendingLength = 0;
+        uint8_t _page[LOG_FLASH_PAGE_SIZE];
+        int _sinkId = -1;
+
+        static size_t Align(size_t length)
+        {
+            return (length + 3) & ~(size_t)3;
+        }
+
+        esp_err_t FlushPage()
+        {
+            esp_err_t err = ESP_OK;
+            if (_pendingLength > 0)
+                err = esp_partition_write(_partition, _pendingOffset, _page, _pendingLength);
+            _pendingOffset = _writeOffset;
+            _pendingLength = 0;
+            return err;
+        }
+
+        esp_err_t Append(const void* data, size_t length)
+        {
+            const uint8_t* bytes = (const uint8_t*)data;
+            while (length > 0)
+            {
+                //The pending bytes never cross a page boundary so they can be programmed in one write.
+                size_t pageEnd = (_writeOffset / LOG_FLASH_PAGE_SIZE + 1) * LOG_FLASH_PAGE_SIZE;
+                size_t chunk = std::min(length, pageEnd - _writeOffset);
+                memcpy(_page + _pendingLength, bytes, chunk);
+                _pendingLength += chunk;
+                _writeOffset += chunk;
+                bytes += chunk;
+                length -= chunk;
+
+                if (_writeOffset == pageEnd)
+                    if (esp_err_t err = FlushPage(); err != ESP_OK)
+                        return err;
+            }
+            return ESP_OK;
+        }
+
+        esp_err_t StartSector(size_t sector, uint32_t sequence)
+        {
+            esp_err_t err = esp_partition_erase_range(_partition, sector * SECTOR_SIZE, SECTOR_SIZE);
+            if (err != ESP_OK)
+                return err;
+
+            SSectorHeader header = { .magic = SECTOR_MAGIC, .sequence = sequence };
+            err = esp_partition_write(_partition, sector * SECTOR_SIZE, &header, sizeof(header));
+            if (err != ESP_OK)
+                return err;
+
+            _sector = sector;
+            _sequence = sequence;
+            _writeOffset = sector * SECTOR_SIZE + sizeof(SSectorHeader);
+            _pendingOffset = _writeOffset;
+            _pendingLength = 0;
+            return ESP_OK;
+        }
+
+        /// @return The partition offset after the last complete record in the sector.
+        size_t FindSectorEnd(size_t sector)
+        {
+            size_t offset = sector * SECTOR_SIZE + sizeof(SSectorHeader);
+            size_t end = (sector + 1) * SECTOR_SIZE;
+            SRecordHeader header;
+            while (offset + sizeof(header) <= end
+                && esp_partition_read(_partition, offset, &header, sizeof(header)) == ESP_OK
+                && header.length != ERASED_LENGTH
+                && offset + sizeof(header) + header.length <= end)
+                offset += Align(sizeof(header) + header.length);
+            return std::min(offset, end);
+        }
+
+        esp_err_t AppendRecord(const SLogRecord& record)
+        {
+            size_t length = std::min(record.length, MAX_MESSAGE_LENGTH);
+            size_t total = Align(sizeof(SRecordHeader) + length);
+
+            //Records don't span sectors, move on to (and erase) the oldest sector when this one is full.
+            if (_writeOffset + total > (_sector + 1) * SECTOR_SIZE)
+            {
+                if (esp_err_t err = FlushPage(); err != ESP_OK)
+                    return err;
+                if (esp_err_t err = StartSector((_sector + 1) % _sectorCount, _sequence + 1); err != ESP_OK)
+                    return err;
+            }
+
+            SRecordHeader header =
+            {
+                .length = (uint16_t)length,
+                .level = (uint8_t)record.level,
+                .core = record.core,
+                .timestamp = record.timestamp
+            };
+            esp_err_t err = Append(&header, sizeof(header));
+            if (err == ESP_OK)
+                err = Append(record.message, length);
+            static const uint8_t padding[3] = { 0xFF, 0xFF, 0xFF };
+            if (err == ESP_OK)
+                err = Append(padding, total - sizeof(header) - length);
+
+            //Errors are often followed by a crash so don't leave them in RAM.
+            if (err == ESP_OK && record.level == ESP_LOG_ERROR)
+                err = FlushPage();
+            return err;
+        }
+
+        static void SinkWriter(const SLogRecord& record, void* context)
+        {
+            //Flash can't be written from an ISR.
+            if (xPortInIsrContext())
+                return;
+
+            FlashLogSink* self = static_cast<FlashLogSink*>(context);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(self->_mutex);
+            if (self->_partition != nullptr)
+                self->AppendRecord(record);
+        }
+
+    public:
+        ~FlashLogSink()
+        {
+            //Waits for any write that is still using this sink.
+            Unregister();
+            Flush();
+        }
+
+        /// @brief Opens the partition and finds where the previous boot stopped writing.
+        /// @param partitionLabel A data partition (any subtype) whose size is a multiple of 4KB, e.g. "logs, data, 0x40, , 64K" in the partition table.
+        esp_err_t Init(const char* partitionLabel = "logs")
+        {
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
+            if (_partition != nullptr)
+                return ESP_OK;
+
+            const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partitionLabel);
+            if (partition == nullptr)
+                return ESP_ERR_NOT_FOUND;
+            if (partition->size < SECTOR_SIZE * 2 || partition->size % SECTOR_SIZE != 0)
+                return ESP_ERR_INVALID_SIZE;
+
+            _partition = partition;
+            _sectorCount = partition->size / SECTOR_SIZE;
+
+            //The newest sector is the one with the highest sequence number.
+            bool found = false;
+            for (size_t i = 0; i < _sectorCount; i++)
+            {
+                SSectorHeader header;
+                if (esp_partition_read(_partition, i * SECTOR_SIZE, &header, sizeof(header)) != ESP_OK
+                    || header.magic != SECTOR_MAGIC || header.sequence == UINT32_MAX)
+                    continue;
+                if (!found || header.sequence > _sequence)
+                {
+                    found = true;
+                    _sector = i;
+                    _sequence = header.sequence;
+                }
+            }
+
+            esp_err_t err = ESP_OK;
+            if (found)
+            {
+                _writeOffset = FindSectorEnd(_sector);
+                _pendingOffset = _writeOffset;
+                _pendingLength = 0;
+            }
+            else
+            {
+                err = StartSector(0, 0);
+            }
+
+            if (err != ESP_OK)
+                _partition = nullptr;
+            return err;
+        }
+
+        /// @brief Adds this as a log sink, Init must have been called first.
+        /// @return The sink ID, or -1 if there was no free sink slot.
+        int Register(uint8_t levelMask = LOG_LEVEL_MASK_UP_TO(ESP_LOG_INFO), const char* tagPrefix = nullptr)
+        {
+            if (_sinkId == -1)
+                _sinkId = Logging::AddSink(&SinkWriter, this, levelMask, tagPrefix);
+            return _sinkId;
+        }
+
+        void Unregister()
+        {
+            if (_sinkId == -1)
+                return;
+            Logging::RemoveSink(_sinkId);
+            _sinkId = -1;
+        }
+
+        /// @brief Writes any records that are still buffered in RAM.
+        esp_err_t Flush()
+        {
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
+            if (_partition == nullptr)
+                return ESP_ERR_INVALID_STATE;
+            return FlushPage();
+        }
+
+        /// @brief Erases every stored record.
+        esp_err_t Erase()
+        {
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
+            if (_partition == nullptr)
+                return ESP_ERR_INVALID_STATE;
+
+            esp_err_t err = esp_partition_erase_range(_partition, 0, _partition->size);
+            if (err != ESP_OK)
+                return err;
+            return StartSector(0, _sequence + 1);
+        }
+
+        /// @brief Memory maps the partition and calls the callback with every stored record from oldest to newest.
+        /// @param callback bool(const SFlashLogEntry&), return false to stop iterating.
+        /// @note Logging to this sink blocks until the iteration completes, so the callback must not log.
+        template <typename TCallback>
+        esp_err_t ForEach(TCallback&& callback)
+        {
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
+            if (_partition == nullptr)
+                return ESP_ERR_INVALID_STATE;
+
+            if (esp_err_t err = FlushPage(); err != ESP_OK)
+                return err;
+
+            const void* mapped;
+            #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+            esp_partition_mmap_handle_t handle;
+            esp_err_t err = esp_partition_mmap(_partition, 0, _partition->size, ESP_PARTITION_MMAP_DATA, &mapped, &handle);
+            #else
+            spi_flash_mmap_handle_t handle;
+            esp_err_t err = esp_partition_mmap(_partition, 0, _partition->size, SPI_FLASH_MMAP_DATA, &mapped, &handle);
+            #endif
+            if (err != ESP_OK)
+                return err;
+
+            const uint8_t* data = (const uint8_t*)mapped;
+            //The sector after the current one is the oldest (if it has been written yet).
+            for (size_t i = 1; i <= _sectorCount; i++)
+            {
+                size_t sector = (_sector + i) % _sectorCount;
+                const uint8_t* sectorData = data + sector * SECTOR_SIZE;
+
+                SSectorHeader sectorHeader;
+                memcpy(&sectorHeader, sectorData, sizeof(sectorHeader));
+                if (sectorHeader.magic != SECTOR_MAGIC || sectorHeader.sequence == UINT32_MAX)
+                    continue;
+
+                size_t end = sector == _sector ? _writeOffset - sector * SECTOR_SIZE : SECTOR_SIZE;
+                size_t offset = sizeof(SSectorHeader);
+                bool keepGoing = true;
+                while (keepGoing && offset + sizeof(SRecordHeader) <= end)
+                {
+                    SRecordHeader header;
+                    memcpy(&header, sectorData + offset, sizeof(header));
+                    if (header.length == ERASED_LENGTH || offset + sizeof(header) + header.length > end)
+                        break;
+
+                    keepGoing = callback(SFlashLogEntry
+                    {
+                        .sequence = sectorHeader.sequence,
+                        .level = (esp_log_level_t)header.level,
+                        .core = header.core,
+                        .timestamp = header.timestamp,
+                        .message = (const char*)(sectorData + offset + sizeof(header)),
+                        .length = header.length
+                    });
+                    offset += Align(sizeof(header) + header.length);
+                }
+                if (!keepGoing)
+                    break;
+            }
+
+            #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+            esp_partition_munmap(handle);
+            #else
+            spi_flash_munmap(handle);
+            #endif
+            return ESP_OK;
+        }
+    };
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "CborEncoder.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <type_traits>
+
+namespace ReadieFur
+{
+    /// @brief A binary field value, encoded as a CBOR byte string and rendered as colon separated hex.
+    struct SLogBytes
+    {
+        const uint8_t* data;
+        size_t length;
+    };
+
+    inline SLogBytes LogMac(const uint8_t* mac)
+    {
+        return SLogBytes{ mac, 6 };
+    }
+
+    /// @brief Encodes and renders the typed values of the LOGx_KV macros.
+    class LogFields
+    {
+    public:
+        template <typename T>
+        static void Encode(CborEncoder& encoder, const T& value)
+        {
+            typedef typename std::decay<T>::type TValue;
+            if constexpr (std::is_same<TValue, SLogBytes>::value)
+                encoder.Bytes(value.data, value.length);
+            else if constexpr (std::is_same<TValue, const char*>::value || std::is_same<TValue, char*>::value)
+                encoder.Text(value);
+            else if constexpr (std::is_same<TValue, bool>::value)
+                encoder.Bool(value);
+            else if constexpr (std::is_floating_point<TValue>::value)
+                encoder.Double(value);
+            else if constexpr (std::is_enum<TValue>::value)
+                encoder.Signed((int64_t)value);
+            else if constexpr (std::is_integral<TValue>::value && std::is_signed<TValue>::value)
+                encoder.Signed(value);
+            else if constexpr (std::is_integral<TValue>::value)
+                encoder.Unsigned(value);
+            else
+                static_assert(!std::is_same<TValue, TValue>::value, "Unsupported log field type, pointers to binary data must be wrapped in SLogBytes.");
+        }
+
+        /// @return The number of characters that were (or would have been) written, as with snprintf.
+        template <typename T>
+        static int Render(char* buffer, size_t size, const T& value)
+        {
+            typedef typename std::decay<T>::type TValue;
+            if constexpr (std::is_same<TValue, SLogBytes>::value)
+            {
+                int written = 0;
+                for (size_t i = 0; i < value.length; i++)
+                {
+                    size_t offset = written < (int)size ? written : size;
+                    written += snprintf(buffer + offset, size - offset, i == 0 ? "%02X" : ":%02X", value.data[i]);
+                }
+                if (value.length == 0 && size > 0)
+                    buffer[0] = '\0';
+                return written;
+            }
+            else if constexpr (std::is_same<TValue, const char*>::value || std::is_same<TValue, char*>::value)
+                return snprintf(buffer, size, "\"%s\"", value == nullptr ? "(null)" : value);
+            else if constexpr (std::is_same<TValue, bool>::value)
+                return snprintf(buffer, size, "%s", value ? "true" : "false");
+            else if constexpr (std::is_floating_point<TValue>::value)
+                return snprintf(buffer, size, "%g", (double)value);
+            else if constexpr (std::is_enum<TValue>::value)
+                return snprintf(buffer, size, "%lld", (long long)value);
+            else if constexpr (std::is_integral<TValue>::value && std::is_signed<TValue>::value)
+                return snprintf(buffer, size, "%lld", (long long)value);
+            else if constexpr (std::is_integral<TValue>::value)
+                return snprintf(buffer, size, "%llu", (unsigned long long)value);
+            else
+                static_assert(!std::is_same<TValue, TValue>::value, "Unsupported log field type, pointers to binary data must be wrapped in SLogBytes.");
+        }
+    };
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+
+//The highest level that is compiled in for tags without an entry in LOG_TAG_LEVELS, calls above it compile to nothing (arguments included).
+#ifndef LOG_MAX_LEVEL
+#if defined(CONFIG_LOG_MAXIMUM_LEVEL) && !defined(ARDUINO)
+#define LOG_MAX_LEVEL CONFIG_LOG_MAXIMUM_LEVEL
+#else
+#define LOG_MAX_LEVEL ESP_LOG_VERBOSE
+#endif
+#endif
+
+//Per tag overrides of LOG_MAX_LEVEL, a comma terminated list of entries, e.g. -DLOG_TAG_LEVELS='{"Bluetooth::BLE", ESP_LOG_WARN}, {"EspNow", ESP_LOG_DEBUG},'
+#ifndef LOG_TAG_LEVELS
+#define LOG_TAG_LEVELS
+#endif
+
+//The number of distinct tags that can have their runtime level cached, tags beyond this fall back to esp_log_level_get.
+#ifndef LOG_MAX_TAGS
+#define LOG_MAX_TAGS 32
+#endif
+
+namespace ReadieFur
+{
+    struct SLogTagLevel
+    {
+        const char* tag;
+        esp_log_level_t maxLevel;
+    };
+
+    class LogFilter
+    {
+    private:
+        static constexpr SLogTagLevel TAG_LEVELS[] = { LOG_TAG_LEVELS { nullptr, ESP_LOG_NONE } };
+
+        static constexpr bool TagEquals(const char* a, const char* b)
+        {
+            while (*a != '\0' && *a == *b)
+            {
+                a++;
+                b++;
+            }
+            return *a == *b;
+        }
+
+    public:
+        /// @brief The highest level compiled in for the tag, must be evaluated with a string literal to be usable in a constant expression.
+        static constexpr esp_log_level_t MaxLevel(const char* tag)
+        {
+            for (size_t i = 0; TAG_LEVELS[i].tag != nullptr; i++)
+                if (TagEquals(TAG_LEVELS[i].tag, tag))
+                    return TAG_LEVELS[i].maxLevel;
+            return (esp_log_level_t)LOG_MAX_LEVEL;
+        }
+    };
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <new>
+#include <esp_heap_caps.h>
+
+namespace ReadieFur
+{
+    /// @brief A bounded lock-free multi-producer multi-consumer queue of fixed size records.
+    /// @note Based on Dmitry Vyukov's bounded MPMC queue, each cell carries a sequence number that tells producers and consumers whose turn it is.
+    template <typename TRecord>
+    class LogRingBuffer
+    {
+    private:
+        struct SCell
+        {
+            std::atomic<size_t> sequence;
+            TRecord record;
+        };
+
+        SCell* _cells = nullptr;
+        size_t _mask = 0;
+        std::atomic<size_t> _enqueuePos = 0;
+        std::atomic<size_t> _dequeuePos = 0;
+
+    public:
+        ~LogRingBuffer()
+        {
+            if (_cells != nullptr)
+                heap_caps_free(_cells);
+        }
+
+        /// @param capacity Rounded up to a power of two.
+        bool Init(size_t capacity, uint32_t caps = MALLOC_CAP_DEFAULT)
+        {
+            if (_cells != nullptr)
+                return true;
+
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+
+            _cells = (SCell*)heap_caps_malloc(size * sizeof(SCell), caps);
+            if (_cells == nullptr)
+                return false;
+
+            for (size_t i = 0; i < size; i++)
+                new (&_cells[i].sequence) std::atomic<size_t>(i);
+            _mask = size - 1;
+            return true;
+        }
+
+        size_t Capacity() const
+        {
+            return _mask + 1;
+        }
+
+        /// @brief Claims the next free record, it must be passed to Publish once written.
+        /// @return nullptr if the buffer is full.
+        TRecord* TryClaim(size_t& outPosition)
+        {
+            size_t position = _enqueuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                SCell& cell = _cells[position & _mask];
+                intptr_t difference = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)position;
+                if (difference == 0)
+                {
+                    if (_enqueuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        outPosition = position;
+                        return &cell.record;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    return nullptr;
+                }
+                else
+                {
+                    position = _enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        void Publish(size_t position)
+        {
+            _cells[position & _mask].sequence.store(position + 1, std::memory_order_release);
+        }
+
+        /// @brief Removes the oldest published record.
+        /// @param consumer Called with the record before its cell is released.
+        /// @return False if there were no published records.
+        template <typename TConsumer>
+        bool TryConsume(TConsumer&& consumer)
+        {
+            size_t position = _dequeuePos.load(std::memory_order_relaxed);
+            while (true)
+            {
+                SCell& cell = _cells[position & _mask];
+                intptr_t difference = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)(position + 1);
+                if (difference == 0)
+                {
+                    if (_dequeuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        consumer(cell.record);
+                        cell.sequence.store(position + _mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = _dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool Empty() const
+        {
+            return _enqueuePos.load(std::memory_order_relaxed) == _dequeuePos.load(std::memory_order_relaxed);
+        }
+    };
+};
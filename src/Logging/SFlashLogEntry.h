@@ -0,0 +1,18 @@
+#pragma once
+
+#include <esp_log.h>
+#include <stdint.h>
+#include <stddef.h>
+
+namespace ReadieFur
+{
+    struct SFlashLogEntry
+    {
+        uint32_t sequence; //The sequence number of the sector the entry was read from, increases across reboots.
+        esp_log_level_t level;
+        uint8_t core;
+        uint32_t timestamp; //Milliseconds since the boot that the entry was written in.
+        const char* message; //Points into the memory mapped partition, only valid during the callback. Not null terminated.
+        size_t length;
+    };
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+namespace ReadieFur
+{
+    /// @brief State kept for each LOGx call site, constant initialized so it costs nothing until the call site first runs.
+    struct SLogCallsite
+    {
+        std::atomic<uint16_t> tagId = 0;
+        std::atomic<uint32_t> theoreticalArrival = 0; //Rate limiter state (GCRA), the time in ms that the bucket is next empty.
+        std::atomic<uint32_t> suppressed = 0; //Messages dropped by the rate limiter since they were last reported.
+        const char* tag = nullptr;
+        SLogCallsite* next = nullptr; //All call sites that have run are kept in a list so their suppressed counts can be reported.
+    };
+};
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <esp_log.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOG_LEVEL_MASK(level) (1 << (level))
+#define LOG_LEVEL_MASK_UP_TO(level) ((1 << ((level) + 1)) - 1) //Includes ESP_LOG_NONE, which is used for raw output.
+#define LOG_LEVEL_MASK_ALL LOG_LEVEL_MASK_UP_TO(ESP_LOG_VERBOSE)
+
+namespace ReadieFur
+{
+    struct SLogRecord
+    {
+        esp_log_level_t level; //ESP_LOG_NONE for output that didn't come from the LOGx macros, e.g. Print.
+        const char* tag; //nullptr for raw output.
+        uint32_t timestamp; //Milliseconds, from esp_log_timestamp.
+        uint8_t core;
+        const char* message; //The formatted message including its prefix (or the encoded frame when built with _ENABLE_BINARY_LOG), not null terminated.
+        size_t length;
+        bool structured; //The message is a CBOR map from the LOGx_KV macros, only sent to sinks registered as structured.
+        bool binary; //The message is a BinaryLogEncoder frame rather than text, only when built with _ENABLE_BINARY_LOG.
+    };
+};
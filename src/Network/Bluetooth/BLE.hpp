@@ -15,6 +15,7 @@
 #include "SGattServerProfile.h"
 #include "SGattClientProfile.h"
 #include <mutex>
+#include "Diagnostic/ProfiledMutex.hpp"
 #include <algorithm>
 #include <esp_err.h>
 
@@ -43,7 +44,7 @@ namespace ReadieFur::Network::Bluetooth
         static esp_ble_adv_params_t _advertisingParams;
         static char* _deviceName;
         static uint32_t _passkey;
-        static std::mutex _mutex;
+        static Diagnostic::ProfiledMutex _mutex;
         static uint8_t _advConfigDone;
         static std::vector<SGattServerProfile*> _serverProfiles;
         static std::vector<SGattClientProfile*> _clientProfiles;
@@ -615,7 +616,7 @@ esp_ble_adv_params_t ReadieFur::Network::Bluetooth::BLE::_advertisingParams =
 };
 char* ReadieFur::Network::Bluetooth::BLE::_deviceName = nullptr;
 uint32_t ReadieFur::Network::Bluetooth::BLE::_passkey;
-std::mutex ReadieFur::Network::Bluetooth::BLE::_mutex;
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Network::Bluetooth::BLE::_mutex("BLE");
 uint8_t ReadieFur::Network::Bluetooth::BLE::_advConfigDone = 0;
 std::vector<ReadieFur::Network::Bluetooth::SGattServerProfile*> ReadieFur::Network::Bluetooth::BLE::_serverProfiles;
 std::vector<ReadieFur::Network::Bluetooth::SGattClientProfile*> ReadieFur::Network::Bluetooth::BLE::_clientProfiles;
@@ -11,6 +11,10 @@
 #include <map>
 #include <string.h>
 #include "SUUID.hpp"
+#include "Diagnostic/Trace.hpp"
+#include "Diagnostic/Metrics.hpp"
+#include "Diagnostic/ProfiledMutex.hpp"
+#include <esp_timer.h>
 
 namespace ReadieFur::Network::Bluetooth
 {
@@ -38,7 +42,13 @@ namespace ReadieFur::Network::Bluetooth
             TGattServerWriteCallback writeCallback;
         };
 
-        std::mutex _mutex;
+        //Shared by every service, the handle is what tells attributes apart and that doesn't make a useful metric name.
+        static Diagnostic::Counter _readsCounter;
+        static Diagnostic::Counter _writesCounter;
+        static Diagnostic::Counter _errorsCounter;
+        static Diagnostic::LatencyHistogram _callbackLatency;
+
+        Diagnostic::ProfiledMutex _mutex{"GattServerService"};
         bool _frozen = false;
         SUUID _serviceUUID;
         uint8_t _instanceId;
@@ -386,8 +396,12 @@ namespace ReadieFur::Network::Bluetooth
             }
             case ESP_GATTS_READ_EVT:
             {
+                TRACE_SPAN_ID("GATT", "Read", param->read.handle);
+                _readsCounter.Increment();
+
                 if (!_frozen)
                 {
+                    _errorsCounter.Increment();
                     esp_ble_gatts_send_response(gattsIf, param->read.conn_id, param->read.trans_id, ESP_GATT_NO_RESOURCES, nullptr);
                     break;
                 }
@@ -407,7 +421,9 @@ namespace ReadieFur::Network::Bluetooth
                 esp_gatt_status_t status;
                 if (attributeInfo.readCallback != nullptr)
                 {
+                    int64_t callbackStart = esp_timer_get_time();
                     status = attributeInfo.readCallback(rsp.attr_value.value, &rsp.attr_value.len);
+                    _callbackLatency.Record(esp_timer_get_time() - callbackStart);
                 }
                 else
                 {
@@ -416,13 +432,19 @@ namespace ReadieFur::Network::Bluetooth
                     memcpy(rsp.attr_value.value, attributeInfo.value, rsp.attr_value.len);
                     status = ESP_GATT_OK;
                 }
+                if (status != ESP_GATT_OK)
+                    _errorsCounter.Increment();
                 esp_ble_gatts_send_response(gattsIf, param->read.conn_id, param->read.trans_id, status, &rsp);
                 break;
             }
             case ESP_GATTS_WRITE_EVT:
             {
+                TRACE_SPAN_ID("GATT", "Write", param->write.handle);
+                _writesCounter.Increment();
+
                 if (!_frozen)
                 {
+                    _errorsCounter.Increment();
                     esp_ble_gatts_send_response(gattsIf, param->write.conn_id, param->write.trans_id, ESP_GATT_NO_RESOURCES, nullptr);
                     break;
                 }
@@ -435,7 +457,9 @@ namespace ReadieFur::Network::Bluetooth
                 esp_gatt_status_t status;
                 if (attributeInfo.writeCallback != nullptr)
                 {
+                    int64_t callbackStart = esp_timer_get_time();
                     status = attributeInfo.writeCallback(param->write.value, param->write.len);
+                    _callbackLatency.Record(esp_timer_get_time() - callbackStart);
                 }
                 else
                 {
@@ -444,6 +468,8 @@ namespace ReadieFur::Network::Bluetooth
                     //Instead send an error response.
                     status = ESP_GATT_WRITE_NOT_PERMIT;
                 }
+                if (status != ESP_GATT_OK)
+                    _errorsCounter.Increment();
                 esp_ble_gatts_send_response(gattsIf, param->write.conn_id, param->write.trans_id, status, nullptr);
                 break;
             }
@@ -455,3 +481,8 @@ namespace ReadieFur::Network::Bluetooth
         }
     };
 };
+
+ReadieFur::Diagnostic::Counter ReadieFur::Network::Bluetooth::GattServerService::_readsCounter("gatt_reads", "GATT read requests received.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::Bluetooth::GattServerService::_writesCounter("gatt_writes", "GATT write requests received.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::Bluetooth::GattServerService::_errorsCounter("gatt_errors", "GATT requests answered with an error status.");
+ReadieFur::Diagnostic::LatencyHistogram ReadieFur::Network::Bluetooth::GattServerService::_callbackLatency("gatt_callback_us", "Time spent in attribute read and write callbacks in microseconds.");
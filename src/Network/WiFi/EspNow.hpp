@@ -10,10 +10,14 @@
 #include <functional>
 #include <stdint.h>
 #include "Event/Event.hpp"
+#include "Diagnostic/Trace.hpp"
+#include "Diagnostic/Metrics.hpp"
+#include "Diagnostic/ProfiledMutex.hpp"
+#include <esp_timer.h>
 
 #define __ESP_NOW_HEADER UINT32_C(0xC679C7A5) //The header is used to recognise compatible messages received by the esp-now protocol, with the hopes that these bytes won't likely be found in other arbitrary data.
 #define __ESP_NOW_VERSION UINT8_C(1) //The major version of the esp-now protocol, minor versions don't need to be checked as they should be compatible with the same major version.
-#define __ESP_NOW_LOCK() std::lock_guard<std::mutex> lock(_mutex); if (!_initalized) return ESP_ERR_INVALID_STATE;
+#define __ESP_NOW_LOCK() std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex); if (!_initalized) return ESP_ERR_INVALID_STATE;
 #define __ESP_NOW_IF WIFI_IF_STA
 
 namespace ReadieFur::Network::WiFi
@@ -26,11 +30,16 @@ namespace ReadieFur::Network::WiFi
 
     private:
         static const uint8_t BROADCAST_ADDRESS[ESP_NOW_ETH_ALEN];
-        static std::mutex _mutex;
+        static Diagnostic::ProfiledMutex _mutex;
         static bool _initalized;
         static bool _doEncryption;
         static std::vector<uint8_t*> _peers;
         static std::vector<TEspNowReceiveCallback> _receiveCallbacks;
+        static Diagnostic::Counter _messagesSentCounter;
+        static Diagnostic::Counter _sendFailedCounter;
+        static Diagnostic::Counter _messagesReceivedCounter;
+        static Diagnostic::Counter _receiveInvalidCounter;
+        static Diagnostic::LatencyHistogram _sendLatency;
 
         enum EOperation : uint8_t
         {
@@ -47,6 +56,8 @@ namespace ReadieFur::Network::WiFi
         static void OnReceive(const esp_now_recv_info_t* info, const uint8_t* data, int len)
         #endif
         {
+            TRACE_SPAN_ID("EspNow", "OnReceive", len);
+
             //Mutex locks will not happen at the root of this function, avoids deadlocks that could otherwise occur.
 
             //Check if the data is for a QueryPeers request/response.
@@ -57,6 +68,7 @@ namespace ReadieFur::Network::WiFi
             if (readError != ESP_OK)
             {
                 LOGV(nameof(WiFi::EspNow), "Received invalid message: %s", esp_err_to_name(readError));
+                _receiveInvalidCounter.Increment();
                 return;
             }
 
@@ -71,6 +83,7 @@ namespace ReadieFur::Network::WiFi
             {
                 case EOperation::EspNowOp_Message:
                 {
+                    _messagesReceivedCounter.Increment();
                     //Forward the message onto any registered callbacks.
                     for (auto &&callback : _receiveCallbacks)
                         callback(srcMacAddress, payload, payloadLen);
@@ -154,6 +167,8 @@ namespace ReadieFur::Network::WiFi
 
         static esp_err_t Send(EOperation operation, const uint8_t* peerMac, const uint8_t* payload, int payloadLen)
         {
+            TRACE_SPAN_ID("EspNow", "Send", payloadLen);
+
             uint8_t* buffer = new uint8_t[sizeof(uint32_t) + sizeof(uint8_t) + sizeof(EOperation) + payloadLen];
             if (buffer == nullptr)
                 return ESP_ERR_NO_MEM;
@@ -163,9 +178,16 @@ namespace ReadieFur::Network::WiFi
             *(EOperation*)(buffer + sizeof(uint32_t) + sizeof(uint8_t)) = operation;
             memcpy(buffer + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(EOperation), payload, payloadLen);
 
+            int64_t sendStart = esp_timer_get_time();
             esp_err_t err = esp_now_send(peerMac, buffer, sizeof(uint32_t) + sizeof(uint8_t) + sizeof(EOperation) + payloadLen);
+            _sendLatency.Record(esp_timer_get_time() - sendStart);
             delete[] buffer;
 
+            if (err == ESP_OK)
+                _messagesSentCounter.Increment();
+            else
+                _sendFailedCounter.Increment();
+
             return err;
         }
 
@@ -194,7 +216,7 @@ namespace ReadieFur::Network::WiFi
         //If local encryption is enabled then autodiscovery will be disabled.
         static esp_err_t Init(const uint8_t* localEncryptionKey = nullptr)
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
             if (_initalized)
                 return ESP_OK;
 
@@ -264,7 +286,7 @@ namespace ReadieFur::Network::WiFi
 
         static esp_err_t Deinit()
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
             if (!_initalized)
                 return ESP_OK;
 
@@ -459,9 +481,14 @@ namespace ReadieFur::Network::WiFi
 };
 
 const uint8_t ReadieFur::Network::WiFi::EspNow::BROADCAST_ADDRESS[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
-std::mutex ReadieFur::Network::WiFi::EspNow::_mutex;
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Network::WiFi::EspNow::_mutex("EspNow");
 bool ReadieFur::Network::WiFi::EspNow::_initalized = false;
 bool ReadieFur::Network::WiFi::EspNow::_doEncryption = false;
 std::vector<uint8_t*> ReadieFur::Network::WiFi::EspNow::_peers;
 std::vector<ReadieFur::Network::WiFi::EspNow::TEspNowReceiveCallback> ReadieFur::Network::WiFi::EspNow::_receiveCallbacks;
 ReadieFur::Event::Event<const uint8_t*, uint8_t, bool> ReadieFur::Network::WiFi::EspNow::OnPeerDiscovered;
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::EspNow::_messagesSentCounter("espnow_messages_sent", "ESP-NOW frames queued for sending, including protocol frames.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::EspNow::_sendFailedCounter("espnow_send_failed", "ESP-NOW frames that could not be queued for sending.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::EspNow::_messagesReceivedCounter("espnow_messages_received", "ESP-NOW messages forwarded to the receive callbacks.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::EspNow::_receiveInvalidCounter("espnow_receive_invalid", "ESP-NOW frames dropped for having an invalid header.");
+ReadieFur::Diagnostic::LatencyHistogram ReadieFur::Network::WiFi::EspNow::_sendLatency("espnow_send_us", "Time spent in esp_now_send in microseconds.");
@@ -4,17 +4,18 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <esp_wifi.h>
+#include "Diagnostic/ProfiledMutex.hpp"
 #include "Event/Event.hpp"
 #include <mutex>
 
-#define __MODEM_LOCK() std::lock_guard<std::mutex> lock(_mutex); if (!_initalized) return ESP_ERR_INVALID_STATE;
+#define __MODEM_LOCK() std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex); if (!_initalized) return ESP_ERR_INVALID_STATE;
 
 namespace ReadieFur::Network::WiFi
 {
     class Modem
     {
     private:
-        static std::mutex _mutex;
+        static Diagnostic::ProfiledMutex _mutex;
         static bool _initalized;
         static esp_netif_t* _staNet;
         static esp_netif_t* _apNet;
@@ -50,7 +51,7 @@ namespace ReadieFur::Network::WiFi
 
         static esp_err_t Init()
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
 
             //Check if the instance is already initialized.
             if (Initalized())
@@ -90,7 +91,7 @@ namespace ReadieFur::Network::WiFi
 
         static esp_err_t Deinit()
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
 
             esp_err_t err = ESP_OK;
             if ((err = esp_wifi_stop()) != ESP_OK)
@@ -247,7 +248,7 @@ namespace ReadieFur::Network::WiFi
 
         static wifi_mode_t GetMode()
         {
-            std::lock_guard<std::mutex> lock(_mutex);
+            std::lock_guard<Diagnostic::ProfiledMutex> lock(_mutex);
             if (!Initalized())
                 return WIFI_MODE_MAX;
 
@@ -258,7 +259,7 @@ namespace ReadieFur::Network::WiFi
     };
 };
 
-std::mutex ReadieFur::Network::WiFi::Modem::_mutex;
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Network::WiFi::Modem::_mutex("Modem");
 bool ReadieFur::Network::WiFi::Modem::_initalized = false;
 esp_netif_t* ReadieFur::Network::WiFi::Modem::_staNet = nullptr;
 esp_netif_t* ReadieFur::Network::WiFi::Modem::_apNet = nullptr;
@@ -7,6 +7,8 @@
 #include "Logging.hpp"
 #include <freertos/semphr.h>
 #include "Modem.hpp"
+#include "Diagnostic/Metrics.hpp"
+#include <esp_timer.h>
 
 namespace ReadieFur::Network::WiFi
 {
@@ -19,6 +21,10 @@ namespace ReadieFur::Network::WiFi
         static const esp_partition_t* _otaPartition;
         static size_t _otaRecvBufferSize;
         static uint _otaRecvIntervalMs;
+        static Diagnostic::Counter _updatesStartedCounter;
+        static Diagnostic::Counter _updatesFailedCounter;
+        static Diagnostic::Counter _bytesReceivedCounter;
+        static Diagnostic::LatencyHistogram _writeLatency;
 
         static esp_err_t OtaProcess(httpd_req_t* req)
         {
@@ -43,6 +49,7 @@ namespace ReadieFur::Network::WiFi
 
             //Start the OTA process.
             LOGI(nameof(WiFi::OTA), "OTA update started...");
+            _updatesStartedCounter.Increment();
             err = esp_ota_begin(_otaPartition, OTA_SIZE_UNKNOWN, &_otaHandle);
             if (err != ESP_OK)
             {
@@ -50,6 +57,7 @@ namespace ReadieFur::Network::WiFi
                 httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA begin failed");
                 esp_ota_abort(_otaHandle);
                 _otaHandle = 0;
+                _updatesFailedCounter.Increment();
                 return ESP_FAIL;
             }
             LOGV(nameof(WiFi::OTA), "OTA partition initialized.");
@@ -62,6 +70,7 @@ namespace ReadieFur::Network::WiFi
             while ((received = httpd_req_recv(req, buf, _otaRecvBufferSize)) > 0)
             {
                 totalReceived += received;
+                _bytesReceivedCounter.Increment(received);
                 TickType_t now = xTaskGetTickCount();
                 if (now - lastLog > pdMS_TO_TICKS(500))
                 {
@@ -69,13 +78,16 @@ namespace ReadieFur::Network::WiFi
                     lastLog = now;
                 }
 
+                int64_t writeStart = esp_timer_get_time();
                 err = esp_ota_write(_otaHandle, buf, received);
+                _writeLatency.Record(esp_timer_get_time() - writeStart);
                 if (err != ESP_OK)
                 {
                     LOGE(nameof(WiFi::OTA), "OTA write failed: %s", esp_err_to_name(err));
                     httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA write failed");
                     esp_ota_abort(_otaHandle);
                     _otaHandle = 0;
+                    _updatesFailedCounter.Increment();
                     return ESP_FAIL;
                 }
 
@@ -89,6 +101,7 @@ namespace ReadieFur::Network::WiFi
                 if (received == HTTPD_SOCK_ERR_TIMEOUT)
                     httpd_resp_send_408(req);
                 LOGE(nameof(WiFi::OTA), "OTA file receive failed.");
+                _updatesFailedCounter.Increment();
                 return ESP_FAIL;
             }
             LOGI(nameof(WiFi::OTA), "OTA file received.");
@@ -100,6 +113,7 @@ namespace ReadieFur::Network::WiFi
             {
                 LOGE(nameof(WiFi::OTA), "OTA end failed: %s", esp_err_to_name(err));
                 httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "OTA end failed");
+                _updatesFailedCounter.Increment();
                 return ESP_FAIL;
             }
 
@@ -109,6 +123,7 @@ namespace ReadieFur::Network::WiFi
             {
                 LOGE(nameof(WiFi::OTA), "Failed to set boot partition: %s", esp_err_to_name(err));
                 httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to set boot partition");
+                _updatesFailedCounter.Increment();
                 return ESP_FAIL;
             }
 
@@ -170,6 +185,12 @@ namespace ReadieFur::Network::WiFi
             return ESP_OK;
         }
 
+        /// @brief The HTTP server started by Init, so that other handlers (e.g. Diagnostic::MetricsEndpoint) can share it. NULL when not initialized.
+        static httpd_handle_t GetServer()
+        {
+            return _server;
+        }
+
         static void Deinit()
         {
             httpd_stop(_server);
@@ -188,3 +209,7 @@ esp_ota_handle_t ReadieFur::Network::WiFi::OTA::_otaHandle = 0;
 const esp_partition_t* ReadieFur::Network::WiFi::OTA::_otaPartition = nullptr;
 size_t ReadieFur::Network::WiFi::OTA::_otaRecvBufferSize = 1024;
 uint ReadieFur::Network::WiFi::OTA::_otaRecvIntervalMs = 0;
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::OTA::_updatesStartedCounter("ota_updates_started", "OTA updates that reached esp_ota_begin.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::OTA::_updatesFailedCounter("ota_updates_failed", "OTA updates that were aborted after being started.");
+ReadieFur::Diagnostic::Counter ReadieFur::Network::WiFi::OTA::_bytesReceivedCounter("ota_bytes_received", "Firmware bytes received over HTTP.");
+ReadieFur::Diagnostic::LatencyHistogram ReadieFur::Network::WiFi::OTA::_writeLatency("ota_write_us", "Time spent in esp_ota_write per chunk in microseconds.");
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "AService.hpp"
+#include "Mailbox.hpp"
+#include <esp_err.h>
+
+namespace ReadieFur::Service
+{
+    /// @brief A service that other tasks communicate with by posting messages, which are then processed on this service's own task (and therefore its core and priority).
+    /// @tparam TMessage The message type, typically a std::variant of the message structs.
+    /// @tparam Depth The number of pre-allocated message slots.
+    /// @tparam TReply The reply type for Request calls.
+    template <typename TMessage, size_t Depth, typename TReply = esp_err_t>
+    class AMailboxService : public AService
+    {
+    private:
+        Mailbox<TMessage, TReply, Depth> _mailbox;
+
+    protected:
+        TickType_t MailboxPollInterval = pdMS_TO_TICKS(100); //How often the default loop checks for cancellation while idle.
+
+        /// @param reply Set for messages sent with Request, nullptr for messages sent with Post.
+        virtual void OnMessage(TMessage& message, TReply* reply) = 0;
+
+        /// @brief Processes messages until the service is stopped, services with their own loop can call ProcessMessages instead.
+        void RunServiceImpl() override
+        {
+            while (!ServiceCancellationToken.IsCancellationRequested())
+                ProcessMessages(MailboxPollInterval);
+        }
+
+        /// @brief Processes all waiting messages, blocking for up to timeout for the first one.
+        /// @return The number of messages processed.
+        size_t ProcessMessages(TickType_t timeout = 0)
+        {
+            size_t processed = 0;
+            auto handler = [this](TMessage& message, TReply* reply) { OnMessage(message, reply); };
+            while (_mailbox.ProcessOne(handler, processed == 0 ? timeout : 0))
+                processed++;
+            return processed;
+        }
+
+    public:
+        /// @brief Queue a message for the service without waiting for it to be processed.
+        /// @param timeout How long to wait for a free slot if the mailbox is full.
+        esp_err_t Post(TMessage message, TickType_t timeout = 0)
+        {
+            return _mailbox.Post(std::move(message), timeout);
+        }
+
+        /// @brief Queue a message for the service and wait for its reply.
+        esp_err_t Request(TMessage message, TReply& outReply, TickType_t timeout = portMAX_DELAY)
+        {
+            return _mailbox.Request(std::move(message), outReply, timeout);
+        }
+
+        SMailboxMetrics GetMailboxMetrics()
+        {
+            return _mailbox.GetMetrics();
+        }
+    };
+};
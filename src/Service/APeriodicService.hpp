@@ -0,0 +1,90 @@
+#pragma once
+
+#include "AService.hpp"
+#include "Diagnostic/Histogram.hpp"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace ReadieFur::Service
+{
+    struct SPeriodicServiceMetrics
+    {
+        uint32_t iterations;
+        uint32_t deadlineMisses;
+        uint32_t overruns; //Iterations that ran past the next release time, the following iteration is started immediately to catch up.
+        Diagnostic::Histogram executionTimeUs;
+        Diagnostic::Histogram jitterUs; //Delay between the scheduled release time and the iteration starting.
+    };
+
+    /// @brief A service that runs RunIteration at a fixed rate, the period is measured from release to release so it doesn't drift by the time spent in the loop body.
+    class APeriodicService : public AService
+    {
+    private:
+        SPeriodicServiceMetrics _metrics = {};
+        std::atomic<bool> _resetMetrics = false;
+
+    protected:
+        TickType_t Period = pdMS_TO_TICKS(10);
+        uint32_t DeadlineUs = 0; //Time from the release that each iteration must complete within, 0 to use the period.
+
+        virtual void RunIteration() = 0;
+
+        /// @brief Called on the service task when an iteration completes after its deadline, can be used to shed load.
+        /// @param lateByUs How long after the deadline the iteration completed.
+        virtual void OnDeadlineMissed(uint32_t lateByUs) {}
+
+        void RunServiceImpl() override
+        {
+            const int64_t periodUs = (int64_t)Period * 1000000 / configTICK_RATE_HZ;
+            const int64_t deadlineUs = DeadlineUs == 0 ? periodUs : DeadlineUs;
+
+            //xTaskDelayUntil releases on tick boundaries, so the first release is taken just after one rather than part way through a tick, which would bias the jitter by up to a tick.
+            vTaskDelay(1);
+            TickType_t lastWakeTime = xTaskGetTickCount();
+            int64_t releaseUs = esp_timer_get_time();
+
+            while (!ServiceCancellationToken.IsCancellationRequested())
+            {
+                if (_resetMetrics.exchange(false))
+                    _metrics = {};
+
+                int64_t startUs = esp_timer_get_time();
+                RunIteration();
+                int64_t endUs = esp_timer_get_time();
+
+                _metrics.iterations++;
+                _metrics.executionTimeUs.Record(endUs - startUs);
+                _metrics.jitterUs.Record(startUs > releaseUs ? startUs - releaseUs : 0);
+
+                if (endUs - releaseUs > deadlineUs)
+                {
+                    _metrics.deadlineMisses++;
+                    OnDeadlineMissed(endUs - releaseUs - deadlineUs);
+                }
+
+                Heartbeat();
+
+                //Returns immediately if the next release time has already passed.
+                if (xTaskDelayUntil(&lastWakeTime, Period) == pdFALSE)
+                    _metrics.overruns++;
+                releaseUs += periodUs;
+            }
+        }
+
+    public:
+        /// @note The metrics are written by the service task without locking so a copy may be slightly inconsistent.
+        SPeriodicServiceMetrics GetPeriodicMetrics()
+        {
+            return _metrics;
+        }
+
+        /// @brief Clears the metrics at the start of the next iteration.
+        void ResetPeriodicMetrics()
+        {
+            _resetMetrics = true;
+        }
+    };
+};
@@ -17,34 +17,98 @@
 #include "Event/AutoResetEvent.hpp"
 #include "Event/CancellationToken.hpp"
 #include <string>
+#include <vector>
+#include <atomic>
 #include "Logging.hpp"
+#include "SServiceResources.h"
+#include "ServiceDependencies.hpp"
+#include "ERestartPolicy.h"
+#include "SServiceHealth.h"
+#include <esp_timer.h>
+#include "Diagnostic/Trace.hpp"
+#include "Diagnostic/ProfiledMutex.hpp"
+#if defined(_ENABLE_SERVICE_HEAP_ACCOUNTING) || defined(_ENABLE_HEAP_PROFILER)
+#include "Diagnostic/HeapHooks.hpp"
+#endif
+
+namespace ReadieFur::Diagnostic
+{
+    class DiagnosticsService;
+};
 
 namespace ReadieFur::Service
 {
     class AService
     {
     friend class ServiceManager;
+    friend class ReadieFur::Diagnostic::DiagnosticsService;
     private:
-        std::mutex _serviceMutex;
+        struct STrackedTask
+        {
+            TaskHandle_t handle;
+            uint32_t stackDepth;
+        };
+
+        struct SChildTaskParams
+        {
+            AService* self;
+            TaskFunction_t function;
+            void* param;
+        };
+
+        Diagnostic::ProfiledMutex _serviceMutex{"AService"};
+        Diagnostic::ProfiledMutex _childTasksMutex{"AService.ChildTasks"};
+        std::vector<STrackedTask> _childTasks;
+        SServiceResources _resources;
         std::function<AService*(std::type_index)> _getServiceCallback = nullptr; //Exists as a convience factor for implementing classes, rather than importing and calling from the service manager directly.
+        #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+        SDependencySpan _dependencies; //Populated from T::Dependencies by the service manager on installation.
+        #else
         std::unordered_set<std::type_index> _dependencies = {};
+        #endif
         Event::AutoResetEvent _taskEndedEvent;
         TaskHandle_t _taskHandle = NULL;
         Event::CancellationTokenSource* _taskCts = nullptr;
 
+        static std::atomic<bool> _supervised; //Set while the service manager's health monitor is running.
+        std::atomic<bool> _taskEnded = false;
+        std::atomic<bool> _failed = false;
+        std::atomic<uint32_t> _lastHeartbeatUs = 0;
+        uint32_t _maxLoopLatencyUs = 0;
+        uint32_t _averageLoopLatencyUs = 0;
+        //Restart bookkeeping, only accessed by the service manager under its lock.
+        EServiceHealth _health = EServiceHealth::Healthy;
+        uint32_t _restarts = 0;
+        uint32_t _consecutiveRestarts = 0;
+        uint32_t _backoffMs = 0;
+        TickType_t _nextRestartAt = 0;
+        TickType_t _restartedAt = 0;
+        std::vector<AService*> _stoppedDependents; //Dependents that were stopped alongside this service and should be restarted with it.
+
         static void TaskWrapper(void* param)
         {
             AService* self = reinterpret_cast<AService*>(param);
 
+            vTaskSetThreadLocalStoragePointer(NULL, SERVICE_TLS_INDEX, &self->_resources);
+
+            //The service name can't be used as the event name as it is freed with the service, before the trace may be exported.
+            //The events are on the service's own task track, and the ID ties the start and stop of a service together.
+            TRACE_INSTANT_ID("Service", "Start", std::type_index(typeid(*self)).hash_code());
             self->RunServiceImpl();
+            TRACE_INSTANT_ID("Service", "Stop", std::type_index(typeid(*self)).hash_code());
 
+            self->_taskEnded = true;
             self->_taskEndedEvent.Set();
 
             if (!self->_taskCts->IsCancelled())
             {
                 //Consider the task as failed here, this occurs when the RunServiceImpl method returns before the task has been signalled for deletion.
-                //For now, have the program fail like how tasks that end early in FreeRTOS call abort too.
-                abort();
+                //When supervised the service manager applies the service's restart policy, otherwise have the program fail like how tasks that end early in FreeRTOS call abort too.
+                if (!_supervised || self->RestartPolicy == ERestartPolicy::Escalate)
+                    abort();
+
+                self->_failed = true;
+                vTaskDelete(NULL);
             }
             else
             {
@@ -53,6 +117,53 @@ namespace ReadieFur::Service
             }
         }
 
+        static void ChildTaskWrapper(void* param)
+        {
+            SChildTaskParams params = *reinterpret_cast<SChildTaskParams*>(param);
+            delete reinterpret_cast<SChildTaskParams*>(param);
+
+            //Bind the task to the service before any user code runs so that all of its work is attributed to the owner.
+            vTaskSetThreadLocalStoragePointer(NULL, SERVICE_TLS_INDEX, &params.self->_resources);
+
+            params.function(params.param);
+
+            //Returning from a FreeRTOS task aborts, so untrack and delete the task here instead to allow child tasks to end gracefully.
+            TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+            params.self->_childTasksMutex.lock();
+            auto& tasks = params.self->_childTasks;
+            tasks.erase(std::remove_if(tasks.begin(), tasks.end(), [handle](const STrackedTask& task) { return task.handle == handle; }), tasks.end());
+            params.self->_childTasksMutex.unlock();
+
+            vTaskDelete(NULL);
+        }
+
+        void SuspendTasks()
+        {
+            vTaskSuspend(_taskHandle);
+            _childTasksMutex.lock();
+            for (auto &&task : _childTasks)
+                vTaskSuspend(task.handle);
+            _childTasksMutex.unlock();
+        }
+
+        void ResumeTasks()
+        {
+            _childTasksMutex.lock();
+            for (auto &&task : _childTasks)
+                vTaskResume(task.handle);
+            _childTasksMutex.unlock();
+            vTaskResume(_taskHandle);
+        }
+
+        void GetTrackedTasks(std::vector<STrackedTask>& outTasks)
+        {
+            if (_taskHandle != NULL)
+                outTasks.push_back({ _taskHandle, ServiceEntrypointStackDepth });
+            _childTasksMutex.lock();
+            outTasks.insert(outTasks.end(), _childTasks.begin(), _childTasks.end());
+            _childTasksMutex.unlock();
+        }
+
         EServiceResult StartService()
         {
             _serviceMutex.lock();
@@ -65,6 +176,10 @@ namespace ReadieFur::Service
 
             _taskCts = new Event::CancellationTokenSource();
             ServiceCancellationToken = _taskCts->GetToken();
+            _taskEndedEvent.Clear();
+            _taskEnded = false;
+            _failed = false;
+            _lastHeartbeatUs = (uint32_t)esp_timer_get_time();
 
             #if true
             std::string name;
@@ -94,10 +209,13 @@ namespace ReadieFur::Service
             if (name.length() > configMAX_TASK_NAME_LEN)
                 name = name.substr(0, configMAX_TASK_NAME_LEN);
 
-            const char* buf = name.c_str();
+            //Kept for the lifetime of the service so that diagnostics can refer to it without the task name dangling.
+            strncpy(_resources.name, name.c_str(), sizeof(_resources.name) - 1);
+            const char* buf = _resources.name;
             #else
             char buf[configMAX_TASK_NAME_LEN];
             sprintf(buf, "svc%012d", xTaskGetTickCount());
+            strncpy(_resources.name, buf, sizeof(_resources.name) - 1);
             #endif
 
             BaseType_t taskCreateResult;
@@ -142,12 +260,33 @@ namespace ReadieFur::Service
 
             // vTaskDelete(_taskHandle);
             _taskCts->Cancel();
-            if (!_taskEndedEvent.WaitOne(timeout))
+            //The event is used up by the first wait, so a retry after the child tasks timed out must not wait on it again.
+            if (!_taskEnded && !_taskEndedEvent.WaitOne(timeout))
             {
                 _serviceMutex.unlock();
                 return EServiceResult::Timeout;
             }
 
+            //Child tasks are expected to observe the same cancellation token, wait for them to finish within the same timeout.
+            TickType_t start = xTaskGetTickCount();
+            while (true)
+            {
+                _childTasksMutex.lock();
+                bool childTasksEnded = _childTasks.empty();
+                _childTasksMutex.unlock();
+
+                if (childTasksEnded)
+                    break;
+
+                if (timeout != portMAX_DELAY && xTaskGetTickCount() - start >= timeout)
+                {
+                    _serviceMutex.unlock();
+                    return EServiceResult::Timeout;
+                }
+
+                vTaskDelay(1);
+            }
+
             delete _taskCts;
             _taskCts = nullptr;
             _taskHandle = NULL;
@@ -156,6 +295,36 @@ namespace ReadieFur::Service
             return EServiceResult::Ok;
         }
 
+        //Last resort for a wedged service, anything held by its tasks (including locks) is not released.
+        void ForceStopService()
+        {
+            _serviceMutex.lock();
+
+            if (_taskHandle == NULL)
+            {
+                _serviceMutex.unlock();
+                return;
+            }
+
+            _taskCts->Cancel();
+
+            _childTasksMutex.lock();
+            for (auto &&task : _childTasks)
+                vTaskDelete(task.handle);
+            _childTasks.clear();
+            _childTasksMutex.unlock();
+
+            //If the task has already ended it will have deleted itself.
+            if (!_taskEnded)
+                vTaskDelete(_taskHandle);
+
+            delete _taskCts;
+            _taskCts = nullptr;
+            _taskHandle = NULL;
+
+            _serviceMutex.unlock();
+        }
+
     protected:
         virtual void RunServiceImpl() = 0;
 
@@ -163,12 +332,71 @@ namespace ReadieFur::Service
         uint ServiceEntrypointStackDepth = IDLE_TASK_STACK_SIZE;
         int ServiceEntrypointCore = -1; //-1 to run on all cores.
         Event::CancellationTokenSource::SCancellationToken ServiceCancellationToken; //Defaults to true, which is ideal.
+        TickType_t HeartbeatTimeout = 0; //0 disables stall detection, otherwise the service must call Heartbeat at least this often.
+        ERestartPolicy RestartPolicy = ERestartPolicy::Escalate;
+        uint32_t RestartBackoffInitialMs = 1000;
+        uint32_t RestartBackoffMaxMs = 60 * 1000;
+        uint32_t MaxConsecutiveRestarts = 0; //0 for unlimited, otherwise the failure is escalated once exceeded.
+
+        /// @brief Signals that the service loop is still making progress, should be called once per iteration.
+        void Heartbeat()
+        {
+            uint32_t now = (uint32_t)esp_timer_get_time();
+            uint32_t latency = now - _lastHeartbeatUs.exchange(now, std::memory_order_relaxed);
+
+            if (latency > _maxLoopLatencyUs)
+                _maxLoopLatencyUs = latency;
+            //Exponential moving average with a weight of 1/8 for the new sample.
+            _averageLoopLatencyUs = _averageLoopLatencyUs == 0 ? latency : _averageLoopLatencyUs - (_averageLoopLatencyUs >> 3) + (latency >> 3);
+        }
 
         template <typename T>
         typename std::enable_if<std::is_base_of<AService, T>::value, void>::type
         AddDependencyType()
         {
+            #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+            static_assert(!std::is_same<T, T>::value, "Runtime dependencies are disabled by _ENABLE_STATIC_SERVICE_GRAPH, declare them with \"using Dependencies = TypeList<...>;\" instead.");
+            #else
             _dependencies.insert(std::type_index(typeid(T)));
+            #endif
+        }
+
+        /// @brief Creates a task that is owned by this service, its CPU time, stack and heap usage are attributed to this service and it is suspended/resumed alongside the service.
+        /// @note The task should return once ServiceCancellationToken is cancelled, StopService will wait for all child tasks to end.
+        BaseType_t CreateServiceTask(TaskFunction_t function, const char* name, uint32_t stackDepth, void* param, UBaseType_t priority, TaskHandle_t* outHandle = nullptr, int core = -1)
+        {
+            SChildTaskParams* params = new SChildTaskParams
+            {
+                .self = this,
+                .function = function,
+                .param = param
+            };
+
+            //Hold the lock over creation so that the child can't untrack itself before it has been tracked.
+            _childTasksMutex.lock();
+
+            TaskHandle_t handle = NULL;
+            BaseType_t taskCreateResult;
+            #if configNUM_CORES > 1
+            if (core != -1)
+                taskCreateResult = xTaskCreatePinnedToCore(ChildTaskWrapper, name, stackDepth, params, priority, &handle, core);
+            else
+            #endif
+                taskCreateResult = xTaskCreate(ChildTaskWrapper, name, stackDepth, params, priority, &handle);
+
+            if (taskCreateResult != pdPASS)
+            {
+                _childTasksMutex.unlock();
+                delete params;
+                return taskCreateResult;
+            }
+
+            _childTasks.push_back({ handle, stackDepth });
+            _childTasksMutex.unlock();
+
+            if (outHandle != nullptr)
+                *outHandle = handle;
+            return taskCreateResult;
         }
 
         // template <typename T>
@@ -194,10 +422,28 @@ namespace ReadieFur::Service
         // }
 
     public:
+        const char* GetServiceName()
+        {
+            return _resources.name;
+        }
+
+        SServiceHealth GetServiceHealth()
+        {
+            return SServiceHealth
+            {
+                .health = _health,
+                .restarts = _restarts,
+                .lastHeartbeatAgeUs = (uint32_t)esp_timer_get_time() - _lastHeartbeatUs.load(std::memory_order_relaxed),
+                .maxLoopLatencyUs = _maxLoopLatencyUs,
+                .averageLoopLatencyUs = _averageLoopLatencyUs
+            };
+        }
+
         bool IsRunning()
         {
             // _serviceMutex.lock();
-            bool retVal = _taskHandle != NULL && eTaskGetState(_taskHandle) != eTaskState::eSuspended;
+            //A failed task has deleted itself so its handle can't be queried.
+            bool retVal = _taskHandle != NULL && !_failed && eTaskGetState(_taskHandle) != eTaskState::eSuspended;
             // _serviceMutex.unlock();
             return retVal;
         }
@@ -212,3 +458,5 @@ namespace ReadieFur::Service
         }
     };
 };
+
+std::atomic<bool> ReadieFur::Service::AService::_supervised = false;
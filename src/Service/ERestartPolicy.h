@@ -0,0 +1,12 @@
+#pragma once
+
+namespace ReadieFur::Service
+{
+    enum ERestartPolicy
+    {
+        Escalate, //Abort the program, the same as a FreeRTOS task returning early.
+        None, //Leave the service and its dependents stopped.
+        Restart,
+        RestartWithBackoff
+    };
+};
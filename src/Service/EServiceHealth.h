@@ -0,0 +1,12 @@
+#pragma once
+
+namespace ReadieFur::Service
+{
+    enum EServiceHealth
+    {
+        Healthy,
+        Stalled, //The service has not sent a heartbeat within its timeout.
+        Exited, //The service returned from RunServiceImpl before being stopped.
+        Degraded //The service failed and was left stopped by its restart policy.
+    };
+};
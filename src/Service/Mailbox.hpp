@@ -0,0 +1,235 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace ReadieFur::Service
+{
+    struct SMailboxMetrics
+    {
+        uint32_t posted;
+        uint32_t dropped; //Posts that failed because no slot became free within the timeout.
+        uint32_t processed;
+        size_t depth; //Messages currently waiting to be processed.
+        size_t maxDepth;
+        uint32_t maxQueueLatencyUs; //Time between a message being posted and its processing starting.
+        uint32_t averageQueueLatencyUs;
+        uint32_t maxProcessingTimeUs;
+        uint32_t averageProcessingTimeUs;
+    };
+
+    /// @brief A fixed capacity message queue where messages are stored in pre-allocated slots and consumed by a single task.
+    /// @tparam TMessage The message type, typically a std::variant of the message structs.
+    /// @tparam TReply The reply type written by the consumer for requests.
+    template <typename TMessage, typename TReply, size_t Depth>
+    class Mailbox
+    {
+    private:
+        static_assert(Depth > 0 && Depth <= UINT16_MAX, "Mailbox depth must be between 1 and UINT16_MAX.");
+
+        enum ESlotState : uint8_t
+        {
+            Free,
+            Queued,
+            Processing,
+            Replied,
+            Abandoned //The requester stopped waiting, the consumer is responsible for releasing the slot.
+        };
+
+        struct SSlot
+        {
+            std::optional<TMessage> message;
+            TReply reply;
+            bool isRequest;
+            int64_t postedAt;
+            std::atomic<uint8_t> state;
+            SemaphoreHandle_t replied;
+        };
+
+        std::array<SSlot, Depth> _slots;
+        QueueHandle_t _freeSlots;
+        QueueHandle_t _pendingSlots;
+
+        std::atomic<uint32_t> _posted = 0;
+        std::atomic<uint32_t> _dropped = 0;
+        std::atomic<size_t> _maxDepth = 0;
+        //Only written by the consumer.
+        uint32_t _processed = 0;
+        uint32_t _maxQueueLatencyUs = 0;
+        uint64_t _totalQueueLatencyUs = 0;
+        uint32_t _maxProcessingTimeUs = 0;
+        uint64_t _totalProcessingTimeUs = 0;
+
+        void ReleaseSlot(uint16_t index)
+        {
+            _slots[index].message.reset();
+            _slots[index].state.store(ESlotState::Free, std::memory_order_release);
+            xQueueSend(_freeSlots, &index, 0); //Can't fail, there is always room for every slot.
+        }
+
+        esp_err_t Enqueue(TMessage&& message, bool isRequest, TickType_t timeout, uint16_t& outIndex)
+        {
+            if (xQueueReceive(_freeSlots, &outIndex, timeout) != pdTRUE)
+            {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return ESP_ERR_TIMEOUT;
+            }
+
+            SSlot& slot = _slots[outIndex];
+            slot.message.emplace(std::move(message));
+            slot.isRequest = isRequest;
+            slot.postedAt = esp_timer_get_time();
+            slot.state.store(ESlotState::Queued, std::memory_order_release);
+
+            xQueueSend(_pendingSlots, &outIndex, 0);
+            _posted.fetch_add(1, std::memory_order_relaxed);
+
+            size_t depth = uxQueueMessagesWaiting(_pendingSlots);
+            size_t maxDepth = _maxDepth.load(std::memory_order_relaxed);
+            while (depth > maxDepth && !_maxDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed));
+
+            return ESP_OK;
+        }
+
+    public:
+        Mailbox()
+        {
+            _freeSlots = xQueueCreate(Depth, sizeof(uint16_t));
+            _pendingSlots = xQueueCreate(Depth, sizeof(uint16_t));
+            if (_freeSlots == NULL || _pendingSlots == NULL)
+                abort();
+
+            for (uint16_t i = 0; i < Depth; i++)
+            {
+                _slots[i].state.store(ESlotState::Free, std::memory_order_relaxed);
+                _slots[i].replied = xSemaphoreCreateBinary();
+                if (_slots[i].replied == NULL)
+                    abort();
+                xQueueSend(_freeSlots, &i, 0);
+            }
+        }
+
+        ~Mailbox()
+        {
+            for (auto &&slot : _slots)
+                vSemaphoreDelete(slot.replied);
+            vQueueDelete(_pendingSlots);
+            vQueueDelete(_freeSlots);
+        }
+
+        /// @brief Post a message without waiting for it to be processed.
+        /// @param timeout How long to wait for a free slot.
+        esp_err_t Post(TMessage message, TickType_t timeout = 0)
+        {
+            uint16_t index;
+            return Enqueue(std::move(message), false, timeout, index);
+        }
+
+        /// @brief Post a message and wait for the consumer to reply to it.
+        /// @param timeout The total time to wait for both a free slot and the reply.
+        esp_err_t Request(TMessage message, TReply& outReply, TickType_t timeout = portMAX_DELAY)
+        {
+            TickType_t start = xTaskGetTickCount();
+
+            uint16_t index;
+            esp_err_t err = Enqueue(std::move(message), true, timeout, index);
+            if (err != ESP_OK)
+                return err;
+
+            SSlot& slot = _slots[index];
+            TickType_t elapsed = xTaskGetTickCount() - start;
+            TickType_t remaining = timeout == portMAX_DELAY ? portMAX_DELAY : (elapsed >= timeout ? 0 : timeout - elapsed);
+
+            if (xSemaphoreTake(slot.replied, remaining) != pdTRUE)
+            {
+                //Hand the slot over to the consumer, unless the reply arrived while we were giving up.
+                uint8_t state = slot.state.load(std::memory_order_acquire);
+                while (state != ESlotState::Replied)
+                    if (slot.state.compare_exchange_weak(state, ESlotState::Abandoned, std::memory_order_acq_rel))
+                        return ESP_ERR_TIMEOUT;
+                //The consumer marks the slot as replied before giving the semaphore, so the give may not have happened yet but is guaranteed to follow.
+                //It must be consumed here, otherwise it would be left signalled for the next request to reuse this slot.
+                xSemaphoreTake(slot.replied, portMAX_DELAY);
+            }
+
+            outReply = std::move(slot.reply);
+            ReleaseSlot(index);
+            return ESP_OK;
+        }
+
+        /// @brief Process a single message on the calling task, should only be called by the owner of the mailbox.
+        /// @param handler Called with the message and a reply to fill in, the reply is nullptr for messages that were posted rather than requested.
+        /// @return True if a message was processed.
+        template <typename THandler>
+        bool ProcessOne(THandler&& handler, TickType_t timeout)
+        {
+            uint16_t index;
+            if (xQueueReceive(_pendingSlots, &index, timeout) != pdTRUE)
+                return false;
+
+            SSlot& slot = _slots[index];
+
+            //Requests that were abandoned before being processed don't need to be run.
+            uint8_t state = ESlotState::Queued;
+            if (!slot.state.compare_exchange_strong(state, ESlotState::Processing, std::memory_order_acq_rel))
+            {
+                ReleaseSlot(index);
+                return true;
+            }
+
+            int64_t startedAt = esp_timer_get_time();
+            handler(*slot.message, slot.isRequest ? &slot.reply : nullptr);
+            int64_t endedAt = esp_timer_get_time();
+
+            uint32_t queueLatency = startedAt - slot.postedAt;
+            uint32_t processingTime = endedAt - startedAt;
+            _processed++;
+            _totalQueueLatencyUs += queueLatency;
+            _totalProcessingTimeUs += processingTime;
+            if (queueLatency > _maxQueueLatencyUs)
+                _maxQueueLatencyUs = queueLatency;
+            if (processingTime > _maxProcessingTimeUs)
+                _maxProcessingTimeUs = processingTime;
+
+            if (!slot.isRequest)
+            {
+                ReleaseSlot(index);
+                return true;
+            }
+
+            //The requester releases the slot once it has read the reply.
+            state = ESlotState::Processing;
+            if (slot.state.compare_exchange_strong(state, ESlotState::Replied, std::memory_order_acq_rel))
+                xSemaphoreGive(slot.replied);
+            else
+                ReleaseSlot(index);
+            return true;
+        }
+
+        SMailboxMetrics GetMetrics()
+        {
+            uint32_t processed = _processed;
+            return SMailboxMetrics
+            {
+                .posted = _posted.load(std::memory_order_relaxed),
+                .dropped = _dropped.load(std::memory_order_relaxed),
+                .processed = processed,
+                .depth = uxQueueMessagesWaiting(_pendingSlots),
+                .maxDepth = _maxDepth.load(std::memory_order_relaxed),
+                .maxQueueLatencyUs = _maxQueueLatencyUs,
+                .averageQueueLatencyUs = processed == 0 ? 0 : (uint32_t)(_totalQueueLatencyUs / processed),
+                .maxProcessingTimeUs = _maxProcessingTimeUs,
+                .averageProcessingTimeUs = processed == 0 ? 0 : (uint32_t)(_totalProcessingTimeUs / processed)
+            };
+        }
+    };
+};
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include "EServiceHealth.h"
+
+namespace ReadieFur::Service
+{
+    struct SServiceHealth
+    {
+        EServiceHealth health;
+        uint32_t restarts;
+        uint32_t lastHeartbeatAgeUs;
+        uint32_t maxLoopLatencyUs; //Longest time between two heartbeats.
+        uint32_t averageLoopLatencyUs;
+    };
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifndef SERVICE_TLS_INDEX
+//Thread local storage slot used to map a task back to the service that owns it.
+//ESP-IDF reserves slot 0 for pthreads, so CONFIG_FREERTOS_THREAD_LOCAL_STORAGE_POINTERS must be at least 2.
+#define SERVICE_TLS_INDEX (configNUM_THREAD_LOCAL_STORAGE_POINTERS - 1)
+#endif
+
+//Slot 0 would be shared with the pthread layer, which would then read a SServiceResources as its own data (and the heap hooks the other way round).
+#if configNUM_THREAD_LOCAL_STORAGE_POINTERS < 2
+#error "Services need a thread local storage slot of their own, set CONFIG_FREERTOS_THREAD_LOCAL_STORAGE_POINTERS to at least 2."
+#endif
+static_assert(SERVICE_TLS_INDEX > 0 && SERVICE_TLS_INDEX < configNUM_THREAD_LOCAL_STORAGE_POINTERS, "SERVICE_TLS_INDEX must not be slot 0, which ESP-IDF reserves for pthreads.");
+
+namespace ReadieFur::Service
+{
+    //Resources attributed to a service across every task that it owns.
+    //The heap counters are only updated when _ENABLE_SERVICE_HEAP_ACCOUNTING is defined (requires CONFIG_HEAP_USE_HOOKS).
+    struct SServiceResources
+    {
+        char name[configMAX_TASK_NAME_LEN] = {};
+        std::atomic<uint32_t> heapAllocations = 0;
+        std::atomic<uint32_t> heapFrees = 0;
+        std::atomic<uint32_t> heapAllocatedBytes = 0; //Cumulative, wraps around so consumers should work with deltas.
+    };
+};
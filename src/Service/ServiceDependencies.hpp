@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <typeindex>
+#include <typeinfo>
+#include <type_traits>
+#include "TypeList.hpp"
+
+namespace ReadieFur::Service
+{
+    //Services can declare their dependencies at compile time with "using Dependencies = TypeList<...>;".
+    template <typename T, typename = void>
+    struct ServiceDependencies
+    {
+        using Type = TypeList<>;
+    };
+
+    template <typename T>
+    struct ServiceDependencies<T, std::void_t<typename T::Dependencies>>
+    {
+        using Type = typename T::Dependencies;
+    };
+
+    //Non-owning view over a statically allocated dependency table, iterates the same as the runtime dependency set.
+    struct SDependencySpan
+    {
+        const std::type_index* first = nullptr;
+        size_t count = 0;
+
+        const std::type_index* begin() const { return first; }
+        const std::type_index* end() const { return first + count; }
+        size_t size() const { return count; }
+    };
+
+    template <typename TList>
+    struct DependencyTable;
+
+    template <>
+    struct DependencyTable<TypeList<>>
+    {
+        static SDependencySpan Get() { return SDependencySpan(); }
+    };
+
+    template <typename... Types>
+    struct DependencyTable<TypeList<Types...>>
+    {
+        inline static const std::type_index Values[] = { std::type_index(typeid(Types))... };
+
+        static SDependencySpan Get() { return SDependencySpan { .first = Values, .count = sizeof...(Types) }; }
+    };
+};
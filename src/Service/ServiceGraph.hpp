@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stddef.h>
+#include <array>
+#include <utility>
+#include <typeindex>
+#include <typeinfo>
+#include <type_traits>
+#include "TypeList.hpp"
+#include "ServiceDependencies.hpp"
+#include "ServiceManager.hpp"
+#include "EServiceResult.h"
+
+namespace ReadieFur::Service
+{
+    /// @brief A fixed set of services whose start order is resolved at compile time from each service's "using Dependencies = TypeList<...>;".
+    /// @note Missing dependencies and circular dependencies are reported with a static_assert.
+    template <typename... TServices>
+    class ServiceGraph
+    {
+    private:
+        typedef EServiceResult(*TServiceAction)();
+
+        static constexpr size_t COUNT = sizeof...(TServices);
+        static_assert(COUNT > 0, "A service graph must contain at least one service.");
+        static_assert((std::is_base_of<AService, TServices>::value && ...), "All services in a service graph must derive from AService.");
+
+        typedef std::array<std::array<bool, COUNT>, COUNT> TMatrix;
+
+        struct SSortResult
+        {
+            std::array<size_t, COUNT> order;
+            size_t sorted;
+        };
+
+        template <typename T>
+        static constexpr size_t IndexOf()
+        {
+            constexpr bool matches[] = { std::is_same<T, TServices>::value... };
+            for (size_t i = 0; i < COUNT; i++)
+                if (matches[i])
+                    return i;
+            return COUNT;
+        }
+
+        template <typename... TDependencies>
+        static constexpr bool DependenciesRegistered(TypeList<TDependencies...>)
+        {
+            return ((IndexOf<TDependencies>() < COUNT) && ...);
+        }
+
+        template <typename... TDependencies>
+        static constexpr void AddEdges(TMatrix& matrix, [[maybe_unused]] size_t service, TypeList<TDependencies...>)
+        {
+            ((IndexOf<TDependencies>() < COUNT ? matrix[service][IndexOf<TDependencies>()] = true : false), ...);
+        }
+
+        static constexpr TMatrix BuildMatrix()
+        {
+            TMatrix matrix = {};
+            size_t service = 0;
+            (AddEdges(matrix, service++, typename ServiceDependencies<TServices>::Type()), ...);
+            return matrix;
+        }
+
+        //Repeatedly places the first service whose dependencies have all been placed, which keeps the declaration order where the graph allows it.
+        //If a pass places nothing then the remaining services form a cycle.
+        static constexpr SSortResult Sort()
+        {
+            TMatrix matrix = BuildMatrix();
+            SSortResult result = {};
+            std::array<bool, COUNT> placed = {};
+
+            for (size_t pass = 0; pass < COUNT; pass++)
+            {
+                bool progressed = false;
+                for (size_t i = 0; i < COUNT && !progressed; i++)
+                {
+                    if (placed[i])
+                        continue;
+
+                    bool ready = true;
+                    for (size_t j = 0; j < COUNT; j++)
+                        if (matrix[i][j] && !placed[j])
+                            ready = false;
+                    if (!ready)
+                        continue;
+
+                    placed[i] = true;
+                    result.order[result.sorted++] = i;
+                    progressed = true;
+                }
+
+                if (!progressed)
+                    break;
+            }
+
+            return result;
+        }
+
+        static constexpr SSortResult SORTED = Sort();
+
+        static_assert((DependenciesRegistered(typename ServiceDependencies<TServices>::Type()) && ...), "A service depends on a service that is not part of the service graph.");
+        static_assert(SORTED.sorted == COUNT, "Circular service dependency detected.");
+
+        static EServiceResult RunInOrder(const TServiceAction (&actions)[COUNT], bool reverse)
+        {
+            for (size_t i = 0; i < COUNT; i++)
+            {
+                EServiceResult result = actions[SORTED.order[reverse ? COUNT - 1 - i : i]]();
+                if (result != EServiceResult::Ok)
+                    return result;
+            }
+            return EServiceResult::Ok;
+        }
+
+        template <size_t... Indices>
+        static std::array<std::type_index, COUNT> GetServices(std::index_sequence<Indices...>)
+        {
+            const std::type_index types[] = { std::type_index(typeid(TServices))... };
+            return { types[SORTED.order[Indices]]... };
+        }
+
+        ServiceGraph() {}
+
+    public:
+        /// @brief The index (into the template parameter list) of each service, in the order they must be started.
+        static constexpr std::array<size_t, COUNT> StartOrder = SORTED.order;
+
+        /// @brief Get the services in the order they must be started, the reverse of this is the order they must be stopped.
+        static std::array<std::type_index, COUNT> GetServices()
+        {
+            return GetServices(std::make_index_sequence<COUNT>());
+        }
+
+        static EServiceResult InstallAll()
+        {
+            static constexpr TServiceAction actions[] = { &ServiceManager::InstallService<TServices>... };
+            return RunInOrder(actions, false);
+        }
+
+        static EServiceResult StartAll()
+        {
+            static constexpr TServiceAction actions[] = { &ServiceManager::StartService<TServices>... };
+            return RunInOrder(actions, false);
+        }
+
+        static EServiceResult InstallAndStartAll()
+        {
+            EServiceResult result = InstallAll();
+            if (result != EServiceResult::Ok)
+                return result;
+            return StartAll();
+        }
+
+        static EServiceResult StopAll()
+        {
+            static constexpr TServiceAction actions[] = { &ServiceManager::StopService<TServices>... };
+            return RunInOrder(actions, true);
+        }
+
+        static EServiceResult UninstallAll()
+        {
+            static constexpr TServiceAction actions[] = { &ServiceManager::UninstallService<TServices>... };
+            return RunInOrder(actions, true);
+        }
+    };
+};
@@ -14,17 +14,181 @@
 #include <unordered_set>
 #include <queue>
 #include "Logging.hpp"
+#include "ServiceDependencies.hpp"
+#include "ERestartPolicy.h"
+#include "EServiceHealth.h"
+#include "Event/AutoResetEvent.hpp"
+#include "Event/CancellationToken.hpp"
+#include "Diagnostic/ProfiledMutex.hpp"
+#include "Diagnostic/Metrics.hpp"
+#include <esp_timer.h>
+#include <freertos/task.h>
 
 namespace ReadieFur::Service
 {
     class ServiceManager
     {
-    // friend class ReadieFur::Diagnostic::DiagnosticsService;
+    friend class ReadieFur::Diagnostic::DiagnosticsService;
     private:
-        static std::mutex _mutex;
-        // static std::vector<std::type_index> _orderedServices; //Increases memory usage slightly but means I don't need to figure out an algorithm for sorting the services by dependencies as this is restricted by the service installation.
+        static Diagnostic::ProfiledMutex _mutex;
+        #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+        static std::vector<std::type_index> _orderedServices; //Increases memory usage slightly but means I don't need to figure out an algorithm for sorting the services by dependencies as this is restricted by the service installation.
+        #endif
         static std::map<std::type_index, AService*> _services;
         static std::map<std::type_index, std::vector<AService*>> _references;
+        static TaskHandle_t _healthMonitorTask;
+        static Event::CancellationTokenSource* _healthMonitorCts;
+        static Event::AutoResetEvent _healthMonitorEnded;
+        static TickType_t _healthMonitorInterval;
+        static TickType_t _healthStopTimeout;
+        static Diagnostic::Gauge _installedGauge;
+        static Diagnostic::Counter _failuresCounter;
+        static Diagnostic::Counter _restartsCounter;
+        static Diagnostic::LatencyHistogram _startLatency;
+
+        static const char* HealthToString(EServiceHealth health)
+        {
+            switch (health)
+            {
+            case EServiceHealth::Healthy:
+                return "healthy";
+            case EServiceHealth::Stalled:
+                return "stalled";
+            case EServiceHealth::Exited:
+                return "exited";
+            case EServiceHealth::Degraded:
+                return "degraded";
+            default:
+                return "unknown";
+            }
+        }
+
+        static void StopServiceInternal(AService* service)
+        {
+            //A stalled service may never observe its cancellation token.
+            if (service->StopService(_healthStopTimeout) == EServiceResult::Timeout)
+            {
+                LOGW(nameof(ServiceManager), "Service '%s' did not stop in time, force stopping.", service->GetServiceName());
+                service->ForceStopService();
+            }
+        }
+
+        //Stops every running service that depends on the given service (dependents of dependents first), appending them in the order they were stopped.
+        static void StopDependentsInternal(std::type_index type, std::vector<AService*>& outStopped)
+        {
+            auto references = _references.find(type);
+            if (references == _references.end())
+                return;
+
+            for (auto &&dependent : references->second)
+            {
+                if (!dependent->IsRunning())
+                    continue;
+
+                StopDependentsInternal(std::type_index(typeid(*dependent)), outStopped);
+                StopServiceInternal(dependent);
+                outStopped.push_back(dependent);
+            }
+        }
+
+        static void RestartServiceInternal(AService* service)
+        {
+            service->_restarts++;
+            service->_consecutiveRestarts++;
+            _restartsCounter.Increment();
+            service->_restartedAt = xTaskGetTickCount();
+
+            if (service->StartService() != EServiceResult::Ok)
+            {
+                LOGE(nameof(ServiceManager), "Failed to restart service '%s'.", service->GetServiceName());
+                service->_health = EServiceHealth::Degraded;
+                service->_nextRestartAt = xTaskGetTickCount() + pdMS_TO_TICKS(service->_backoffMs);
+                return;
+            }
+            service->_health = EServiceHealth::Healthy;
+            LOGI(nameof(ServiceManager), "Restarted service '%s' (%u restarts).", service->GetServiceName(), service->_restarts);
+
+            //Restart the dependents in the reverse of the order they were stopped.
+            for (auto dependent = service->_stoppedDependents.rbegin(); dependent != service->_stoppedDependents.rend(); ++dependent)
+                if ((*dependent)->StartService() != EServiceResult::Ok)
+                    LOGE(nameof(ServiceManager), "Failed to restart dependent service '%s'.", (*dependent)->GetServiceName());
+            service->_stoppedDependents.clear();
+        }
+
+        static void CheckServiceHealthInternal(std::type_index type, AService* service)
+        {
+            TickType_t now = xTaskGetTickCount();
+
+            if (service->_health == EServiceHealth::Degraded)
+            {
+                //Waiting for the backoff to elapse.
+                if ((service->RestartPolicy == ERestartPolicy::Restart || service->RestartPolicy == ERestartPolicy::RestartWithBackoff)
+                    && (int32_t)(now - service->_nextRestartAt) >= 0)
+                    RestartServiceInternal(service);
+                return;
+            }
+
+            if (service->_taskHandle == NULL)
+                return;
+
+            EServiceHealth health = EServiceHealth::Healthy;
+            if (service->_failed)
+                health = EServiceHealth::Exited;
+            else if (service->HeartbeatTimeout != 0 && eTaskGetState(service->_taskHandle) != eTaskState::eSuspended
+                && service->GetServiceHealth().lastHeartbeatAgeUs > pdTICKS_TO_MS(service->HeartbeatTimeout) * 1000)
+                health = EServiceHealth::Stalled;
+
+            if (health == EServiceHealth::Healthy)
+            {
+                //Once the service has stayed healthy for the maximum backoff, treat the next failure as a fresh one.
+                if (service->_consecutiveRestarts != 0 && now - service->_restartedAt > pdMS_TO_TICKS(service->RestartBackoffMaxMs))
+                {
+                    service->_consecutiveRestarts = 0;
+                    service->_backoffMs = 0;
+                }
+                return;
+            }
+
+            service->_health = health;
+            _failuresCounter.Increment();
+            LOGE(nameof(ServiceManager), "Service '%s' %s.", service->GetServiceName(), HealthToString(health));
+
+            if (service->RestartPolicy == ERestartPolicy::Escalate
+                || (service->MaxConsecutiveRestarts != 0 && service->_consecutiveRestarts >= service->MaxConsecutiveRestarts))
+            {
+                LOGE(nameof(ServiceManager), "Escalating failure of service '%s'.", service->GetServiceName());
+                abort();
+            }
+
+            //Dependents can't run without this service so stop them first, they are restarted alongside it.
+            StopDependentsInternal(type, service->_stoppedDependents);
+            StopServiceInternal(service);
+            service->_health = EServiceHealth::Degraded;
+
+            switch (service->RestartPolicy)
+            {
+            case ERestartPolicy::Restart:
+                RestartServiceInternal(service);
+                break;
+            case ERestartPolicy::RestartWithBackoff:
+                service->_backoffMs = service->_backoffMs == 0 ? service->RestartBackoffInitialMs : std::min(service->_backoffMs * 2, service->RestartBackoffMaxMs);
+                service->_nextRestartAt = now + pdMS_TO_TICKS(service->_backoffMs);
+                LOGW(nameof(ServiceManager), "Restarting service '%s' in %ums.", service->GetServiceName(), service->_backoffMs);
+                break;
+            default:
+                break;
+            }
+        }
+
+        static void HealthMonitorTask(void* param)
+        {
+            Event::CancellationTokenSource::SCancellationToken token = _healthMonitorCts->GetToken();
+            while (!token.WaitForCancellation(_healthMonitorInterval))
+                CheckServiceHealth();
+
+            _healthMonitorEnded.Set();
+            vTaskDelete(NULL);
+        }
 
         static AService* GetServiceInternal(std::type_index type)
         {
@@ -57,6 +221,14 @@ namespace ReadieFur::Service
             //It isn't possible for a circular dependency to exist here because this service doesn't exist in the list yet.
             AService* service = reinterpret_cast<AService*>(new T());
             service->_getServiceCallback = GetServiceInternal;
+
+            //Merge in any dependencies that were declared at compile time.
+            #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+            service->_dependencies = DependencyTable<typename ServiceDependencies<T>::Type>::Get();
+            #else
+            for (auto &&dependency : DependencyTable<typename ServiceDependencies<T>::Type>::Get())
+                service->_dependencies.insert(dependency);
+            #endif
             
             //Check if all dependencies are satisfied.
             std::vector<std::vector<AService*>*> dependenciesToAddTo;
@@ -76,7 +248,10 @@ namespace ReadieFur::Service
                 dependency->push_back(service);
 
             _services[std::type_index(typeid(T))] = service;
-            // _orderedServices.push_back(std::type_index(typeid(T)));
+            #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+            _orderedServices.push_back(std::type_index(typeid(T)));
+            #endif
+            _installedGauge.Add(1);
 
             _mutex.unlock();
             return EServiceResult::Ok;
@@ -112,7 +287,10 @@ namespace ReadieFur::Service
 
             delete service->second;
             _services.erase(std::type_index(typeid(T)));
-            // _orderedServices.erase(std::remove(_orderedServices.begin(), _orderedServices.end(), std::type_index(typeid(T))), _orderedServices.end());
+            #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+            _orderedServices.erase(std::remove(_orderedServices.begin(), _orderedServices.end(), std::type_index(typeid(T))), _orderedServices.end());
+            #endif
+            _installedGauge.Add(-1);
 
             _mutex.unlock();
             return EServiceResult::Ok;
@@ -146,7 +324,9 @@ namespace ReadieFur::Service
                 }
             }
 
+            int64_t startedAt = esp_timer_get_time();
             EServiceResult retVal = service->second->StartService();
+            _startLatency.Record(esp_timer_get_time() - startedAt);
 
             _mutex.unlock();
             return retVal;
@@ -228,8 +408,8 @@ namespace ReadieFur::Service
                 }
             }
 
-            //TODO: Currently this will only suspend the main task, if there are other tasks that are created by the service then they will not be suspended.
-            vTaskSuspend(service->second->_taskHandle);
+            //Suspends the main task along with any child tasks created through CreateServiceTask.
+            service->second->SuspendTasks();
 
             _mutex.unlock();
             return EServiceResult::Ok;
@@ -261,7 +441,7 @@ namespace ReadieFur::Service
 
             //No need to check on services that depend on this as they should already be stopped in this state.
 
-            vTaskResume(service->second->_taskHandle);
+            service->second->ResumeTasks();
 
             _mutex.unlock();
             return EServiceResult::Ok;
@@ -302,6 +482,74 @@ namespace ReadieFur::Service
             return retVal;
         }
 
+        /// @brief Checks every service for failures or missed heartbeats and applies its restart policy, dependents of a failed service are stopped and restarted with it.
+        /// @note This is called periodically by the health monitor but can also be called manually.
+        static void CheckServiceHealth()
+        {
+            _mutex.lock();
+            for (auto &&kvp : _services)
+                CheckServiceHealthInternal(kvp.first, kvp.second);
+            _mutex.unlock();
+        }
+
+        /// @brief Starts a task that periodically checks the health of all services. While running, services that return early are handled by their restart policy instead of aborting.
+        /// @param priority Should be higher than the monitored services so that a busy service can't starve the monitor.
+        /// @param stopTimeout How long a failed service is given to stop before it is forcefully stopped.
+        static EServiceResult StartHealthMonitor(TickType_t interval = pdMS_TO_TICKS(1000), UBaseType_t priority = configMAX_PRIORITIES * 0.2, uint32_t stackDepth = IDLE_TASK_STACK_SIZE + 1024, TickType_t stopTimeout = pdMS_TO_TICKS(1000))
+        {
+            _mutex.lock();
+
+            if (_healthMonitorTask != NULL)
+            {
+                _mutex.unlock();
+                return EServiceResult::Ok;
+            }
+
+            _healthMonitorInterval = interval;
+            _healthStopTimeout = stopTimeout;
+            _healthMonitorCts = new Event::CancellationTokenSource();
+            _healthMonitorEnded.Clear();
+
+            if (xTaskCreate(HealthMonitorTask, "svcHealth", stackDepth, NULL, priority, &_healthMonitorTask) != pdPASS)
+            {
+                delete _healthMonitorCts;
+                _healthMonitorCts = nullptr;
+                _healthMonitorTask = NULL;
+                _mutex.unlock();
+                return EServiceResult::Failed;
+            }
+            AService::_supervised = true;
+
+            _mutex.unlock();
+            return EServiceResult::Ok;
+        }
+
+        static EServiceResult StopHealthMonitor(TickType_t timeout = portMAX_DELAY)
+        {
+            _mutex.lock();
+
+            if (_healthMonitorTask == NULL)
+            {
+                _mutex.unlock();
+                return EServiceResult::Ok;
+            }
+
+            AService::_supervised = false;
+            _healthMonitorCts->Cancel();
+            _mutex.unlock();
+
+            //The lock is released while waiting as the monitor may be mid-check.
+            if (!_healthMonitorEnded.WaitOne(timeout))
+                return EServiceResult::Timeout;
+
+            _mutex.lock();
+            delete _healthMonitorCts;
+            _healthMonitorCts = nullptr;
+            _healthMonitorTask = NULL;
+            _mutex.unlock();
+            return EServiceResult::Ok;
+        }
+
         /// @brief Get a service list by dependencies, where the first service in the list is the one that must be started first/ended last and the last is the one that must be started last/ended first.
         //https://www.geeksforgeeks.org/topological-sorting-indegree-based-solution/
         //This algorithm wouldn't strictly be needed if I stored the services in a sorted order due to services having to be installed in the order of their dependencies, but it is good to have this anyway.
@@ -309,6 +557,10 @@ namespace ReadieFur::Service
         {
             _mutex.lock();
 
+            #ifdef _ENABLE_STATIC_SERVICE_GRAPH
+            //Installation requires dependencies to be installed first, so the installation order is already a valid start order (and the graph was checked for cycles at compile time).
+            std::vector<std::type_index> sortedOrder = _orderedServices;
+            #else
             std::map<std::type_index, std::vector<std::type_index>> dependencyGraph;
             std::unordered_map<std::type_index, int> inDegree;
             std::vector<std::type_index> sortedOrder;
@@ -355,6 +607,7 @@ namespace ReadieFur::Service
                 LOGE(nameof(ServiceManager), "Circular dependency detected.");
                 abort();
             }
+            #endif
 
             _mutex.unlock();
             return sortedOrder;
@@ -362,6 +615,18 @@ namespace ReadieFur::Service
     };
 };
 
-std::mutex ReadieFur::Service::ServiceManager::_mutex;
+ReadieFur::Diagnostic::ProfiledMutex ReadieFur::Service::ServiceManager::_mutex("ServiceManager");
+#ifdef _ENABLE_STATIC_SERVICE_GRAPH
+std::vector<std::type_index> ReadieFur::Service::ServiceManager::_orderedServices;
+#endif
 std::map<std::type_index, ReadieFur::Service::AService*> ReadieFur::Service::ServiceManager::_services;
 std::map<std::type_index, std::vector<ReadieFur::Service::AService*>> ReadieFur::Service::ServiceManager::_references;
+TaskHandle_t ReadieFur::Service::ServiceManager::_healthMonitorTask = NULL;
+ReadieFur::Event::CancellationTokenSource* ReadieFur::Service::ServiceManager::_healthMonitorCts = nullptr;
+ReadieFur::Event::AutoResetEvent ReadieFur::Service::ServiceManager::_healthMonitorEnded;
+TickType_t ReadieFur::Service::ServiceManager::_healthMonitorInterval = pdMS_TO_TICKS(1000);
+TickType_t ReadieFur::Service::ServiceManager::_healthStopTimeout = pdMS_TO_TICKS(1000);
+ReadieFur::Diagnostic::Gauge ReadieFur::Service::ServiceManager::_installedGauge("services_installed", "Services currently installed.");
+ReadieFur::Diagnostic::Counter ReadieFur::Service::ServiceManager::_failuresCounter("service_failures", "Services found exited or stalled by the health monitor.");
+ReadieFur::Diagnostic::Counter ReadieFur::Service::ServiceManager::_restartsCounter("service_restarts", "Service restarts attempted by the health monitor.");
+ReadieFur::Diagnostic::LatencyHistogram ReadieFur::Service::ServiceManager::_startLatency("service_start_us", "Time taken by ServiceManager::StartService to start a service in microseconds.");
@@ -1,6 +1,27 @@
 //Based on the stream debugger by Volodymyr Shymanskyy.
 
+#pragma once
+
 #include <Stream.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/ringbuf.h>
+#include <esp_timer.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "EStreamDumpFormat.h"
+
+#ifndef STREAM_DEBUGGER_CHUNK_SIZE
+#define STREAM_DEBUGGER_CHUNK_SIZE 64 //Bytes moving in the same direction are grouped into chunks of up to this size, each with a single timestamp.
+#endif
+
+#ifndef STREAM_DEBUGGER_CHUNK_GAP_US
+#define STREAM_DEBUGGER_CHUNK_GAP_US 1000 //A pause longer than this starts a new chunk.
+#endif
 
 class StreamDebugger : public Stream
 {
@@ -9,21 +30,94 @@ public:
 
 	StreamDebugger(Stream& dataStream, Stream* dumpStream) : _dataStream(dataStream), DumpStream(dumpStream) {}
 
+	~StreamDebugger()
+	{
+		StopAsyncDump();
+	}
+
+	/// @brief Captures the traffic into a buffer that a low priority task writes to the dump stream, so the data stream isn't slowed down by the dump stream.
+	/// @param bufferSize The capture buffer size in bytes, traffic is dropped (and reported) if the dump stream can't keep up.
+	bool StartAsyncDump(EStreamDumpFormat format = StreamDump_Annotated, size_t bufferSize = 4096, UBaseType_t priority = tskIDLE_PRIORITY + 1, uint32_t stackDepth = 3072)
+	{
+		if (_task != NULL)
+			return true;
+
+		_format = format;
+		_ring = xRingbufferCreate(bufferSize, RINGBUF_TYPE_NOSPLIT);
+		if (_ring == NULL)
+			return false;
+
+		_stopRequested = false;
+		TaskHandle_t task;
+		if (xTaskCreate(DumpTask, "streamDump", stackDepth, this, priority, &task) != pdPASS)
+		{
+			vRingbufferDelete(_ring);
+			_ring = NULL;
+			return false;
+		}
+		_task = task;
+		return true;
+	}
+
+	/// @brief Writes out the remaining captured traffic and returns to dumping synchronously.
+	void StopAsyncDump()
+	{
+		if (_task == NULL)
+			return;
+
+		_stopRequested = true;
+		while (_task != NULL)
+			vTaskDelay(1);
+
+		std::lock_guard<std::mutex> lock(_chunkMutex);
+		vRingbufferDelete(_ring);
+		_ring = NULL;
+		_chunkLength = 0;
+	}
+
+	/// @return The number of captured bytes that were dropped because the capture buffer was full.
+	uint32_t GetDroppedBytes()
+	{
+		return _droppedBytes.load(std::memory_order_relaxed);
+	}
+
+	using Print::write;
+	using Stream::readBytes;
+
 	virtual size_t write(uint8_t ch)
 	{
-		if (DumpStream != nullptr)
-			DumpStream->write(ch);
+		Capture(DIRECTION_WRITE, &ch, 1);
 		return _dataStream.write(ch);
 	}
 
+	virtual size_t write(const uint8_t* buffer, size_t size)
+	{
+		Capture(DIRECTION_WRITE, buffer, size);
+		return _dataStream.write(buffer, size);
+	}
+
 	virtual int read()
 	{
 		int ch = _dataStream.read();
-		if (ch != -1 && DumpStream != nullptr)
-			DumpStream->write(ch);
+		if (ch != -1)
+		{
+			uint8_t byte = ch;
+			Capture(DIRECTION_READ, &byte, 1);
+		}
 		return ch;
 	}
 
+	virtual size_t readBytes(char* buffer, size_t length)
+	{
+		//Use the timeout that was set on this stream rather than the data stream's, leaving the data stream's as it was for its other users.
+		unsigned long dataStreamTimeout = _dataStream.getTimeout();
+		_dataStream.setTimeout(_timeout);
+		size_t read = _dataStream.readBytes(buffer, length);
+		_dataStream.setTimeout(dataStreamTimeout);
+		Capture(DIRECTION_READ, (const uint8_t*)buffer, read);
+		return read;
+	}
+
 	virtual int available() { return _dataStream.available(); }
 
 	virtual int peek() { return _dataStream.peek(); }
@@ -31,5 +125,193 @@ public:
 	virtual void flush() { _dataStream.flush(); }
 
 private:
+	static constexpr uint8_t DIRECTION_WRITE = '>';
+	static constexpr uint8_t DIRECTION_READ = '<';
+	static constexpr TickType_t DUMP_INTERVAL = pdMS_TO_TICKS(20);
+
+	struct SChunk
+	{
+		int64_t timestamp; //When the first byte was captured.
+		uint8_t direction;
+		uint8_t data[STREAM_DEBUGGER_CHUNK_SIZE];
+	};
+
 	Stream& _dataStream;
+	EStreamDumpFormat _format = StreamDump_Raw;
+	RingbufHandle_t _ring = NULL;
+	std::atomic<TaskHandle_t> _task = NULL; //Cleared by the dump task as it exits, which StopAsyncDump waits for.
+	std::atomic<bool> _stopRequested = false;
+	std::atomic<uint32_t> _droppedBytes = 0;
+	//The chunk currently being built, bytes are gathered here so that single byte reads and writes don't each cost a ring buffer item.
+	std::mutex _chunkMutex;
+	SChunk _chunk;
+	size_t _chunkLength = 0;
+	int64_t _lastCapture = 0;
+
+	//Must be called with the chunk mutex held.
+	void CommitChunk()
+	{
+		if (_chunkLength == 0)
+			return;
+		if (xRingbufferSend(_ring, &_chunk, offsetof(SChunk, data) + _chunkLength, 0) != pdTRUE)
+			_droppedBytes.fetch_add(_chunkLength, std::memory_order_relaxed);
+		_chunkLength = 0;
+	}
+
+	void Capture(uint8_t direction, const uint8_t* data, size_t length)
+	{
+		if (DumpStream == nullptr || length == 0)
+			return;
+
+		int64_t now = esp_timer_get_time();
+		std::unique_lock<std::mutex> lock(_chunkMutex);
+		if (_ring == NULL)
+		{
+			//Synchronous dump, the original behaviour.
+			lock.unlock();
+			DumpStream->write(data, length);
+			return;
+		}
+
+		if (_chunkLength > 0 && (_chunk.direction != direction || now - _lastCapture > STREAM_DEBUGGER_CHUNK_GAP_US))
+			CommitChunk();
+		_lastCapture = now;
+
+		while (length > 0)
+		{
+			if (_chunkLength == 0)
+			{
+				_chunk.timestamp = now;
+				_chunk.direction = direction;
+			}
+
+			size_t count = std::min(length, sizeof(_chunk.data) - _chunkLength);
+			memcpy(_chunk.data + _chunkLength, data, count);
+			_chunkLength += count;
+			data += count;
+			length -= count;
+
+			if (_chunkLength == sizeof(_chunk.data))
+				CommitChunk();
+		}
+	}
+
+	void WriteLine(char* line, size_t& length)
+	{
+		if (length == 0)
+			return;
+		line[length++] = '\n';
+		DumpStream->write((const uint8_t*)line, length);
+		length = 0;
+	}
+
+	size_t WriteHeader(char* line, size_t size, const SChunk& chunk)
+	{
+		int length = snprintf(line, size, "[%6u.%06u] %c ", (unsigned)(chunk.timestamp / 1000000), (unsigned)(chunk.timestamp % 1000000), chunk.direction);
+		return length < 0 ? 0 : std::min<size_t>(length, size - 1);
+	}
+
+	void DumpChunk(const SChunk& chunk, size_t length)
+	{
+		if (_format == StreamDump_Raw)
+		{
+			DumpStream->write(chunk.data, length);
+			return;
+		}
+
+		static const char hexDigits[] = "0123456789ABCDEF";
+		char line[24 + 16 * 3 + 1];
+		size_t lineLength = 0;
+		size_t bytesOnLine = 0;
+
+		for (size_t i = 0; i < length; i++)
+		{
+			if (lineLength == 0)
+			{
+				lineLength = WriteHeader(line, sizeof(line), chunk);
+				bytesOnLine = 0;
+			}
+
+			uint8_t byte = chunk.data[i];
+			if (_format == StreamDump_Hex)
+			{
+				line[lineLength++] = hexDigits[byte >> 4];
+				line[lineLength++] = hexDigits[byte & 0xF];
+				line[lineLength++] = ' ';
+				if (++bytesOnLine == 16)
+					WriteLine(line, lineLength);
+				continue;
+			}
+
+			//Annotated, printable characters as they are and everything else escaped, with a new line after each line feed in the data.
+			if (byte >= ' ' && byte <= '~' && byte != '\\')
+			{
+				line[lineLength++] = byte;
+			}
+			else
+			{
+				line[lineLength++] = '\\';
+				switch (byte)
+				{
+				case '\r': line[lineLength++] = 'r'; break;
+				case '\n': line[lineLength++] = 'n'; break;
+				case '\t': line[lineLength++] = 't'; break;
+				case '\\': line[lineLength++] = '\\'; break;
+				default:
+					line[lineLength++] = 'x';
+					line[lineLength++] = hexDigits[byte >> 4];
+					line[lineLength++] = hexDigits[byte & 0xF];
+					break;
+				}
+			}
+			if (byte == '\n' || lineLength >= sizeof(line) - 5)
+				WriteLine(line, lineLength);
+		}
+		WriteLine(line, lineLength);
+	}
+
+	static void DumpTask(void* param)
+	{
+		StreamDebugger* self = static_cast<StreamDebugger*>(param);
+		uint32_t reportedDroppedBytes = 0;
+
+		while (true)
+		{
+			bool stopping = self->_stopRequested.load();
+
+			size_t size;
+			SChunk* chunk = (SChunk*)xRingbufferReceive(self->_ring, &size, stopping ? 0 : DUMP_INTERVAL);
+			if (chunk != NULL)
+			{
+				self->DumpChunk(*chunk, size - offsetof(SChunk, data));
+				vRingbufferReturnItem(self->_ring, chunk);
+				continue;
+			}
+
+			//Nothing queued, commit the chunk that is being built if the stream has gone quiet.
+			{
+				std::lock_guard<std::mutex> lock(self->_chunkMutex);
+				if (self->_chunkLength > 0 && (stopping || esp_timer_get_time() - self->_lastCapture > STREAM_DEBUGGER_CHUNK_GAP_US))
+				{
+					self->CommitChunk();
+					continue;
+				}
+			}
+
+			uint32_t droppedBytes = self->_droppedBytes.load(std::memory_order_relaxed);
+			if (droppedBytes != reportedDroppedBytes)
+			{
+				char line[48];
+				int length = snprintf(line, sizeof(line), "[StreamDebugger] %u bytes dropped.\n", (unsigned)(droppedBytes - reportedDroppedBytes));
+				self->DumpStream->write((const uint8_t*)line, std::min<size_t>(length, sizeof(line) - 1));
+				reportedDroppedBytes = droppedBytes;
+			}
+
+			if (stopping)
+				break;
+		}
+
+		self->_task = NULL;
+		vTaskDelete(NULL);
+	}
 };
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <type_traits>
+
+namespace ReadieFur
+{
+    template <typename... Types>
+    struct TypeList
+    {
+        static constexpr size_t Count = sizeof...(Types);
+
+        template <typename T>
+        static constexpr bool Contains = (std::is_same<T, Types>::value || ...);
+    };
+};
@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+"""Decodes the binary log frames written when the library is built with _ENABLE_BINARY_LOG.
+
+The firmware only records the addresses of the format string and tag along with the raw
+arguments (see src/Logging/BinaryLogEncoder.hpp), the strings are looked up in the ELF file
+that was flashed and the message is formatted here instead. Any bytes that are not part of a
+frame (boot messages, panics, output from other libraries) are passed through unchanged.
+
+On the console every CR, LF and 0xDB byte of a frame is escaped as 0xDB followed by the byte
+XORed with 0x20, so that newlib's line ending translation can't alter the frame. Raw frames
+(e.g. read back from the flash log) can be decoded with --raw.
+
+Usage:
+    stty -F /dev/ttyUSB0 115200 raw
+    python3 tools/log_decoder.py .pio/build/esp32dev/firmware.elf /dev/ttyUSB0
+    python3 tools/log_decoder.py firmware.elf capture.bin
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+SYNC = b"\xA5\x5A"
+ESCAPE = 0xDB
+ESCAPE_XOR = 0x20
+HEADER = struct.Struct("<2sHBBIII")
+TRUNCATED_FLAG = 0x80
+MAX_PAYLOAD = 4096
+LEVELS = {1: "E", 2: "W", 3: "I", 4: "D", 5: "V"}
+COLOURS = {1: "31", 2: "33", 3: "32"}
+
+SHT_NOBITS = 8
+SHF_ALLOC = 0x2
+
+#%[flags][width][.precision][length]conversion
+FORMAT_SPEC = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|j|z|t|L)?([diouxXcsSpneEfFgGaA%])")
+
+
+class Elf:
+    """Reads the allocated sections of an ELF file so that strings can be looked up by their runtime address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as file:
+            self.data = file.read()
+        if self.data[:4] != b"\x7fELF":
+            raise ValueError(f"{path} is not an ELF file")
+
+        is64 = self.data[4] == 2
+        endian = "<" if self.data[5] == 1 else ">"
+        if is64:
+            shoff, = struct.unpack_from(endian + "Q", self.data, 0x28)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x3A)
+            section = struct.Struct(endian + "IIQQQQIIQQ")
+        else:
+            shoff, = struct.unpack_from(endian + "I", self.data, 0x20)
+            shentsize, shnum = struct.unpack_from(endian + "HH", self.data, 0x2E)
+            section = struct.Struct(endian + "IIIIIIIIII")
+
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, sh_flags, sh_addr, sh_offset, sh_size, *_ = section.unpack_from(self.data, shoff + i * shentsize)
+            if sh_flags & SHF_ALLOC and sh_type != SHT_NOBITS and sh_size > 0:
+                self.sections.append((sh_addr, sh_size, sh_offset))
+        self.cache = {}
+
+    def string_at(self, address):
+        if address in self.cache:
+            return self.cache[address]
+        result = None
+        for start, size, offset in self.sections:
+            if start <= address < start + size:
+                begin = offset + address - start
+                end = self.data.find(b"\0", begin, offset + size)
+                if end >= 0:
+                    result = self.data[begin:end].decode("utf-8", "replace")
+                break
+        self.cache[address] = result
+        return result
+
+
+class Arguments:
+    def __init__(self, payload):
+        self.payload = payload
+        self.offset = 0
+
+    def take(self, fmt):
+        size = struct.calcsize(fmt)
+        if self.offset + size > len(self.payload):
+            raise EOFError
+        value, = struct.unpack_from(fmt, self.payload, self.offset)
+        self.offset += size
+        return value
+
+    def take_string(self):
+        length = self.take("<B")
+        if self.offset + length > len(self.payload):
+            raise EOFError
+        value = self.payload[self.offset:self.offset + length].decode("utf-8", "replace")
+        self.offset += length
+        return value
+
+
+def format_message(fmt, payload):
+    """Applies the printf format to the encoded arguments, the argument sizes are inferred from the conversion specifiers."""
+    args = Arguments(payload)
+    out = []
+    position = 0
+    try:
+        for match in FORMAT_SPEC.finditer(fmt):
+            out.append(fmt[position:match.start()])
+            position = match.end()
+            flags, width, precision, length, conversion = match.groups()
+
+            if conversion == "%":
+                out.append("%")
+                continue
+            if width == "*":
+                width = str(args.take("<i"))
+            if precision == "*":
+                precision = str(args.take("<i"))
+
+            wide = length in ("ll", "j")
+            if conversion in "di":
+                value = args.take("<q" if wide else "<i")
+            elif conversion in "ouxX":
+                value = args.take("<Q" if wide else "<I")
+            elif conversion == "c":
+                value = chr(args.take("<I") & 0xFF)
+            elif conversion in "eEfFgGaA":
+                value = args.take("<d")
+            elif conversion in "sS":
+                value = args.take_string()
+            elif conversion == "p":
+                value = args.take("<I")
+                out.append(f"0x{value:x}")
+                continue
+            else:
+                #%n writes nothing out and isn't encoded.
+                continue
+
+            if conversion in "aA":
+                out.append(float.hex(value))
+                continue
+            spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "")
+            spec += {"i": "d", "F": "f"}.get(conversion, conversion)
+            out.append(spec % value)
+    except EOFError:
+        out.append("<missing arguments>")
+        return "".join(out)
+
+    out.append(fmt[position:])
+    return "".join(out)
+
+
+class Decoder:
+    def __init__(self, elf, output, colour, show_core, escaped=True):
+        self.elf = elf
+        self.output = output
+        self.colour = colour
+        self.show_core = show_core
+        self.escaped = escaped
+        self.buffer = bytearray()
+
+    def unescape(self, count):
+        """Reads count frame bytes from the start of the buffer.
+        Returns the bytes and the number of buffer bytes they took, or None if more data is needed."""
+        if not self.escaped:
+            return (bytes(self.buffer[:count]), count) if len(self.buffer) >= count else None
+        out = bytearray()
+        offset = 0
+        while len(out) < count:
+            if offset >= len(self.buffer):
+                return None
+            value = self.buffer[offset]
+            offset += 1
+            if value == ESCAPE:
+                if offset >= len(self.buffer):
+                    return None
+                value = self.buffer[offset] ^ ESCAPE_XOR
+                offset += 1
+            out.append(value)
+        return bytes(out), offset
+
+    def write_text(self, data):
+        if data:
+            self.output.write(data.decode("utf-8", "replace"))
+
+    def write_frame(self, level, core, timestamp, message, tag):
+        line = f"{LEVELS[level]} ({timestamp})"
+        if self.show_core:
+            line += f" [{core}]"
+        line += f" {tag}: {message}"
+        if self.colour and level in COLOURS:
+            line = f"\033[0;{COLOURS[level]}m{line}\033[0m"
+        self.output.write(line + "\n")
+
+    def try_decode(self):
+        """Decodes the frame at the start of the buffer.
+        Returns the number of bytes consumed, 0 if more data is needed or -1 if it isn't a valid frame."""
+        header = self.unescape(HEADER.size)
+        if header is None:
+            return 0
+        _, length, level_byte, core, timestamp, format_address, tag_address = HEADER.unpack_from(header[0])
+        level = level_byte & ~TRUNCATED_FLAG
+        if level not in LEVELS or length > MAX_PAYLOAD:
+            return -1
+        fmt = self.elf.string_at(format_address)
+        if fmt is None:
+            return -1
+        frame = self.unescape(HEADER.size + length)
+        if frame is None:
+            return 0
+
+        payload = frame[0][HEADER.size:]
+        tag = self.elf.string_at(tag_address) or f"0x{tag_address:08x}"
+        message = format_message(fmt, payload)
+        if level_byte & TRUNCATED_FLAG:
+            message += " <truncated>"
+        self.write_frame(level, core, timestamp, message, tag)
+        return frame[1]
+
+    def feed(self, data):
+        self.buffer += data
+        while self.buffer:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                #Keep a trailing first sync byte in case the rest of the marker is in the next read.
+                keep = 1 if self.buffer[-1:] == SYNC[:1] else 0
+                self.write_text(bytes(self.buffer[:len(self.buffer) - keep]))
+                del self.buffer[:len(self.buffer) - keep]
+                break
+
+            self.write_text(bytes(self.buffer[:start]))
+            del self.buffer[:start]
+
+            consumed = self.try_decode()
+            if consumed == 0:
+                break
+            if consumed < 0:
+                self.write_text(bytes(self.buffer[:1]))
+                consumed = 1
+            del self.buffer[:consumed]
+        self.output.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode binary log frames using the firmware ELF file.")
+    parser.add_argument("elf", help="The ELF file of the firmware that produced the log.")
+    parser.add_argument("input", nargs="?", help="A capture file or serial device, defaults to stdin.")
+    parser.add_argument("--colour", action="store_true", help="Colour the output by level like the ESP-IDF logger.")
+    parser.add_argument("--core", action="store_true", help="Show the core that each message was logged from.")
+    parser.add_argument("--raw", action="store_true", help="The frames are not escaped, i.e. they weren't captured from the console.")
+    args = parser.parse_args()
+
+    decoder = Decoder(Elf(args.elf), sys.stdout, args.colour, args.core, not args.raw)
+    source = open(args.input, "rb", buffering=0) if args.input else sys.stdin.buffer
+    try:
+        while True:
+            data = source.read1(4096) if hasattr(source, "read1") else source.read(4096)
+            if not data:
+                break
+            decoder.feed(data)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if source is not sys.stdin.buffer:
+            source.close()
+    decoder.write_text(bytes(decoder.buffer))
+
+
+if __name__ == "__main__":
+    main()